@@ -22,10 +22,31 @@
  *
  *------------------------------------------------------------------------------
  */
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <opencv2/imgproc/imgproc.hpp>
+
 #include "camera.h"
 
 namespace sentry {
 
+/** number of frames to remember the dirty tiles of */
+static const unsigned int tile_history_size = 64;
+
+/** nanoseconds in a second */
+static const long nsec_per_sec = 1000000000L;
+
+/**
+ * Milliseconds from since to now
+ */
+static long
+elapsed_msec (const struct timespec &since, const struct timespec &now)
+{
+    return (now.tv_sec - since.tv_sec) * 1000 + (now.tv_nsec - since.tv_nsec) / 1000000;
+}
+
 /**
  * Camera constructor
  */
@@ -41,20 +62,116 @@ Camera::Camera (void)
 
     /* initialize members */
     pthread_mutex_init(&mutex, NULL);
+    pthread_mutex_init(&frame_mutex, NULL);
+    running = false;
+    frames = new FramePool();
+    latest = NULL;
+    seq = 1;
     clients.clear();
-    frame_params.clear();
-    frame_params.push_back(CV_IMWRITE_JPEG_QUALITY);
-    frame_params.push_back(config->get_int("quality"));
+    parse_tiers();
+
+    /* unchanged frames are not published if motion detection is enabled */
+    motion = NULL;
+    if (config->get_bool("motion")) {
+        motion = new MotionDetector(config);
+    }
+    int period = config->get_int("motion_keepalive");
+    keepalive.tv_sec = (period > 0) ? period : 1;
+    keepalive.tv_nsec = 0;
+
+    /* changed tiles are tracked for delta streams if tiles are configured */
+    tiles = NULL;
+    if (config->get_int("tile_size") > 0) {
+        tiles = new TileDetector(config);
+    }
+    dirty_tiles.resize(tile_history_size);
+    dirty_next = 0;
+    dirty_count = 0;
+
+    /* libjpeg strip encoder unless OpenCV's encoder is asked for */
+    encoder = NULL;
+    if ("opencv" != config->get_string("encoder")) {
+        encoder_options_st options;
+        options.subsampling = config->get_int("subsampling");
+        options.fast_dct = config->get_bool("fast_dct");
+        options.optimize = config->get_bool("optimize");
+        encoder = new JpegEncoder(config->get_int("encode_threads"), options);
+    }
+    encode_count = 0;
+    encode_usec = 0;
+
+    /* the camera is kept warm for "linger" seconds after the last client */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wake, &attr);
+    pthread_cond_init(&published, &attr);
+    pthread_condattr_destroy(&attr);
+    idle = false;
+    linger = std::max(0, config->get_int("linger"));
+    always_warm = config->get_bool("always_warm");
+    float warm_fps = config->get_float("warm_fps");
+    first_pending = false;
+    reconfigured = false;
+    last_published.tv_sec = 0;
+    last_published.tv_nsec = 0;
+
+    /* the pre-event ring needs the camera running all the time */
+    ring = NULL;
+    if (config->get_bool("ring")) {
+        ring = new FrameRing(config);
+        ring_variant = get_tier(config->get_int("ring_tier"));
+        always_warm = true;
+        if (config->get_float("ring_fps") > 0) {
+            warm_fps = config->get_float("ring_fps");
+        }
+    }
+
+    /* so does the recorder, at the higher of the two rates */
+    recorder = NULL;
+    recording = config->get_bool("record");
+    if (recording) {
+        record_variant = get_tier(config->get_int("record_tier"));
+        always_warm = true;
+        warm_fps = std::max(warm_fps, config->get_float("record_fps"));
+    }
+
+    /* the recorder's thread writes the ring dumps too */
+    if (recording || (NULL != ring)) {
+        recorder = new Recorder();
+    }
+    warm_period = (long)(nsec_per_sec / ((warm_fps > 0) ? warm_fps : 1));
 
     /* configure the camera */
-    device = new raspicam::RaspiCam_Cv;
-    device->set(CV_CAP_PROP_FRAME_WIDTH, config->get_int("cols"));
-    device->set(CV_CAP_PROP_FRAME_HEIGHT, config->get_int("rows"));
-    device->set(CV_CAP_PROP_FORMAT, CV_8UC3);
-    device->set(CV_CAP_PROP_BRIGHTNESS, 50);
-    device->set(CV_CAP_PROP_CONTRAST, 50);
-    device->set(CV_CAP_PROP_SATURATION, 50);
-    device->set(CV_CAP_PROP_GAIN, 50);
+    device = CameraDevice::create(config);
+    on_msec = 0;
+    mode.cols = config->get_int("cols");
+    mode.rows = config->get_int("rows");
+    mode.fps = config->get_float("fps");
+    mode.subsampling = (NULL != encoder) ? encoder->get_options().subsampling : 0;
+    mode.fast_dct = (NULL != encoder) ? (encoder->get_options().fast_dct ? 1 : -1) : 0;
+
+    /* an always warm camera is opened right away */
+    if (always_warm) {
+        pthread_mutex_lock(&mutex);
+        if (open_device()) {
+            dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_CAMERA,
+                 "keeping camera warm");
+            idle = true;
+            clock_gettime(CLOCK_MONOTONIC, &idle_since);
+            start();
+        } else {
+            dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_CAMERA,
+                 "unable to open camera");
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+    /* the timelapse takes the camera every now and then, like a client */
+    timelapse = NULL;
+    if (framework::Config("timelapse").get_bool("enable")) {
+        timelapse = new Timelapse(this);
+    }
 }
 
 /**
@@ -65,18 +182,29 @@ Camera::~Camera (void)
     dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_CAMERA,
          "destroying camera");
 
+    /* the timelapse must not reserve the camera anymore */
+    delete timelapse;
+
     /* let go of the camera */
     pthread_mutex_lock(&mutex);
     clients.clear();
-    if (device->isOpened()) {
-        device->release();
-    }
+    stop();
+    close_device();
     pthread_mutex_unlock(&mutex);
 
     /* cleanup members */
     pthread_mutex_destroy(&mutex);
-    delete config;
+    pthread_mutex_destroy(&frame_mutex);
+    pthread_cond_destroy(&wake);
+    pthread_cond_destroy(&published);
+    delete motion;
+    delete tiles;
+    delete encoder;
+    delete recorder;
+    delete ring;
+    delete frames;
     delete device;
+    delete config;
 }
 
 /**
@@ -86,6 +214,9 @@ Camera::~Camera (void)
  * camera remembers who has access to it. We assume the same client does not
  * call open() multiple times, without calling release() first, but it's not
  * enforced in the camera object.
+ *
+ * If the camera is still warm, the camera thread is woken up to capture at
+ * full rate again. The time to the first frame is logged either way.
  */
 void
 Camera::reserve (const int client_id)
@@ -93,17 +224,33 @@ Camera::reserve (const int client_id)
     dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_CAMERA,
          "client (" << client_id << ") requesting camera stream");
 
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
     pthread_mutex_lock(&mutex);
-    if (!device->isOpened()) {
-        device->open();
-        if (!device->isOpened()) {
+    if (!device->is_open()) {
+        if (!open_device()) {
             dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_CAMERA,
                  "unable to open camera");
             pthread_mutex_unlock(&mutex);
             return;
         }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_CAMERA,
+             "camera opened in " << elapsed_msec(begin, now) << " ms");
     }
     clients.push_back(client_id);
+    if (1 == clients.size()) {
+        pthread_mutex_lock(&frame_mutex);
+        idle = false;
+        reserved_at = begin;
+        first_pending = true;
+        reconfigured = false;
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&frame_mutex);
+    }
+    start();
     pthread_mutex_unlock(&mutex);
 }
 
@@ -111,10 +258,14 @@ Camera::reserve (const int client_id)
  * Release camera
  *
  * Client no longer wants to stream camera frames, thus we remove the client ID.
- * The camera is stopped if there are no more clients.
+ * If there are no more clients, the camera thread keeps the camera warm for
+ * "linger" seconds (or forever with "always_warm"), capturing "warm_fps"
+ * frames per second, and closes it if nobody showed up in the meantime. With
+ * a linger of 0, or if the client doesn't want it kept warm, the camera thread
+ * and the camera are stopped right away, unless the camera is always warm.
  */
 void
-Camera::release (const int client_id)
+Camera::release (const int client_id, const bool warm)
 {
     pthread_mutex_lock(&mutex);
     for (std::vector<int>::iterator i = clients.begin(); i != clients.end(); i++) {
@@ -122,10 +273,18 @@ Camera::release (const int client_id)
             dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_CAMERA,
                  "client (" << client_id << ") released camera");
             clients.erase(i);
-            if (!clients.size()) {
+            if (!clients.size() && running && (always_warm || (warm && (linger > 0)))) {
+                dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_CAMERA,
+                     "no more clients, keeping camera warm");
+                pthread_mutex_lock(&frame_mutex);
+                idle = true;
+                clock_gettime(CLOCK_MONOTONIC, &idle_since);
+                pthread_mutex_unlock(&frame_mutex);
+            } else if (!clients.size()) {
                 dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_CAMERA,
                      "no more clients");
-                device->release();
+                stop();
+                close_device();
             }
             break;
         }
@@ -134,46 +293,902 @@ Camera::release (const int client_id)
 }
 
 /**
- * Capture a frame and encode it into a JPEG image
+ * Get the latest frame if it is newer than last_seq
+ *
+ * Never blocks: clients poll for frames at their own pace. The frame is
+ * returned with a reference taken on behalf of the caller, who must drop it
+ * with put().
+ *
+ * The latest frame is a single slot cache, read without any lock: a reader
+ * takes a reference if the frame is still alive, then checks that the slot
+ * didn't move on meanwhile, and tries again if it did. As long as the camera
+ * runs (or is kept warm), a new client gets the cached frame right away, with
+ * whatever encodings it already has, instead of waiting for the next capture.
+ */
+Frame*
+Camera::get_frame (const uint32_t last_seq)
+{
+    while (true) {
+        Frame *frame = latest.load(std::memory_order_acquire);
+        if (NULL == frame) {
+            return NULL;
+        }
+        if (frame->try_get()) {
+            if (frame == latest.load(std::memory_order_acquire)) {
+                if (frame->get_seq() == last_seq) {
+                    frame->put();
+                    return NULL;
+                }
+                return frame;
+            }
+            frame->put();
+        }
+    }
+}
+
+/**
+ * Wait for a frame captured at or after the given time, NULL at the deadline
+ *
+ * The caller must have the camera reserved. The frame is returned with a
+ * reference taken on behalf of the caller, like get_frame() does.
+ */
+Frame*
+Camera::wait_frame (const struct timespec &after, const struct timespec &deadline)
+{
+    Frame *frame = NULL;
+
+    pthread_mutex_lock(&frame_mutex);
+    while (true) {
+        frame = get_frame(0);
+        if (NULL != frame) {
+            const struct timespec &time = frame->get_time();
+            if ((time.tv_sec > after.tv_sec) ||
+                ((time.tv_sec == after.tv_sec) && (time.tv_nsec >= after.tv_nsec))) {
+                break;
+            }
+            frame->put();
+            frame = NULL;
+        }
+        if (ETIMEDOUT == pthread_cond_timedwait(&published, &frame_mutex, &deadline)) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&frame_mutex);
+
+    return frame;
+}
+
+/**
+ * Encode a frame (or a tile of it) with the given parameters, unless already done
+ *
+ * The encoding is cached in the frame, so every client asking for the same
+ * variant of the same frame shares a single encode. The encoding slot keeps
+ * its buffers from earlier frames, so once they have grown to size, encoding
+ * with the strip encoder doesn't allocate. Tiles are cut from the
+ * full resolution image, and scaled with the same rounding as the whole frame,
+ * so scaled tiles line up with the scaled frame. Returns NULL if the frame
+ * could not be encoded.
+ *
+ * I420 frames are cut, scaled and encoded plane by plane, without ever being
+ * converted to BGR, unless the OpenCV encoder is used.
+ *
+ * Whole frame variants may ask for a region of interest, which is cut out
+ * (on even pixels, for the sake of the chroma planes) and scaled to the
+ * output size before the encode, up to the full resolution of the frame.
+ * Clients with the same region of interest share the encode, like any other
+ * variant. Tiles always come from the whole frame.
+ */
+const frame_encoding_st*
+Camera::encode (Frame *frame, const frame_variant_st &variant, const int tile)
+{
+    frame->lock();
+    frame_encoding_st *encoding = frame->find_encoding(variant, tile);
+    if (NULL == encoding) {
+        encoding = frame->add_encoding(variant, tile);
+
+        /* cut out the tile or the region of interest if needed */
+        cv::Rect whole(0, 0, frame->get_cols(), frame->get_rows());
+        cv::Rect rect = whole;
+        cv::Rect scaled_rect;
+        int s = variant.scale;
+        if ((tile >= 0) && (NULL != tiles)) {
+            rect = tiles->get_rect(frame->get_cols(), frame->get_rows(), tile);
+            scaled_rect = cv::Rect(rect.x / s, rect.y / s,
+                                   (rect.x + rect.width) / s - rect.x / s,
+                                   (rect.y + rect.height) / s - rect.y / s);
+        } else {
+            cv::Rect roi(variant.roi.x & ~1, variant.roi.y & ~1,
+                         variant.roi.width & ~1, variant.roi.height & ~1);
+            roi &= whole;
+            if (roi.area() > 0) {
+                rect = roi;
+            }
+            cv::Size size = (variant.size.area() > 0) ? variant.size : rect.size();
+            scaled_rect = cv::Rect(0, 0, std::min(size.width / s, whole.width),
+                                   std::min(size.height / s, whole.height));
+        }
+        bool resize = (scaled_rect.width != rect.width) ||
+                      (scaled_rect.height != rect.height);
+        int interpolation = ((scaled_rect.width <= rect.width) &&
+                             (scaled_rect.height <= rect.height)) ?
+                            cv::INTER_AREA : cv::INTER_LINEAR;
+        const unsigned char *buffer = encoding->scaled.data;
+        bool planar = (FRAME_FORMAT_I420 == frame->get_format()) && (NULL != encoder);
+        cv::Mat scaled;
+        cv::Mat planes[3];
+        if (planar) {
+            /* scale each plane first if needed, into the slot's own buffer */
+            frame->get_planes(planes);
+            planes[0] = planes[0](rect);
+            for (int c = 1; c < 3; c++) {
+                planes[c] = planes[c](cv::Rect(rect.x / 2, rect.y / 2,
+                                               (rect.x + rect.width + 1) / 2 - rect.x / 2,
+                                               (rect.y + rect.height + 1) / 2 - rect.y / 2));
+            }
+            if (resize && (scaled_rect.area() > 0)) {
+                cv::Size luma = scaled_rect.size();
+                cv::Size chroma((luma.width + 1) / 2, (luma.height + 1) / 2);
+                encoding->scaled.create(1, luma.area() + 2 * chroma.area(), CV_8UC1);
+                unsigned char *data = encoding->scaled.ptr();
+                cv::Mat target[3] = {
+                    cv::Mat(luma, CV_8UC1, data),
+                    cv::Mat(chroma, CV_8UC1, data + luma.area()),
+                    cv::Mat(chroma, CV_8UC1, data + luma.area() + chroma.area())};
+                for (int c = 0; c < 3; c++) {
+                    cv::resize(planes[c], target[c], target[c].size(), 0, 0,
+                               interpolation);
+                    planes[c] = target[c];
+                }
+            }
+        } else {
+            /* scale first if needed, into the slot's own buffer */
+            scaled = frame->get_bgr()(rect);
+            if (resize && (scaled_rect.area() > 0)) {
+                cv::resize(scaled, encoding->scaled, scaled_rect.size(), 0, 0,
+                           interpolation);
+                scaled = encoding->scaled;
+            }
+        }
+        if (encoding->scaled.data != buffer) {
+            frame_count_alloc();
+        }
+        size_t capacity = encoding->data.capacity();
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bool ok = false;
+        if ((scaled_rect.area() > 0) && planar) {
+            const unsigned char *const data[3] = {
+                planes[0].ptr(), planes[1].ptr(), planes[2].ptr()};
+            const int steps[3] = {(int)planes[0].step, (int)planes[1].step,
+                                  (int)planes[2].step};
+            ok = encoder->encode_yuv(data, steps, scaled_rect.width, scaled_rect.height,
+                                     variant.quality, encoding->data);
+        } else if ((scaled_rect.area() > 0) && (NULL != encoder)) {
+            ok = encoder->encode(scaled.ptr(), scaled.cols, scaled.rows, scaled.step,
+                                 scaled.channels(), variant.quality, encoding->data);
+        } else if (scaled_rect.area() > 0) {
+            std::vector<int> params;
+            params.push_back(CV_IMWRITE_JPEG_QUALITY);
+            params.push_back(variant.quality);
+            ok = cv::imencode(".jpg", scaled, encoding->data, params);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        encoding->encode_usec = (end.tv_sec - start.tv_sec) * 1000000 +
+                                (end.tv_nsec - start.tv_nsec) / 1000;
+        if (encoding->data.capacity() != capacity) {
+            frame_count_alloc();
+        }
+        if (ok && (tile < 0)) {
+            record_encode_time(encoding->encode_usec);
+        }
+        if (ok) {
+            encoding->x = scaled_rect.x;
+            encoding->y = scaled_rect.y;
+            encoding->cols = scaled_rect.width;
+            encoding->rows = scaled_rect.height;
+        } else {
+            encoding->data.clear();
+        }
+
+        dbug(DEBUG_LEVEL_VERY_VERBOSE, DEBUG_TYPE_CAMERA,
+             "encoded frame " << frame->get_seq() << " tile " << tile << " scale 1/" <<
+             variant.scale << " quality " << variant.quality << ", size " <<
+             encoding->data.size() << " bytes in " << encoding->encode_usec << " us");
+    }
+    frame->unlock();
+
+    if (encoding->data.empty()) {
+        return NULL;
+    }
+    return encoding;
+}
+
+/**
+ * Record the encode time of a whole frame
+ *
+ * The average is logged every stats_interval encodes, to compare the encoder
+ * backends and settings on the real hardware.
  */
 void
-Camera::get_image (std::vector<unsigned char> &buf)
+Camera::record_encode_time (const unsigned long usec)
 {
-    if (!device->isOpened()) {
-        return;
+    static const unsigned long stats_interval = 100;
+
+    encode_usec.fetch_add(usec, std::memory_order_relaxed);
+    if (0 == (encode_count.fetch_add(1, std::memory_order_relaxed) + 1) % stats_interval) {
+        unsigned long total = encode_usec.exchange(0, std::memory_order_relaxed);
+        (void) total;
+        dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_CAMERA,
+             ((NULL != encoder) ? "libjpeg" : "opencv") << " encoder averaged " <<
+             total / stats_interval << " us per frame over " << stats_interval << " frames");
+    }
+}
+
+/**
+ * Number of tiles of a frame, 0 if tile detection is disabled
+ */
+int
+Camera::get_tile_count (const Frame *frame) const
+{
+    if (NULL == tiles) {
+        return 0;
+    }
+    return tiles->get_count(frame->get_cols(), frame->get_rows());
+}
+
+/**
+ * Tiles that changed after frame since up to frame until
+ *
+ * The result is the union of the dirty tiles of every frame in between, which
+ * is what a client that has frame since needs to catch up with frame until.
+ * Returns false if the history doesn't go back that far, the client needs a
+ * whole frame in that case.
+ */
+bool
+Camera::get_dirty_tiles (const uint32_t since, const uint32_t until,
+                         std::vector<uint8_t> &dirty)
+{
+    bool found = false;
+    unsigned int size = dirty_tiles.size();
+
+    dirty.clear();
+    pthread_mutex_lock(&frame_mutex);
+    unsigned int oldest = (dirty_next + size - dirty_count) % size;
+    if ((0 != since) && (0 != dirty_count) &&
+        ((int32_t)(dirty_tiles[oldest].first - since) <= 1)) {
+        for (unsigned int n = 0; n < dirty_count; n++) {
+            const std::pair<uint32_t, std::vector<uint8_t> > &entry =
+                dirty_tiles[(oldest + n) % size];
+            if (((int32_t)(entry.first - since) <= 0) ||
+                ((int32_t)(entry.first - until) > 0)) {
+                continue;
+            }
+            if (dirty.size() != entry.second.size()) {
+                if (!dirty.empty()) {
+                    /* resolution changed on the way */
+                    break;
+                }
+                dirty.assign(entry.second.size(), 0);
+            }
+            for (unsigned int i = 0; i < dirty.size(); i++) {
+                dirty[i] |= entry.second[i];
+            }
+            if (entry.first == until) {
+                found = true;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&frame_mutex);
+
+    return found;
+}
+
+/**
+ * Number of encoding tiers
+ */
+int
+Camera::get_tier_count (void) const
+{
+    return tiers.size();
+}
+
+/**
+ * Encoding variant of the given tier, the first tier for invalid indexes
+ */
+frame_variant_st
+Camera::get_tier (const int tier) const
+{
+    if ((tier < 0) || (tier >= (int)tiers.size())) {
+        return tiers[0];
+    }
+    return tiers[tier];
+}
+
+/**
+ * Name of the given tier
+ */
+std::string
+Camera::get_tier_name (const int tier) const
+{
+    if ((tier < 0) || (tier >= (int)tier_names.size())) {
+        return tier_names[0];
     }
+    return tier_names[tier];
+}
+
+/**
+ * Ask the camera thread to encode the given variant of every frame
+ *
+ * Each subscribed variant is encoded once per captured frame, right after the
+ * capture, no matter how many clients subscribed to it. Variants nobody
+ * subscribes to are not encoded at all, unless a client asks for one.
+ */
+void
+Camera::subscribe (const frame_variant_st &variant)
+{
+    pthread_mutex_lock(&frame_mutex);
+    subscription_list::iterator it;
+    for (it = subscriptions.begin(); it != subscriptions.end(); ++it) {
+        if (it->first == variant) {
+            it->second++;
+            break;
+        }
+    }
+    if (it == subscriptions.end()) {
+        subscriptions.push_back(std::make_pair(variant, 1));
+        dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_CAMERA,
+             "encoding scale 1/" << variant.scale << " quality " <<
+             variant.quality << ", " << subscriptions.size() << " variants active");
+    }
+    pthread_mutex_unlock(&frame_mutex);
+}
+
+/**
+ * Drop a subscription taken with subscribe()
+ */
+void
+Camera::unsubscribe (const frame_variant_st &variant)
+{
+    pthread_mutex_lock(&frame_mutex);
+    subscription_list::iterator it;
+    for (it = subscriptions.begin(); it != subscriptions.end(); ++it) {
+        if (it->first == variant) {
+            if (--it->second <= 0) {
+                subscriptions.erase(it);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&frame_mutex);
+}
+
+/**
+ * Pre-event ring, NULL if disabled
+ */
+FrameRing*
+Camera::get_ring (void) const
+{
+    return ring;
+}
 
-    /* capture a frame and encode it into JPEG image */
-    cv::Mat frame = cv::Mat::zeros(config->get_int("rows"),
-                                   config->get_int("cols"), CV_8UC3);
+/**
+ * Have the recorder write the last seconds of the pre-event ring to disk
+ *
+ * Returns right away, the recorder's I/O thread does the writing. Returns
+ * false if the ring is disabled.
+ */
+bool
+Camera::dump_ring (const int seconds)
+{
+    if ((NULL == ring) || (NULL == recorder)) {
+        return false;
+    }
+    recorder->dump(ring, seconds);
+    return true;
+}
+
+/**
+ * Milliseconds the camera has been open for, in total
+ */
+unsigned long
+Camera::get_on_msec (void)
+{
     pthread_mutex_lock(&mutex);
-    device->grab();
-    device->retrieve(frame);
-    if (frame.rows > 0 && frame.cols > 0) {
-        cv::imencode(".jpg", frame, buf, frame_params);
+    unsigned long msec = on_msec;
+    if (device->is_open()) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        msec += elapsed_msec(opened_at, now);
     }
     pthread_mutex_unlock(&mutex);
 
-    dbug(DEBUG_LEVEL_VERY_VERBOSE, DEBUG_TYPE_CAMERA,
-         "captured frame, size " << buf.size() << " bytes");
+    return msec;
 }
 
 /**
- * Number of cols (i.e. width)
+ * Change the capture mode and the encoder settings on the fly
+ *
+ * The camera thread finishes the frame in flight and exits, the device is
+ * switched to the new mode, and the thread starts over, if it was running.
+ * The latest frame stays cached meanwhile, and the frames in flight are sent
+ * in the old mode: clients see the new resolution in the frame header. The
+ * stream gap (from the last frame in the old mode to the first in the new
+ * one) is logged. A mode the device refuses leaves everything as it was.
+ *
+ * Encoder settings only need the encoder to finish the image at hand, they
+ * don't stop the camera at all.
  */
-int
-Camera::get_cols (void) const
+bool
+Camera::reconfigure (const capture_mode_st &request)
 {
-    return config->get_int("cols");
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    pthread_mutex_lock(&mutex);
+    capture_mode_st next = mode;
+    next.cols = (request.cols > 0) ? request.cols : mode.cols;
+    next.rows = (request.rows > 0) ? request.rows : mode.rows;
+    next.fps = (request.fps > 0) ? request.fps : mode.fps;
+    next.subsampling = (request.subsampling > 0) ? request.subsampling : mode.subsampling;
+    next.fast_dct = (0 != request.fast_dct) ? request.fast_dct : mode.fast_dct;
+
+    /* encoder settings take effect from the next image on */
+    if ((NULL != encoder) &&
+        ((next.subsampling != mode.subsampling) || (next.fast_dct != mode.fast_dct))) {
+        encoder_options_st options = encoder->get_options();
+        options.subsampling = next.subsampling;
+        options.fast_dct = (next.fast_dct > 0);
+        encoder->set_options(options);
+        mode.subsampling = encoder->get_options().subsampling;
+        mode.fast_dct = next.fast_dct;
+    }
+
+    bool ok = true;
+    if ((next.cols != mode.cols) || (next.rows != mode.rows) || (next.fps != mode.fps)) {
+        /* drain the camera thread, but keep the latest frame for new clients */
+        bool restart = running;
+        bool was_idle = false;
+        if (running) {
+            pthread_mutex_lock(&frame_mutex);
+            was_idle = idle;
+            running = false;
+            idle = false;
+            pthread_cond_signal(&wake);
+            pthread_mutex_unlock(&frame_mutex);
+            pthread_join(thrd, NULL);
+        }
+        struct timespec drained;
+        clock_gettime(CLOCK_MONOTONIC, &drained);
+
+        ok = device->set_mode(next.cols, next.rows, next.fps);
+        if (ok) {
+            mode.cols = next.cols;
+            mode.rows = next.rows;
+            mode.fps = next.fps;
+        } else if (!device->set_mode(mode.cols, mode.rows, mode.fps)) {
+            dbug(DEBUG_LEVEL_ERROR, DEBUG_TYPE_CAMERA,
+                 "unable to restore capture mode " << mode.cols << "x" << mode.rows);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_CAMERA,
+             "camera thread drained in " << elapsed_msec(begin, drained) << " ms, " <<
+             "device switched in " << elapsed_msec(drained, end) << " ms");
+
+        /* the tile history is of the old resolution */
+        pthread_mutex_lock(&frame_mutex);
+        dirty_count = 0;
+        if (restart) {
+            idle = was_idle;
+            reserved_at = begin;
+            first_pending = true;
+            reconfigured = true;
+        }
+        pthread_mutex_unlock(&frame_mutex);
+        if (restart) {
+            start();
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_CAMERA,
+         (ok ? "capture mode " : "capture mode refused, staying at ") << mode.cols <<
+         "x" << mode.rows << " at " << mode.fps << " fps, " << "subsampling " <<
+         mode.subsampling << (mode.fast_dct > 0 ? ", fast DCT" : ""));
+    return ok;
 }
 
 /**
- * Number of rows (i.e. height)
+ * Parse the encoding tiers
+ *
+ * The "tiers" key of the camera section is a comma separated list of
+ * name:scale:quality triplets, e.g. "full:1:85,half:2:70,thumb:4:50", where
+ * scale is the downscale factor. Clients select a tier by its index. Without
+ * tiers there is a single full resolution tier with the configured quality.
  */
-int
-Camera::get_rows (void) const
+void
+Camera::parse_tiers (void)
+{
+    std::stringstream list(config->get_string("tiers"));
+    std::string item;
+
+    tiers.clear();
+    tier_names.clear();
+    while (std::getline(list, item, ',')) {
+        std::string name;
+        frame_variant_st variant;
+        char sep1 = 0, sep2 = 0;
+
+        std::string::size_type colon = item.find(':');
+        if (std::string::npos == colon) {
+            dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_CAMERA,
+                 "invalid tier '" << item << "'");
+            continue;
+        }
+        name = item.substr(0, colon);
+        std::stringstream params(item.substr(colon));
+        if (!(params >> sep1 >> variant.scale >> sep2 >> variant.quality) ||
+            (variant.scale < 1) || (variant.quality < 1) || (variant.quality > 100)) {
+            dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_CAMERA,
+                 "invalid tier '" << item << "'");
+            continue;
+        }
+
+        dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_CAMERA,
+             "tier " << tiers.size() << " '" << name << "' scale 1/" <<
+             variant.scale << " quality " << variant.quality);
+        tiers.push_back(variant);
+        tier_names.push_back(name);
+    }
+
+    if (tiers.empty()) {
+        frame_variant_st variant;
+        variant.scale = 1;
+        variant.quality = config->get_int("quality");
+        tiers.push_back(variant);
+        tier_names.push_back("full");
+    }
+}
+
+/**
+ * Open the camera device, and account for the time it's on
+ *
+ * Must be called with the camera mutex held.
+ */
+bool
+Camera::open_device (void)
+{
+    if (!device->open()) {
+        return false;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &opened_at);
+    return true;
+}
+
+/**
+ * Close the camera device, and account for the time it was on
+ *
+ * Must be called with the camera mutex held.
+ */
+void
+Camera::close_device (void)
+{
+    if (device->is_open()) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        on_msec += elapsed_msec(opened_at, now);
+    }
+    device->close();
+}
+
+/**
+ * Start the camera thread
+ *
+ * Must be called with the camera mutex held.
+ */
+void
+Camera::start (void)
+{
+    if (running || !device->is_open()) {
+        return;
+    }
+
+    if (NULL != motion) {
+        motion->reset();
+    }
+    if (NULL != tiles) {
+        tiles->reset();
+    }
+
+    pthread_mutex_lock(&frame_mutex);
+    running = true;
+    pthread_mutex_unlock(&frame_mutex);
+    if (pthread_create(&thrd, 0, camera_thread, this) != 0) {
+        dbug(DEBUG_LEVEL_ERROR, DEBUG_TYPE_CAMERA,
+             "unable to start camera thread");
+        pthread_mutex_lock(&frame_mutex);
+        running = false;
+        pthread_mutex_unlock(&frame_mutex);
+        return;
+    }
+    pthread_setname_np(thrd, "camera");
+}
+
+/**
+ * Stop the camera thread
+ *
+ * Must be called with the camera mutex held. The thread only uses the frame
+ * mutex, so it is safe to wait for it here.
+ */
+void
+Camera::stop (void)
 {
-    return config->get_int("rows");
+    if (!running) {
+        return;
+    }
+
+    /* tell the thread to stop, wake it up if it's idle */
+    pthread_mutex_lock(&frame_mutex);
+    running = false;
+    idle = false;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&frame_mutex);
+    pthread_join(thrd, NULL);
+
+    /* the last frame is stale from now on */
+    publish(NULL);
+    pthread_mutex_lock(&frame_mutex);
+    dirty_count = 0;
+    pthread_mutex_unlock(&frame_mutex);
+}
+
+/**
+ * Close the camera from the idle camera thread, if still unused
+ *
+ * Called by the camera thread when the linger time is over. It can't wait
+ * for the camera mutex, since stop() holds it while joining the thread, so it
+ * gives up if the mutex is busy, and the thread tries again after its next
+ * idle capture. Returns true if the camera was closed, the thread must exit
+ * without touching the camera then.
+ */
+bool
+Camera::park (void)
+{
+    bool parked = false;
+
+    if (0 != pthread_mutex_trylock(&mutex)) {
+        return false;
+    }
+    if (clients.empty()) {
+        dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_CAMERA,
+             "no clients for " << linger << " seconds, closing camera");
+        pthread_mutex_lock(&frame_mutex);
+        running = false;
+        idle = false;
+        dirty_count = 0;
+        pthread_mutex_unlock(&frame_mutex);
+        publish(NULL);
+        pthread_detach(thrd);
+        close_device();
+        parked = true;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return parked;
+}
+
+/**
+ * Publish a new frame, replacing the previous one
+ *
+ * The camera takes over the caller's reference of the new frame, and drops its
+ * own reference of the previous frame. Clients still sending the previous frame
+ * keep it alive until they are done.
+ */
+void
+Camera::publish (Frame *frame)
+{
+    Frame *old = latest.exchange(frame, std::memory_order_acq_rel);
+
+    pthread_mutex_lock(&frame_mutex);
+    if ((NULL != frame) && first_pending) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (reconfigured) {
+            dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_CAMERA,
+                 "first frame " << elapsed_msec(reserved_at, now) << " ms after " <<
+                 "reconfigure, stream gap " << elapsed_msec(last_published, now) <<
+                 " ms");
+        } else {
+            dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_CAMERA,
+                 "first frame " << elapsed_msec(reserved_at, now) << " ms after reserve");
+        }
+        first_pending = false;
+        reconfigured = false;
+    }
+    if (NULL != frame) {
+        clock_gettime(CLOCK_MONOTONIC, &last_published);
+        pthread_cond_broadcast(&published);
+    }
+    pthread_mutex_unlock(&frame_mutex);
+
+    if (NULL != old) {
+        old->put();
+    }
+}
+
+/**
+ * Camera thread
+ *
+ * Capture a frame, encode it into every subscribed variant, and publish it.
+ * Every client streams the same published frame, thus the cost of capturing
+ * and encoding grows with the number of active variants, not with the number
+ * of clients.
+ *
+ * With motion detection enabled, frames that did not change are dropped right
+ * after the capture, so they cost neither an encode nor any bandwidth. Clients
+ * still get a frame every keepalive period, so a static scene stays visible.
+ *
+ * While the camera is idle, the thread only captures every warm period, which
+ * keeps the exposure settled and a recent frame published for the next
+ * client, until the linger time is over. With the pre-event ring or the
+ * recorder enabled, the camera never goes cold, and every published frame is
+ * also encoded for them, at "ring_fps" or "record_fps" while nobody watches.
+ */
+void*
+Camera::camera_thread (void *args)
+{
+    Camera *camera = reinterpret_cast<Camera*>(args);
+    std::vector<frame_variant_st> variants;
+    struct timespec last = {0, 0};
+    unsigned int skipped = 0;
+    std::vector<uint8_t> dirty;
+    unsigned long allocs = frame_alloc_count();
+    struct timespec warm_next = {0, 0};
+
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_CAMERA,
+         "camera thread started");
+
+    while (true) {
+        pthread_mutex_lock(&camera->frame_mutex);
+        bool running = camera->running;
+        bool idle = camera->idle;
+        struct timespec idle_since = camera->idle_since;
+        pthread_mutex_unlock(&camera->frame_mutex);
+        if (!running) {
+            break;
+        }
+
+        /* without clients, capture once per warm period until the linger is over */
+        if (idle) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (!camera->always_warm &&
+                (elapsed_msec(idle_since, now) >= camera->linger * 1000L) &&
+                camera->park()) {
+                break;
+            }
+
+            bool due = false;
+            pthread_mutex_lock(&camera->frame_mutex);
+            while (camera->running && camera->idle && !due) {
+                due = (ETIMEDOUT == pthread_cond_timedwait(&camera->wake,
+                                                           &camera->frame_mutex,
+                                                           &warm_next));
+            }
+            pthread_mutex_unlock(&camera->frame_mutex);
+            if (!due) {
+                continue;
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &warm_next);
+            warm_next.tv_nsec += camera->warm_period;
+            warm_next.tv_sec += warm_next.tv_nsec / nsec_per_sec;
+            warm_next.tv_nsec %= nsec_per_sec;
+        }
+
+        /* capture into a recycled frame, back off a little if the device has trouble */
+        Frame *frame = camera->frames->acquire();
+        cv::Mat &image = frame->get_buffer();
+        const unsigned char *buffer = image.data;
+        if (!camera->device->capture(image)) {
+            frame->put();
+            usleep(10000);
+            continue;
+        }
+        if (image.data != buffer) {
+            frame_count_alloc();
+        }
+        frame->set_format(camera->device->get_format());
+        struct timespec captured;
+        clock_gettime(CLOCK_MONOTONIC, &captured);
+        frame->set_time(captured);
+
+        /* drop it if nothing moved, unless it's time for a keepalive */
+        if (NULL != camera->motion) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            bool expired = ((now.tv_sec - last.tv_sec) > camera->keepalive.tv_sec) ||
+                           (((now.tv_sec - last.tv_sec) == camera->keepalive.tv_sec) &&
+                            (now.tv_nsec >= last.tv_nsec));
+            if (!camera->motion->detect(frame->get_luma()) && !expired) {
+                frame->put();
+                skipped++;
+                continue;
+            }
+            if (skipped) {
+                dbug(DEBUG_LEVEL_VERY_VERBOSE, DEBUG_TYPE_CAMERA,
+                     "skipped " << skipped << " unchanged frames");
+                skipped = 0;
+            }
+            last = now;
+        }
+
+        /* encode it into the subscribed variants */
+        variants.clear();
+        pthread_mutex_lock(&camera->frame_mutex);
+        subscription_list::iterator it;
+        for (it = camera->subscriptions.begin(); it != camera->subscriptions.end(); ++it) {
+            variants.push_back(it->first);
+        }
+        pthread_mutex_unlock(&camera->frame_mutex);
+
+        frame->set_seq(camera->seq++);
+
+        /* remember which tiles changed, for the delta streams */
+        if (NULL != camera->tiles) {
+            camera->tiles->detect(frame->get_luma(), dirty);
+            pthread_mutex_lock(&camera->frame_mutex);
+            std::pair<uint32_t, std::vector<uint8_t> > &entry =
+                camera->dirty_tiles[camera->dirty_next];
+            entry.first = frame->get_seq();
+            entry.second = dirty;
+            camera->dirty_next = (camera->dirty_next + 1) % camera->dirty_tiles.size();
+            if (camera->dirty_count < camera->dirty_tiles.size()) {
+                camera->dirty_count++;
+            }
+            pthread_mutex_unlock(&camera->frame_mutex);
+        }
+
+        for (unsigned int i = 0; i < variants.size(); i++) {
+            camera->encode(frame, variants[i]);
+        }
+
+        /* keep the recent past for incident review */
+        if (NULL != camera->ring) {
+            const frame_encoding_st *encoding = camera->encode(frame, camera->ring_variant);
+            if (NULL != encoding) {
+                camera->ring->push(frame->get_seq(), frame->get_time(), encoding->cols,
+                                   encoding->rows, encoding->data);
+            }
+        }
+        if (camera->recording) {
+            const frame_encoding_st *encoding = camera->encode(frame, camera->record_variant);
+            if (NULL != encoding) {
+                camera->recorder->push(frame->get_seq(), encoding->cols, encoding->rows,
+                                       encoding->data);
+            }
+        }
+
+        dbug(DEBUG_LEVEL_VERY_VERBOSE, DEBUG_TYPE_CAMERA,
+             "captured frame " << frame->get_seq() << ", encoded " <<
+             variants.size() << " variants");
+
+        camera->publish(frame);
+
+        /* the steady state must not allocate, tell if it does */
+        if (frame_alloc_count() != allocs) {
+            dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_CAMERA,
+                 "capture path allocated " << frame_alloc_count() - allocs <<
+                 " times at frame " << camera->seq - 1);
+            allocs = frame_alloc_count();
+        }
+    }
+
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_CAMERA,
+         "camera thread stopped");
+
+    pthread_exit(NULL);
 }
 
 } /* namespace sentry */
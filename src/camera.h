@@ -26,15 +26,38 @@
 #define CAMERA_H_
 
 #include <pthread.h>
+#include <atomic>
+#include <string>
 #include <vector>
-#include <raspicam/raspicam_cv.h>
 
+#include "camera_device.h"
+#include "encoder.h"
+#include "frame.h"
 #include "framework.h"
+#include "motion.h"
+#include "recorder.h"
+#include "ring.h"
+#include "timelapse.h"
 
 namespace sentry {
 
+/** capture mode, zero fields keep the current setting */
+typedef struct capture_mode {
+    int cols;          /** cols of the captured frames */
+    int rows;          /** rows of the captured frames */
+    float fps;         /** capture frame rate */
+    int subsampling;   /** JPEG chroma subsampling: 420, 422 or 444 */
+    int fast_dct;      /** 1 for the fast DCT, -1 for the accurate one */
+} capture_mode_st;
+
 /**
  * Camera class
+ *
+ * The camera thread is the only producer of frames: it captures and encodes
+ * each frame exactly once, then publishes it for every client to share. The
+ * thread runs as long as at least one client has the camera reserved, and
+ * keeps the camera warm for a while after the last one left, so the next
+ * client doesn't wait for the camera to open and settle.
  */
 class Camera {
   public:
@@ -47,24 +70,126 @@ class Camera {
     /** reserve camera */
     void reserve (const int client_id);
 
-    /** release camera */
-    void release (const int client_id);
+    /** release camera, keep it warm unless told otherwise */
+    void release (const int client_id, const bool warm = true);
+
+    /** get the latest frame if it is newer than last_seq, NULL otherwise */
+    Frame* get_frame (const uint32_t last_seq);
+
+    /** wait for a frame captured at or after the given time, NULL at the deadline */
+    Frame* wait_frame (const struct timespec &after, const struct timespec &deadline);
+
+    /** encode a frame (or a tile of it) with the given parameters, unless already done */
+    const frame_encoding_st* encode (Frame *frame, const frame_variant_st &variant,
+                                     const int tile = -1);
+
+    /** number of tiles of a frame, 0 if tile detection is disabled */
+    int get_tile_count (const Frame *frame) const;
+
+    /** tiles that changed after frame since up to frame until */
+    bool get_dirty_tiles (const uint32_t since, const uint32_t until,
+                          std::vector<uint8_t> &dirty);
+
+    /** number of encoding tiers */
+    int get_tier_count (void) const;
+
+    /** encoding variant of the given tier */
+    frame_variant_st get_tier (const int tier) const;
+
+    /** name of the given tier */
+    std::string get_tier_name (const int tier) const;
+
+    /** ask the camera thread to encode the given variant of every frame */
+    void subscribe (const frame_variant_st &variant);
+
+    /** drop a subscription taken with subscribe() */
+    void unsubscribe (const frame_variant_st &variant);
 
-    /** capture a frame and encode it into a JPEG image */
-    void get_image (std::vector<unsigned char> &buf);
+    /** pre-event ring, NULL if disabled */
+    FrameRing* get_ring (void) const;
 
-    /** number of cols (i.e. width) */
-    int get_cols (void) const;
+    /** have the recorder write the last seconds of the pre-event ring to disk */
+    bool dump_ring (const int seconds);
 
-    /** number of rows (i.e. height) */
-    int get_rows (void) const;
+    /** milliseconds the camera has been open for, in total */
+    unsigned long get_on_msec (void);
+
+    /** change the capture mode and the encoder settings on the fly */
+    bool reconfigure (const capture_mode_st &request);
 
   private:
-    framework::Config *config;     /** camera configuration */
-    raspicam::RaspiCam_Cv *device; /** camera device */
-    pthread_mutex_t mutex;         /** mutex to protect access to camera */
-    std::vector<int> frame_params; /** frame parameters */
-    std::vector<int> clients;      /** list of clients using the camera */
+    /** number of clients per subscribed variant */
+    typedef std::vector<std::pair<frame_variant_st, int> > subscription_list;
+
+    /** dirty tiles of recent frames, by sequence number */
+    typedef std::vector<std::pair<uint32_t, std::vector<uint8_t> > > tile_history;
+
+    framework::Config *config;            /** camera configuration */
+    CameraDevice *device;                 /** camera device (frame source) */
+    pthread_mutex_t mutex;                /** mutex to protect access to camera */
+    std::vector<frame_variant_st> tiers;  /** configured encoding tiers */
+    std::vector<std::string> tier_names;  /** names of the encoding tiers */
+    std::vector<int> clients;             /** list of clients using the camera */
+    pthread_t thrd;                       /** camera thread */
+    bool running;                         /** flag to indicate camera thread is running */
+    pthread_mutex_t frame_mutex;          /** mutex to protect frames and subscriptions */
+    pthread_cond_t wake;                  /** wakes up the idle camera thread */
+    pthread_cond_t published;             /** signalled on every published frame */
+    bool idle;                            /** no clients, the camera is kept warm */
+    struct timespec idle_since;           /** when the last client left */
+    int linger;                           /** seconds to keep the camera warm */
+    bool always_warm;                     /** keep the camera warm forever */
+    long warm_period;                     /** capture period while idle, in nsec */
+    struct timespec reserved_at;          /** when the first client reserved the camera */
+    bool first_pending;                   /** no frame published since reserved_at */
+    bool reconfigured;                    /** reserved_at is the time of a reconfigure */
+    struct timespec last_published;       /** when the latest frame was published */
+    capture_mode_st mode;                 /** current capture mode */
+    FramePool *frames;                    /** frames not in use */
+    std::atomic<Frame*> latest;           /** latest published frame, lock-free */
+    uint32_t seq;                         /** sequence number of the next frame */
+    subscription_list subscriptions;      /** variants encoded for every frame */
+    MotionDetector *motion;               /** motion detector, NULL if disabled */
+    struct timespec keepalive;            /** publish period without motion */
+    TileDetector *tiles;                  /** tile detector, NULL if disabled */
+    tile_history dirty_tiles;             /** ring of the dirty tiles of recent frames */
+    unsigned int dirty_next;              /** next slot of the ring */
+    unsigned int dirty_count;             /** number of valid slots in the ring */
+    JpegEncoder *encoder;                 /** strip encoder, NULL to use OpenCV */
+    std::atomic<unsigned long> encode_count; /** number of whole frames encoded */
+    std::atomic<unsigned long> encode_usec;  /** encode time since the last stats */
+    FrameRing *ring;                      /** pre-event ring, NULL if disabled */
+    frame_variant_st ring_variant;        /** encoding kept in the ring */
+    Recorder *recorder;                   /** on-disk recorder, NULL if disabled */
+    bool recording;                       /** frames go to the recorder too */
+    frame_variant_st record_variant;      /** encoding recorded to disk */
+    Timelapse *timelapse;                 /** timelapse capture, NULL if disabled */
+    struct timespec opened_at;            /** when the camera was last opened */
+    unsigned long on_msec;                /** time the camera was open before that */
+
+    /** parse the encoding tiers */
+    void parse_tiers (void);
+
+    /** open the camera device, and account for the time it's on */
+    bool open_device (void);
+
+    /** close the camera device, and account for the time it was on */
+    void close_device (void);
+
+    /** start the camera thread */
+    void start (void);
+
+    /** stop the camera thread */
+    void stop (void);
+
+    /** close the camera from the idle camera thread, if still unused */
+    bool park (void);
+
+    /** record the encode time of a whole frame */
+    void record_encode_time (const unsigned long usec);
+
+    /** publish a new frame, replacing the previous one */
+    void publish (Frame *frame);
 
     /** camera thread */
     static void* camera_thread (void *args);
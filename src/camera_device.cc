@@ -0,0 +1,622 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * camera_device.cc
+ *
+ * Camera device (frame source) implementations
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <dirent.h>
+#include <algorithm>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "camera_device.h"
+
+namespace sentry {
+
+/** nanoseconds in a second */
+static const long nsec_per_sec = 1000000000L;
+
+/**
+ * Frame period in nanoseconds for the given frame rate, 0 means no pacing
+ */
+static long
+frame_period (const double fps)
+{
+    if (fps <= 0) {
+        return 0;
+    }
+    return (long)(nsec_per_sec / fps);
+}
+
+/**
+ * Sleep until the next frame is due, and schedule the one after
+ *
+ * If we fell behind (e.g. the consumer was slow), the schedule restarts from
+ * the current time instead of trying to catch up with a burst of frames.
+ */
+static void
+pace (struct timespec &next, const long period)
+{
+    if (0 == period) {
+        return;
+    }
+
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    next.tv_nsec += period;
+    while (next.tv_nsec >= nsec_per_sec) {
+        next.tv_nsec -= nsec_per_sec;
+        next.tv_sec++;
+    }
+    if ((next.tv_sec < now.tv_sec) ||
+        ((next.tv_sec == now.tv_sec) && (next.tv_nsec < now.tv_nsec))) {
+        next = now;
+    }
+}
+
+/**
+ * Camera device constructor
+ *
+ * The "capture_format" key is "bgr" (default) or "yuv420". YUV420 frames are
+ * delivered as I420, which needs an even resolution.
+ */
+CameraDevice::CameraDevice (framework::Config *config)
+        : config(config), format(FRAME_FORMAT_BGR)
+{
+    if ("yuv420" == config->get_string("capture_format")) {
+        if ((config->get_int("cols") % 2) || (config->get_int("rows") % 2)) {
+            dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_CAMERA,
+                 "yuv420 capture needs an even resolution, using bgr");
+        } else {
+            format = FRAME_FORMAT_I420;
+        }
+    }
+}
+
+/**
+ * Camera device destructor
+ */
+CameraDevice::~CameraDevice (void)
+{
+}
+
+/**
+ * Pixel layout of the captured frames
+ */
+frame_format_en
+CameraDevice::get_format (void) const
+{
+    return format;
+}
+
+/**
+ * Change the resolution and frame rate, reopening the device if needed
+ *
+ * Devices that can't change their mode (like the replay) refuse it. The mode
+ * must be checked here, a refused mode leaves the device as it was.
+ */
+bool
+CameraDevice::set_mode (const int cols, const int rows, const float fps)
+{
+    dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_CAMERA,
+         "camera device can't change its capture mode");
+    return false;
+}
+
+/**
+ * Create the frame source configured in the camera section
+ *
+ * Supported devices are "raspicam" (default), "synthetic" and "replay".
+ */
+CameraDevice*
+CameraDevice::create (framework::Config *config)
+{
+    std::string type = config->get_string("device");
+
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_CAMERA,
+         "using camera device '" << type << "'");
+
+    if ("synthetic" == type) {
+        return new SyntheticDevice(config);
+    } else if ("replay" == type) {
+        return new ReplayDevice(config);
+    }
+
+#ifdef HAVE_RASPICAM
+    if ((type.empty() || ("raspicam" == type)) &&
+        ("yuv420" == config->get_string("capture_format"))) {
+        return new RaspicamYuvDevice(config);
+    } else if (type.empty() || ("raspicam" == type)) {
+        return new RaspicamDevice(config);
+    }
+#endif
+
+    dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_CAMERA,
+         "camera device '" << type << "' is not supported, using synthetic");
+    return new SyntheticDevice(config);
+}
+
+#ifdef HAVE_RASPICAM
+/**
+ * Raspicam device constructor
+ */
+RaspicamDevice::RaspicamDevice (framework::Config *config)
+        : CameraDevice(config)
+{
+    device = new raspicam::RaspiCam_Cv;
+    device->set(CV_CAP_PROP_FRAME_WIDTH, config->get_int("cols"));
+    device->set(CV_CAP_PROP_FRAME_HEIGHT, config->get_int("rows"));
+    device->set(CV_CAP_PROP_FORMAT, CV_8UC3);
+    device->set(CV_CAP_PROP_BRIGHTNESS, 50);
+    device->set(CV_CAP_PROP_CONTRAST, 50);
+    device->set(CV_CAP_PROP_SATURATION, 50);
+    device->set(CV_CAP_PROP_GAIN, 50);
+    if (config->get_int("fps") > 0) {
+        device->set(CV_CAP_PROP_FPS, config->get_int("fps"));
+    }
+}
+
+/**
+ * Raspicam device destructor
+ */
+RaspicamDevice::~RaspicamDevice (void)
+{
+    close();
+    delete device;
+}
+
+/**
+ * Open the camera module
+ */
+bool
+RaspicamDevice::open (void)
+{
+    if (!device->isOpened()) {
+        device->open();
+    }
+    return device->isOpened();
+}
+
+/**
+ * True if the camera module is open
+ */
+bool
+RaspicamDevice::is_open (void) const
+{
+    return device->isOpened();
+}
+
+/**
+ * Close the camera module
+ */
+void
+RaspicamDevice::close (void)
+{
+    if (device->isOpened()) {
+        device->release();
+    }
+}
+
+/**
+ * Capture the next frame from the camera module
+ */
+bool
+RaspicamDevice::capture (cv::Mat &image)
+{
+    if (!device->grab()) {
+        return false;
+    }
+    device->retrieve(image);
+    return (image.rows > 0 && image.cols > 0);
+}
+
+/**
+ * Change the resolution and frame rate, the module is restarted if it's open
+ */
+bool
+RaspicamDevice::set_mode (const int cols, const int rows, const float fps)
+{
+    if ((cols <= 0) || (rows <= 0)) {
+        return false;
+    }
+    bool was_open = is_open();
+    close();
+    device->set(CV_CAP_PROP_FRAME_WIDTH, cols);
+    device->set(CV_CAP_PROP_FRAME_HEIGHT, rows);
+    if (fps > 0) {
+        device->set(CV_CAP_PROP_FPS, fps);
+    }
+    return !was_open || open();
+}
+
+/**
+ * Raspicam YUV device constructor
+ *
+ * Same settings as the OpenCV flavor, on the scales of the plain API.
+ */
+RaspicamYuvDevice::RaspicamYuvDevice (framework::Config *config)
+        : CameraDevice(config)
+{
+    cols = config->get_int("cols");
+    rows = config->get_int("rows");
+    format = FRAME_FORMAT_I420;
+
+    device = new raspicam::RaspiCam;
+    device->setFormat(raspicam::RASPICAM_FORMAT_YUV420);
+    device->setCaptureSize(cols, rows);
+    device->setBrightness(50);
+    device->setContrast(0);
+    device->setSaturation(0);
+    device->setISO(450);
+    if (config->get_int("fps") > 0) {
+        device->setFrameRate(config->get_int("fps"));
+    }
+}
+
+/**
+ * Raspicam YUV device destructor
+ */
+RaspicamYuvDevice::~RaspicamYuvDevice (void)
+{
+    close();
+    delete device;
+}
+
+/**
+ * Open the camera module
+ *
+ * The frames are copied from the camera as they are, so the resolution must
+ * not need any padding, i.e. the width a multiple of 32 and the height of 16.
+ */
+bool
+RaspicamYuvDevice::open (void)
+{
+    if (!device->isOpened()) {
+        device->open();
+    }
+    if (device->isOpened() &&
+        (device->getImageTypeSize(raspicam::RASPICAM_FORMAT_YUV420) !=
+         (size_t)(cols * rows * 3 / 2))) {
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_CAMERA,
+             "camera pads " << cols << "x" << rows << " frames, yuv420 capture " <<
+             "needs the width to be a multiple of 32 and the height of 16");
+        device->release();
+    }
+    return device->isOpened();
+}
+
+/**
+ * True if the camera module is open
+ */
+bool
+RaspicamYuvDevice::is_open (void) const
+{
+    return device->isOpened();
+}
+
+/**
+ * Close the camera module
+ */
+void
+RaspicamYuvDevice::close (void)
+{
+    if (device->isOpened()) {
+        device->release();
+    }
+}
+
+/**
+ * Capture the next frame from the camera module, straight into the image
+ */
+bool
+RaspicamYuvDevice::capture (cv::Mat &image)
+{
+    if (!device->grab()) {
+        return false;
+    }
+    image.create(rows * 3 / 2, cols, CV_8UC1);
+    device->retrieve(image.ptr(), raspicam::RASPICAM_FORMAT_IGNORE);
+    return true;
+}
+
+/**
+ * Change the resolution and frame rate, the module is restarted if it's open
+ *
+ * Opening fails if the module would pad the new resolution, see open().
+ */
+bool
+RaspicamYuvDevice::set_mode (const int cols, const int rows, const float fps)
+{
+    if ((cols <= 0) || (rows <= 0) || (cols % 2) || (rows % 2)) {
+        return false;
+    }
+    bool was_open = is_open();
+    close();
+    this->cols = cols;
+    this->rows = rows;
+    device->setCaptureSize(cols, rows);
+    if (fps > 0) {
+        device->setFrameRate(fps);
+    }
+    return !was_open || open();
+}
+#endif /* HAVE_RASPICAM */
+
+/**
+ * Synthetic device constructor
+ */
+SyntheticDevice::SyntheticDevice (framework::Config *config)
+        : CameraDevice(config), opened(false), count(0)
+{
+    cols = config->get_int("cols");
+    rows = config->get_int("rows");
+    period = frame_period(config->get_float("fps"));
+}
+
+/**
+ * Synthetic device destructor
+ */
+SyntheticDevice::~SyntheticDevice (void)
+{
+}
+
+/**
+ * Open the synthetic device
+ */
+bool
+SyntheticDevice::open (void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    opened = true;
+    return opened;
+}
+
+/**
+ * True if the synthetic device is open
+ */
+bool
+SyntheticDevice::is_open (void) const
+{
+    return opened;
+}
+
+/**
+ * Close the synthetic device
+ */
+void
+SyntheticDevice::close (void)
+{
+    opened = false;
+}
+
+/**
+ * Change the resolution and frame rate, right away
+ */
+bool
+SyntheticDevice::set_mode (const int cols, const int rows, const float fps)
+{
+    if ((cols <= 0) || (rows <= 0) ||
+        ((FRAME_FORMAT_I420 == format) && ((cols % 2) || (rows % 2)))) {
+        return false;
+    }
+    this->cols = cols;
+    this->rows = rows;
+    period = frame_period(fps);
+    return true;
+}
+
+/**
+ * Generate the next frame
+ *
+ * The pattern is a color gradient with a bright box sweeping across it, which
+ * gives the encoder realistic work and makes dropped frames easy to spot.
+ */
+bool
+SyntheticDevice::capture (cv::Mat &image)
+{
+    if (!opened) {
+        return false;
+    }
+    pace(next, period);
+
+    int box = rows / 4;
+    int box_x = (count * 4) % (cols + box) - box;
+    int box_y = (rows - box) / 2;
+
+    if (FRAME_FORMAT_I420 == format) {
+        /* same pattern, generated in YUV */
+        image.create(rows * 3 / 2, cols, CV_8UC1);
+        for (int r = 0; r < rows; r++) {
+            unsigned char *p = image.ptr(r);
+            for (int c = 0; c < cols; c++) {
+                bool in_box = (c >= box_x) && (c < box_x + box) &&
+                              (r >= box_y) && (r < box_y + box);
+                p[c] = in_box ? 235 : (unsigned char)((c * 255 / cols + r * 255 / rows) / 2);
+            }
+        }
+        unsigned char *u = image.ptr(rows);
+        unsigned char *v = u + (cols / 2) * (rows / 2);
+        for (int r = 0; r < rows / 2; r++) {
+            for (int c = 0; c < cols / 2; c++) {
+                *u++ = (unsigned char)(c * 2 * 255 / cols);
+                *v++ = (unsigned char)(count);
+            }
+        }
+        count++;
+        return true;
+    }
+
+    image.create(rows, cols, CV_8UC3);
+    for (int r = 0; r < rows; r++) {
+        unsigned char *p = image.ptr(r);
+        for (int c = 0; c < cols; c++) {
+            if ((c >= box_x) && (c < box_x + box) && (r >= box_y) && (r < box_y + box)) {
+                p[0] = p[1] = p[2] = 255;
+            } else {
+                p[0] = (unsigned char)(c * 255 / cols);
+                p[1] = (unsigned char)(r * 255 / rows);
+                p[2] = (unsigned char)(count);
+            }
+            p += 3;
+        }
+    }
+    count++;
+
+    return true;
+}
+
+/**
+ * Replay device constructor
+ *
+ * The "replay" key is either a directory of images or a video file, and the
+ * "replay_speed" key is "realtime" (default) or "max". Images are replayed at
+ * the configured fps, videos at their own frame rate.
+ */
+ReplayDevice::ReplayDevice (framework::Config *config)
+        : CameraDevice(config), opened(false), period(0), index(0)
+{
+    realtime = ("max" != config->get_string("replay_speed"));
+}
+
+/**
+ * Replay device destructor
+ */
+ReplayDevice::~ReplayDevice (void)
+{
+    close();
+}
+
+/**
+ * Open the replay source
+ */
+bool
+ReplayDevice::open (void)
+{
+    std::string path = config->get_string("replay");
+
+    /* collect the images if the source is a directory */
+    files.clear();
+    DIR *dir = opendir(path.c_str());
+    if (NULL != dir) {
+        struct dirent *entry;
+        while (NULL != (entry = readdir(dir))) {
+            std::string name(entry->d_name);
+            std::string::size_type dot = name.rfind('.');
+            if (std::string::npos == dot) {
+                continue;
+            }
+            std::string ext = name.substr(dot);
+            std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+            if ((".jpg" == ext) || (".jpeg" == ext) || (".png" == ext) ||
+                (".bmp" == ext) || (".ppm" == ext)) {
+                files.push_back(path + "/" + name);
+            }
+        }
+        closedir(dir);
+        std::sort(files.begin(), files.end());
+
+        if (files.empty()) {
+            dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_CAMERA,
+                 "no images found in " << path);
+            return false;
+        }
+        index = 0;
+        period = frame_period(config->get_float("fps"));
+    } else {
+        if (!video.open(path)) {
+            dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_CAMERA,
+                 "unable to open replay file " << path);
+            return false;
+        }
+        period = frame_period(video.get(CV_CAP_PROP_FPS));
+    }
+
+    if (!realtime) {
+        period = 0;
+    }
+
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_CAMERA,
+         "replaying " << path << (realtime ? " in real time" : " at max speed"));
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    opened = true;
+    return opened;
+}
+
+/**
+ * True if the replay source is open
+ */
+bool
+ReplayDevice::is_open (void) const
+{
+    return opened;
+}
+
+/**
+ * Close the replay source
+ */
+void
+ReplayDevice::close (void)
+{
+    if (video.isOpened()) {
+        video.release();
+    }
+    files.clear();
+    opened = false;
+}
+
+/**
+ * Read the next frame, rewinding at the end of the source
+ *
+ * Images and videos decode to BGR, they are converted for I420 capture (and
+ * cropped to an even resolution), like a camera would deliver them.
+ */
+bool
+ReplayDevice::capture (cv::Mat &image)
+{
+    if (!opened) {
+        return false;
+    }
+    pace(next, period);
+
+    cv::Mat &target = (FRAME_FORMAT_I420 == format) ? decoded : image;
+    if (!files.empty()) {
+        target = cv::imread(files[index], CV_LOAD_IMAGE_COLOR);
+        index = (index + 1) % files.size();
+    } else if (!video.read(target)) {
+        video.set(CV_CAP_PROP_POS_FRAMES, 0);
+        if (!video.read(target)) {
+            return false;
+        }
+    }
+    if ((target.rows < 2) || (target.cols < 2)) {
+        return false;
+    }
+
+    if (FRAME_FORMAT_I420 == format) {
+        cv::cvtColor(decoded(cv::Rect(0, 0, decoded.cols & ~1, decoded.rows & ~1)),
+                     image, CV_BGR2YUV_I420);
+    }
+    return true;
+}
+
+} /* namespace sentry */
@@ -0,0 +1,196 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * camera_device.h
+ *
+ * Camera device (frame source) class declarations
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#ifndef CAMERA_DEVICE_H_
+#define CAMERA_DEVICE_H_
+
+#include <ctime>
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#ifdef HAVE_RASPICAM
+#include <raspicam/raspicam.h>
+#include <raspicam/raspicam_cv.h>
+#endif
+
+#include "frame.h"
+#include "framework.h"
+
+namespace sentry {
+
+/**
+ * CameraDevice class
+ *
+ * Frame source interface used by the camera. The backend is selected with the
+ * "device" key of the camera config section, the pixel layout of the frames
+ * with the "capture_format" key.
+ */
+class CameraDevice {
+  public:
+    /** camera device constructor */
+    CameraDevice (framework::Config *config);
+
+    /** camera device destructor */
+    virtual ~CameraDevice (void);
+
+    /** create the frame source configured in the camera section */
+    static CameraDevice* create (framework::Config *config);
+
+    /** open the device */
+    virtual bool open (void) = 0;
+
+    /** true if the device is open */
+    virtual bool is_open (void) const = 0;
+
+    /** close the device */
+    virtual void close (void) = 0;
+
+    /** capture the next frame, blocks until it is available */
+    virtual bool capture (cv::Mat &image) = 0;
+
+    /** change the resolution and frame rate, reopening the device if needed */
+    virtual bool set_mode (const int cols, const int rows, const float fps);
+
+    /** pixel layout of the captured frames */
+    frame_format_en get_format (void) const;
+
+  protected:
+    framework::Config *config;   /** camera configuration (owned by camera) */
+    frame_format_en format;      /** pixel layout of the captured frames */
+};
+
+#ifdef HAVE_RASPICAM
+/**
+ * RaspicamDevice class
+ *
+ * Raspberry Pi camera module, using the raspicam library.
+ */
+class RaspicamDevice : public CameraDevice {
+  public:
+    /** raspicam device constructor */
+    RaspicamDevice (framework::Config *config);
+
+    /** raspicam device destructor */
+    virtual ~RaspicamDevice (void);
+
+    bool open (void);
+    bool is_open (void) const;
+    void close (void);
+    bool capture (cv::Mat &image);
+    bool set_mode (const int cols, const int rows, const float fps);
+
+  private:
+    raspicam::RaspiCam_Cv *device;   /** raspicam device */
+};
+
+/**
+ * RaspicamYuvDevice class
+ *
+ * Raspberry Pi camera module in its native YUV420 format, using the plain
+ * raspicam API, as the OpenCV flavor only delivers BGR or gray.
+ */
+class RaspicamYuvDevice : public CameraDevice {
+  public:
+    /** raspicam YUV device constructor */
+    RaspicamYuvDevice (framework::Config *config);
+
+    /** raspicam YUV device destructor */
+    virtual ~RaspicamYuvDevice (void);
+
+    bool open (void);
+    bool is_open (void) const;
+    void close (void);
+    bool capture (cv::Mat &image);
+    bool set_mode (const int cols, const int rows, const float fps);
+
+  private:
+    raspicam::RaspiCam *device;      /** raspicam device */
+    int cols;                        /** cols, also known as width */
+    int rows;                        /** rows, also known as height */
+};
+#endif /* HAVE_RASPICAM */
+
+/**
+ * SyntheticDevice class
+ *
+ * Generates a moving test pattern with the configured resolution and frame
+ * rate, so the whole server can run on machines without a camera.
+ */
+class SyntheticDevice : public CameraDevice {
+  public:
+    /** synthetic device constructor */
+    SyntheticDevice (framework::Config *config);
+
+    /** synthetic device destructor */
+    virtual ~SyntheticDevice (void);
+
+    bool open (void);
+    bool is_open (void) const;
+    void close (void);
+    bool capture (cv::Mat &image);
+    bool set_mode (const int cols, const int rows, const float fps);
+
+  private:
+    bool opened;                 /** true if the device is open */
+    int cols;                    /** cols, also known as width */
+    int rows;                    /** rows, also known as height */
+    long period;                 /** frame period in nanoseconds */
+    unsigned int count;          /** number of frames generated so far */
+    struct timespec next;        /** time when the next frame is due */
+};
+
+/**
+ * ReplayDevice class
+ *
+ * Replays a directory of images or a video file in a loop, either in real
+ * time or as fast as possible.
+ */
+class ReplayDevice : public CameraDevice {
+  public:
+    /** replay device constructor */
+    ReplayDevice (framework::Config *config);
+
+    /** replay device destructor */
+    virtual ~ReplayDevice (void);
+
+    bool open (void);
+    bool is_open (void) const;
+    void close (void);
+    bool capture (cv::Mat &image);
+
+  private:
+    bool opened;                     /** true if the device is open */
+    bool realtime;                   /** false means replay at max speed */
+    long period;                     /** frame period in nanoseconds */
+    struct timespec next;            /** time when the next frame is due */
+    std::vector<std::string> files;  /** image files, when replaying a directory */
+    unsigned int index;              /** index of the next image file */
+    cv::VideoCapture video;          /** video file, when not replaying images */
+    cv::Mat decoded;                 /** decoded image, when capturing I420 */
+};
+
+} /* namespace sentry */
+
+#endif /* CAMERA_DEVICE_H_ */
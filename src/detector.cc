@@ -0,0 +1,319 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * detector.cc
+ *
+ * Person detector implementation
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <vector>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "detector.h"
+
+namespace sentry {
+
+/** nanoseconds in a second */
+static const long detector_nsec_per_sec = 1000000000L;
+
+/** smallest image the HOG people detector works on (its window) */
+static const int detector_min_cols = 64;
+static const int detector_min_rows = 128;
+
+/**
+ * Milliseconds from since to now
+ */
+static long
+detector_elapsed_msec (const struct timespec &since, const struct timespec &now)
+{
+    return (now.tv_sec - since.tv_sec) * 1000 + (now.tv_nsec - since.tv_nsec) / 1000000;
+}
+
+/**
+ * Time nsec nanoseconds after the given time
+ */
+static struct timespec
+detector_add_nsec (const struct timespec &time, const long nsec)
+{
+    struct timespec result = time;
+    result.tv_sec += nsec / detector_nsec_per_sec;
+    result.tv_nsec += nsec % detector_nsec_per_sec;
+    result.tv_sec += result.tv_nsec / detector_nsec_per_sec;
+    result.tv_nsec %= detector_nsec_per_sec;
+    return result;
+}
+
+/**
+ * Detector constructor
+ */
+Detector::Detector (MessageQueue* const engine_queue, Camera *camera)
+        : engine_queue(engine_queue), camera(camera), reserved(false), present(false),
+          detections(0), skipped(0), latency_msec(0), max_latency_msec(0),
+          detect_usec(0)
+{
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_DETECTOR,
+         "parsing file " << framework::config_file << " for detector config");
+    config = new framework::Config("detector");
+
+    scale = std::max(1, config->get_int("scale"));
+    hit_threshold = config->get_float("hit_threshold");
+    float fps = config->get_float("fps");
+    period_nsec = (long)(detector_nsec_per_sec / ((fps > 0) ? fps : 2));
+    hog.setSVMDetector(cv::HOGDescriptor::getDefaultPeopleDetector());
+
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_DETECTOR,
+         "detecting people at scale 1/" << scale << ", up to " <<
+         detector_nsec_per_sec / period_nsec << " fps");
+
+    /* keep the camera running if asked to, otherwise only look while others do */
+    if (config->get_bool("reserve")) {
+        camera->reserve(detector_client_id);
+        reserved = true;
+    }
+
+    pthread_mutex_init(&mutex, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    running = true;
+    if (pthread_create(&thrd, 0, detector_thread, this) != 0) {
+        running = false;
+        dbug(DEBUG_LEVEL_ERROR, DEBUG_TYPE_DETECTOR,
+             "unable to start detector thread");
+        return;
+    }
+    pthread_setname_np(thrd, "detector");
+}
+
+/**
+ * Detector destructor
+ *
+ * A detection in progress is finished first.
+ */
+Detector::~Detector (void)
+{
+    if (running) {
+        pthread_mutex_lock(&mutex);
+        running = false;
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&mutex);
+        pthread_join(thrd, NULL);
+    }
+    if (reserved) {
+        camera->release(detector_client_id);
+    }
+
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&wake);
+    delete config;
+}
+
+/**
+ * Wait until the given time, returns false if the thread must stop
+ */
+bool
+Detector::sleep_until (const struct timespec &deadline)
+{
+    pthread_mutex_lock(&mutex);
+    while (running) {
+        if (ETIMEDOUT == pthread_cond_timedwait(&wake, &mutex, &deadline)) {
+            break;
+        }
+    }
+    bool keep_running = running;
+    pthread_mutex_unlock(&mutex);
+
+    return keep_running;
+}
+
+/**
+ * Look for people in the latest frame, returns false if there was none
+ *
+ * The frame is only held while its downscaled copy is made. The boxes are
+ * scaled back to the whole frame before they're sent.
+ */
+bool
+Detector::detect (uint32_t &last_seq)
+{
+    Frame *frame = camera->get_frame(last_seq);
+    if (NULL == frame) {
+        return false;
+    }
+
+    /* the frames in between were published while we were busy */
+    if ((0 != last_seq) && (frame->get_seq() - last_seq > 1)) {
+        skipped += frame->get_seq() - last_seq - 1;
+    }
+    last_seq = frame->get_seq();
+    struct timespec captured = frame->get_time();
+    int cols = frame->get_cols();
+    int rows = frame->get_rows();
+    cv::Size size(cols / scale, rows / scale);
+    if ((size.width < detector_min_cols) || (size.height < detector_min_rows)) {
+        frame->put();
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_DETECTOR,
+             "frame of " << cols << "x" << rows << " is too small for scale 1/" << scale);
+        return true;
+    }
+    cv::resize(frame->get_luma(), small, size, 0, 0, cv::INTER_AREA);
+    frame->put();
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    if (small.channels() > 1) {
+        cv::cvtColor(small, gray, CV_BGR2GRAY);
+    } else {
+        gray = small;
+    }
+    std::vector<cv::Rect> found;
+    std::vector<double> weights;
+    hog.detectMultiScale(gray, found, weights, hit_threshold, cv::Size(8, 8),
+                         cv::Size(0, 0), 1.05, 2.0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    long latency = detector_elapsed_msec(captured, end);
+    detections++;
+    latency_msec += latency;
+    max_latency_msec = std::max(max_latency_msec, (unsigned long)latency);
+    detect_usec += (end.tv_sec - begin.tv_sec) * 1000000 +
+                   (end.tv_nsec - begin.tv_nsec) / 1000;
+
+    /* tell the clients when people show up, and when they are gone */
+    if (found.empty() && !present) {
+        return true;
+    }
+    present = !found.empty();
+
+    message_detection_st *msg = new message_detection_st;
+    memset(msg, 0, sizeof(*msg));
+    msg->type = MESSAGE_DETECTION;
+    msg->frame_id = last_seq;
+    msg->cols = cols;
+    msg->rows = rows;
+    msg->latency = std::min(latency, 65535L);
+    for (unsigned int i = 0; (i < found.size()) && (msg->count < max_detections); i++) {
+        message_box_st &box = msg->boxes[msg->count++];
+        cv::Rect rect = cv::Rect(found[i].x * scale, found[i].y * scale,
+                                 found[i].width * scale, found[i].height * scale) &
+                        cv::Rect(0, 0, cols, rows);
+        box.x = rect.x;
+        box.y = rect.y;
+        box.cols = rect.width;
+        box.rows = rect.height;
+        double score = (i < weights.size()) ? weights[i] : 0;
+        box.score = std::max(0, std::min(65535, (int)(score * 100)));
+    }
+
+    dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_DETECTOR,
+         found.size() << " people in frame " << last_seq << ", " << latency <<
+         " ms after capture");
+    engine_queue->push_msg(msg);
+    return true;
+}
+
+/**
+ * Log the detection rate and latency
+ *
+ * The latency is from the capture of the frame to the result, the detection
+ * time is the CPU the detector took. Skipped frames were published while a
+ * detection was in progress, or between two detections.
+ */
+void
+Detector::report (const long msec)
+{
+    if (0 != detections) {
+        dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_DETECTOR,
+             detections * 1000.0 / ((msec > 0) ? msec : 1) << " detections/s, latency " <<
+             latency_msec / detections << " ms (max " << max_latency_msec << " ms), " <<
+             "detection " << detect_usec / detections / 1000 << " ms, " << skipped <<
+             " frames skipped");
+    }
+    detections = 0;
+    skipped = 0;
+    latency_msec = 0;
+    max_latency_msec = 0;
+    detect_usec = 0;
+}
+
+/**
+ * Detector thread
+ *
+ * Waits for a frame newer than the last one looked at, detects, then sleeps
+ * out the rest of the detection period. The wait polls the camera's cache
+ * every "poll" milliseconds, the camera is never asked to wake anybody up.
+ */
+void*
+Detector::detector_thread (void *args)
+{
+    Detector *detector = reinterpret_cast<Detector*>(args);
+    int interval = detector->config->get_int("stats_interval");
+    long stats_msec = ((interval > 0) ? interval : 10) * 1000L;
+    int poll = detector->config->get_int("poll");
+    long poll_nsec = ((poll > 0) ? poll : 50) * 1000000L;
+    uint32_t last_seq = 0;
+    struct timespec last_stats, next;
+
+    /* only run when nothing else wants the CPU, or at least be nice about it */
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    if (0 != pthread_setschedparam(pthread_self(), SCHED_IDLE, &param)) {
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_DETECTOR,
+             "unable to set the idle scheduling policy, lowering priority instead");
+        setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+    }
+
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_DETECTOR,
+         "detector thread started");
+
+    clock_gettime(CLOCK_MONOTONIC, &last_stats);
+    next = last_stats;
+    while (detector->sleep_until(next)) {
+        struct timespec begin;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        if (detector->detect(last_seq)) {
+            next = detector_add_nsec(begin, detector->period_nsec);
+        } else {
+            next = detector_add_nsec(begin, poll_nsec);
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (detector_elapsed_msec(last_stats, now) >= stats_msec) {
+            detector->report(detector_elapsed_msec(last_stats, now));
+            last_stats = now;
+        }
+    }
+
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_DETECTOR,
+         "detector thread stopped");
+
+    pthread_exit(NULL);
+}
+
+} /* namespace sentry */
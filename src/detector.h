@@ -0,0 +1,108 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * detector.h
+ *
+ * Person detector class declaration
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#ifndef DETECTOR_H_
+#define DETECTOR_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <opencv2/core/core.hpp>
+#include <opencv2/objdetect/objdetect.hpp>
+
+#include "camera.h"
+#include "message_queue.h"
+#include "framework.h"
+
+namespace sentry {
+
+/** camera client ID of the detector, session IDs are never negative in practice */
+static const int detector_client_id = -1;
+
+/**
+ * Detector class
+ *
+ * Looks for people in the frames the camera publishes, with OpenCV's HOG
+ * people detector, on a 1/"scale" grayscale copy. The detector runs in its
+ * own thread at the idle scheduling priority, so it only gets the CPU time
+ * the camera and the uplinks leave over, and never holds them up: it takes
+ * the latest frame from the camera's cache, copies the downscaled image out
+ * and lets go of the frame before detecting. Frames published meanwhile are
+ * simply skipped, there is no queue to fall behind on. At most "fps"
+ * detections are made per second.
+ *
+ * When people are found, a detection message goes to the engine, which
+ * hands it to the uplinks of the subscribed clients; another one with no
+ * objects follows when they are gone. With "reserve", the detector keeps the
+ * camera running by itself, otherwise it only looks while somebody else does.
+ *
+ * The detection rate, the latency from capture to result and the time spent
+ * detecting are logged every "stats_interval" seconds.
+ */
+class Detector {
+  public:
+    /** detector constructor */
+    Detector (MessageQueue* const engine_queue, Camera *camera);
+
+    /** detector destructor */
+    virtual ~Detector (void);
+
+  private:
+    framework::Config *config;          /** detector configuration */
+    MessageQueue* const engine_queue;   /** main message queue */
+    Camera *camera;                     /** camera the frames come from */
+    cv::HOGDescriptor hog;              /** people detector */
+    int scale;                          /** downscale factor of the detection image */
+    double hit_threshold;               /** SVM distance a detection must exceed */
+    long period_nsec;                   /** minimum time between detections */
+    bool reserved;                      /** camera is reserved by the detector */
+    pthread_t thrd;                     /** detector thread */
+    bool running;                       /** flag to indicate detector thread is running */
+    pthread_mutex_t mutex;              /** mutex to protect the running flag */
+    pthread_cond_t wake;                /** wakes up the detector thread to stop */
+    cv::Mat small;                      /** downscaled image, kept for reuse */
+    cv::Mat gray;                       /** grayscale detection image, kept for reuse */
+    bool present;                       /** objects were found in the last frame */
+    unsigned long detections;           /** detections since the last stats */
+    unsigned long skipped;              /** frames skipped since the last stats */
+    unsigned long latency_msec;         /** sum of the latencies since the last stats */
+    unsigned long max_latency_msec;     /** worst latency since the last stats */
+    unsigned long detect_usec;          /** time spent detecting since the last stats */
+
+    /** wait until the given time, returns false if the thread must stop */
+    bool sleep_until (const struct timespec &deadline);
+
+    /** look for people in the latest frame, returns false if there was none */
+    bool detect (uint32_t &last_seq);
+
+    /** log the detection rate and latency */
+    void report (const long msec);
+
+    /** detector thread */
+    static void* detector_thread (void *args);
+};
+
+} /* namespace sentry */
+
+#endif /* DETECTOR_H_ */
@@ -0,0 +1,646 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * encoder.cc
+ *
+ * JPEG encoder implementation
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <jpeglib.h>
+
+#include "encoder.h"
+#include "framework.h"
+
+namespace sentry {
+
+/** smallest strip worth handing to another thread, in MCU rows */
+static const int min_strip_mcus = 4;
+
+/** libjpeg error manager that jumps back instead of exiting */
+typedef struct encoder_error {
+    struct jpeg_error_mgr pub;   /** libjpeg error manager */
+    jmp_buf jmp;                 /** where to go on error */
+} encoder_error_st;
+
+/** libjpeg destination manager writing into a growing vector */
+typedef struct encoder_dest {
+    struct jpeg_destination_mgr pub;   /** libjpeg destination manager */
+    std::vector<unsigned char> *buf;   /** output buffer */
+} encoder_dest_st;
+
+/** encoder state of a single strip */
+struct encoder_strip {
+    struct jpeg_compress_struct cinfo;   /** libjpeg compressor */
+    encoder_error_st err;                /** error manager */
+    encoder_dest_st dest;                /** destination manager */
+    std::vector<unsigned char> data;     /** encoded strip, kept between images */
+    std::vector<unsigned char> rgb;      /** row conversion buffer */
+    std::vector<unsigned char> pad;      /** padded rows of an MCU row of planes */
+    const encoder_options_st *options;   /** encoder settings */
+    const unsigned char *pixels;         /** first pixel of the strip */
+    const unsigned char *planes[3];      /** first row of each plane of the strip */
+    int steps[3];                        /** bytes per row of each plane */
+    bool raw;                            /** true if the strip is given as I420 planes */
+    int cols;                            /** cols of the image */
+    int rows;                            /** rows of the strip */
+    int step;                            /** bytes per image row */
+    int channels;                        /** 3 for BGR, 1 for grayscale */
+    int quality;                         /** JPEG quality */
+    int first_mcu_row;                   /** MCU row of the image the strip starts at */
+    bool restart;                        /** restart marker after each MCU row */
+    bool ok;                             /** true if the strip was encoded */
+};
+
+/**
+ * Error exit, jump back to the strip encoder
+ */
+static void
+encoder_error_exit (j_common_ptr cinfo)
+{
+    encoder_error_st *err = reinterpret_cast<encoder_error_st*>(cinfo->err);
+    char msg[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, msg);
+    dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_CAMERA,
+         "JPEG encoding failed: " << msg);
+    longjmp(err->jmp, 1);
+}
+
+/**
+ * Warnings are not interesting
+ */
+static void
+encoder_output_message (j_common_ptr cinfo)
+{
+}
+
+/**
+ * Start writing into the vector, reusing whatever it has already allocated
+ */
+static void
+encoder_init_destination (j_compress_ptr cinfo)
+{
+    encoder_dest_st *dest = reinterpret_cast<encoder_dest_st*>(cinfo->dest);
+    dest->buf->resize(std::max<size_t>(dest->buf->capacity(), 65536));
+    dest->pub.next_output_byte = &(*dest->buf)[0];
+    dest->pub.free_in_buffer = dest->buf->size();
+}
+
+/**
+ * The vector is full, double it
+ */
+static boolean
+encoder_empty_output_buffer (j_compress_ptr cinfo)
+{
+    encoder_dest_st *dest = reinterpret_cast<encoder_dest_st*>(cinfo->dest);
+    size_t used = dest->buf->size();
+    dest->buf->resize(2 * used);
+    dest->pub.next_output_byte = &(*dest->buf)[used];
+    dest->pub.free_in_buffer = dest->buf->size() - used;
+    return TRUE;
+}
+
+/**
+ * Cut the vector to the encoded size
+ */
+static void
+encoder_term_destination (j_compress_ptr cinfo)
+{
+    encoder_dest_st *dest = reinterpret_cast<encoder_dest_st*>(cinfo->dest);
+    dest->buf->resize(dest->buf->size() - dest->pub.free_in_buffer);
+}
+
+/**
+ * Height of an MCU row, the strips must be a multiple of it
+ *
+ * Only 4:2:0 subsamples the chroma vertically.
+ */
+static int
+encoder_mcu_rows (const int channels, const int subsampling)
+{
+    return ((1 == channels) || (420 != subsampling)) ? DCTSIZE : 2 * DCTSIZE;
+}
+
+/**
+ * Feed the planes of an I420 strip to libjpeg, one MCU row at a time
+ *
+ * The last MCU row is completed by repeating the last row of each plane.
+ * libjpeg reads whole blocks, so if the strip is not a multiple of 16 pixels
+ * wide, the rows are copied into the padding buffer first, with the last pixel
+ * repeated.
+ */
+static void
+encoder_write_raw (encoder_strip_st *strip)
+{
+    struct jpeg_compress_struct *cinfo = &strip->cinfo;
+    const int mcu = 2 * DCTSIZE;
+    const int widths[3] = {strip->cols, (strip->cols + 1) / 2, (strip->cols + 1) / 2};
+    const int heights[3] = {strip->rows, (strip->rows + 1) / 2, (strip->rows + 1) / 2};
+    const int padded = (strip->cols + mcu - 1) & ~(mcu - 1);
+    const bool copy = (padded != strip->cols);
+    JSAMPROW y[2 * DCTSIZE], u[DCTSIZE], v[DCTSIZE];
+    JSAMPARRAY data[3] = {y, u, v};
+
+    while (cinfo->next_scanline < cinfo->image_height) {
+        unsigned char *pad = copy ? &strip->pad[0] : NULL;
+        for (int c = 0; c < 3; c++) {
+            int lines = (0 == c) ? mcu : mcu / 2;
+            int first = (0 == c) ? cinfo->next_scanline : cinfo->next_scanline / 2;
+            int width = (0 == c) ? padded : padded / 2;
+            for (int i = 0; i < lines; i++) {
+                const unsigned char *row = strip->planes[c] +
+                    std::min(first + i, heights[c] - 1) * strip->steps[c];
+                if (copy) {
+                    memcpy(pad, row, widths[c]);
+                    memset(pad + widths[c], row[widths[c] - 1], width - widths[c]);
+                    row = pad;
+                    pad += width;
+                }
+                data[c][i] = const_cast<JSAMPROW>(row);
+            }
+        }
+        jpeg_write_raw_data(cinfo, data, mcu);
+    }
+}
+
+/**
+ * Encode a strip as a standalone JPEG with a restart marker after each MCU row
+ *
+ * Every strip uses the same parameters and the standard Huffman tables, so
+ * the headers of the strips only differ in the image height. No objects with
+ * destructors may live in this function, because of the longjmp on errors.
+ */
+static bool
+encoder_compress_strip (encoder_strip_st *strip)
+{
+    struct jpeg_compress_struct *cinfo = &strip->cinfo;
+
+    if (setjmp(strip->err.jmp)) {
+        jpeg_abort_compress(cinfo);
+        return false;
+    }
+
+    cinfo->image_width = strip->cols;
+    cinfo->image_height = strip->rows;
+    cinfo->input_components = strip->channels;
+#ifdef JCS_EXTENSIONS
+    cinfo->in_color_space = (1 == strip->channels) ? JCS_GRAYSCALE : JCS_EXT_BGR;
+#else
+    cinfo->in_color_space = (1 == strip->channels) ? JCS_GRAYSCALE : JCS_RGB;
+#endif
+    if (strip->raw) {
+        cinfo->in_color_space = JCS_YCbCr;
+    }
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, strip->quality, TRUE);
+    if (strip->raw) {
+        /* the planes are already downsampled 4:2:0 */
+        cinfo->raw_data_in = TRUE;
+        cinfo->comp_info[0].h_samp_factor = 2;
+        cinfo->comp_info[0].v_samp_factor = 2;
+    } else if (3 == strip->channels) {
+        /* luma sampling factors, chroma is always 1x1 */
+        const int subsampling = strip->options->subsampling;
+        cinfo->comp_info[0].h_samp_factor = (444 == subsampling) ? 1 : 2;
+        cinfo->comp_info[0].v_samp_factor = (420 == subsampling) ? 2 : 1;
+    }
+    cinfo->dct_method = strip->options->fast_dct ? JDCT_IFAST : JDCT_ISLOW;
+    cinfo->optimize_coding = strip->options->optimize ? TRUE : FALSE;
+    cinfo->restart_in_rows = strip->restart ? 1 : 0;
+
+    jpeg_start_compress(cinfo, TRUE);
+    if (strip->raw) {
+        encoder_write_raw(strip);
+    }
+    while (cinfo->next_scanline < cinfo->image_height) {
+        JSAMPROW row = const_cast<JSAMPROW>(strip->pixels +
+                                            cinfo->next_scanline * strip->step);
+#ifndef JCS_EXTENSIONS
+        if (3 == strip->channels) {
+            /* plain libjpeg only takes RGB */
+            for (int i = 0; i < strip->cols * 3; i += 3) {
+                strip->rgb[i] = row[i + 2];
+                strip->rgb[i + 1] = row[i + 1];
+                strip->rgb[i + 2] = row[i];
+            }
+            row = &strip->rgb[0];
+        }
+#endif
+        jpeg_write_scanlines(cinfo, &row, 1);
+    }
+    jpeg_finish_compress(cinfo);
+
+    return true;
+}
+
+/**
+ * Find the frame header and the start of the entropy coded data of a JPEG
+ *
+ * Returns false if the data doesn't look like what libjpeg writes.
+ */
+static bool
+encoder_parse (const std::vector<unsigned char> &data, size_t &sof, size_t &scan)
+{
+    size_t pos = 2;
+
+    sof = 0;
+    while (pos + 4 <= data.size()) {
+        if (0xff != data[pos]) {
+            return false;
+        }
+        unsigned char marker = data[pos + 1];
+        size_t length = (data[pos + 2] << 8) | data[pos + 3];
+        if (0xc0 == marker) {
+            sof = pos;
+        } else if (0xda == marker) {
+            scan = pos + 2 + length;
+            return ((0 != sof) && (scan + 2 <= data.size()));
+        }
+        pos += 2 + length;
+    }
+    return false;
+}
+
+/**
+ * JPEG encoder constructor
+ */
+JpegEncoder::JpegEncoder (const int threads, const encoder_options_st &options)
+        : threads(threads), options(options), running(true), generation(0),
+          strip_count(0), next_strip(0), finished(0)
+{
+    if ((420 != options.subsampling) && (422 != options.subsampling) &&
+        (444 != options.subsampling)) {
+        this->options.subsampling = 420;
+    }
+    if (this->threads <= 0) {
+        this->threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (this->threads <= 0) {
+        this->threads = 1;
+    }
+
+    pthread_mutex_init(&encode_mutex, NULL);
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&work, NULL);
+    pthread_cond_init(&done, NULL);
+
+    /* one strip encoder per thread, they are reused for every image */
+    for (int i = 0; i < this->threads; i++) {
+        encoder_strip_st *strip = new encoder_strip_st;
+        strip->cinfo.err = jpeg_std_error(&strip->err.pub);
+        strip->err.pub.error_exit = encoder_error_exit;
+        strip->err.pub.output_message = encoder_output_message;
+        jpeg_create_compress(&strip->cinfo);
+        strip->dest.pub.init_destination = encoder_init_destination;
+        strip->dest.pub.empty_output_buffer = encoder_empty_output_buffer;
+        strip->dest.pub.term_destination = encoder_term_destination;
+        strip->dest.buf = &strip->data;
+        strip->options = &this->options;
+        strip->cinfo.dest = &strip->dest.pub;
+        strips.push_back(strip);
+    }
+
+    /* the caller is one of the threads */
+    for (int i = 1; i < this->threads; i++) {
+        pthread_t thrd;
+        if (pthread_create(&thrd, 0, encoder_thread, this) != 0) {
+            dbug(DEBUG_LEVEL_ERROR, DEBUG_TYPE_CAMERA,
+                 "unable to start encoder thread");
+            break;
+        }
+        pthread_setname_np(thrd, "encoder");
+        thrds.push_back(thrd);
+    }
+
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_CAMERA,
+         "JPEG encoder with " << thrds.size() + 1 << " threads, subsampling " <<
+         this->options.subsampling << (this->options.fast_dct ? ", fast DCT" : "") <<
+         (this->options.optimize ? ", optimized Huffman tables" : ""));
+}
+
+/**
+ * JPEG encoder destructor
+ */
+JpegEncoder::~JpegEncoder (void)
+{
+    /* stop the helper threads */
+    pthread_mutex_lock(&mutex);
+    running = false;
+    pthread_cond_broadcast(&work);
+    pthread_mutex_unlock(&mutex);
+    for (unsigned int i = 0; i < thrds.size(); i++) {
+        pthread_join(thrds[i], NULL);
+    }
+
+    for (unsigned int i = 0; i < strips.size(); i++) {
+        jpeg_destroy_compress(&strips[i]->cinfo);
+        delete strips[i];
+    }
+    pthread_cond_destroy(&done);
+    pthread_cond_destroy(&work);
+    pthread_mutex_destroy(&mutex);
+    pthread_mutex_destroy(&encode_mutex);
+}
+
+/**
+ * Number of threads encoding an image
+ */
+int
+JpegEncoder::get_threads (void) const
+{
+    return thrds.size() + 1;
+}
+
+/**
+ * Encoder settings
+ */
+encoder_options_st
+JpegEncoder::get_options (void)
+{
+    pthread_mutex_lock(&encode_mutex);
+    encoder_options_st current = options;
+    pthread_mutex_unlock(&encode_mutex);
+    return current;
+}
+
+/**
+ * Change the encoder settings, from the next image on
+ *
+ * Waits for the image being encoded, if any, the strips see the new settings
+ * when they are set up for the next one.
+ */
+void
+JpegEncoder::set_options (const encoder_options_st &options)
+{
+    pthread_mutex_lock(&encode_mutex);
+    this->options = options;
+    if ((420 != options.subsampling) && (422 != options.subsampling) &&
+        (444 != options.subsampling)) {
+        this->options.subsampling = 420;
+    }
+    pthread_mutex_unlock(&encode_mutex);
+}
+
+/**
+ * Encode an image (BGR or grayscale) into out
+ *
+ * The strips are a whole number of MCU rows high, except for the last one.
+ * An image encoded in a single strip has no restart markers. Small images
+ * (e.g. tiles) are encoded by the caller alone, in one strip. Images are
+ * encoded one at a time, concurrent callers wait for their turn.
+ */
+bool
+JpegEncoder::encode (const unsigned char *pixels, const int cols, const int rows,
+                     const int step, const int channels, const int quality,
+                     std::vector<unsigned char> &out)
+{
+    if ((NULL == pixels) || (cols <= 0) || (rows <= 0) ||
+        ((1 != channels) && (3 != channels))) {
+        return false;
+    }
+
+    pthread_mutex_lock(&encode_mutex);
+
+    /* cut the image into strips */
+    int mcu = encoder_mcu_rows(channels, options.subsampling);
+    int mcu_count = (rows + mcu - 1) / mcu;
+    int count = std::max(1, std::min(get_threads(), mcu_count / min_strip_mcus));
+    if (options.optimize) {
+        count = 1;
+    }
+    int strip_mcus = (mcu_count + count - 1) / count;
+    count = (mcu_count + strip_mcus - 1) / strip_mcus;
+    for (int i = 0; i < count; i++) {
+        encoder_strip_st *strip = strips[i];
+        int first_row = i * strip_mcus * mcu;
+        strip->pixels = pixels + first_row * step;
+        strip->cols = cols;
+        strip->rows = std::min(strip_mcus * mcu, rows - first_row);
+        strip->step = step;
+        strip->channels = channels;
+        strip->quality = quality;
+        strip->first_mcu_row = i * strip_mcus;
+        strip->restart = (count > 1);
+        strip->raw = false;
+        strip->ok = false;
+#ifndef JCS_EXTENSIONS
+        strip->rgb.resize(cols * channels);
+#endif
+    }
+
+    bool ok = run(count, rows, out);
+    pthread_mutex_unlock(&encode_mutex);
+
+    return ok;
+}
+
+/**
+ * Encode an I420 image, given as Y, U and V planes, into out
+ *
+ * Same as encode(), except that libjpeg takes the planes as they are. The
+ * chroma planes are half the size of the Y plane, rounded up.
+ */
+bool
+JpegEncoder::encode_yuv (const unsigned char *const planes[3], const int steps[3],
+                         const int cols, const int rows, const int quality,
+                         std::vector<unsigned char> &out)
+{
+    if ((NULL == planes[0]) || (NULL == planes[1]) || (NULL == planes[2]) ||
+        (cols <= 0) || (rows <= 0)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&encode_mutex);
+
+    /* cut the image into strips of 16 rows of Y and 8 rows of U and V */
+    int mcu = 2 * DCTSIZE;
+    int mcu_count = (rows + mcu - 1) / mcu;
+    int count = std::max(1, std::min(get_threads(), mcu_count / min_strip_mcus));
+    if (options.optimize) {
+        count = 1;
+    }
+    int strip_mcus = (mcu_count + count - 1) / count;
+    count = (mcu_count + strip_mcus - 1) / strip_mcus;
+    for (int i = 0; i < count; i++) {
+        encoder_strip_st *strip = strips[i];
+        int first_row = i * strip_mcus * mcu;
+        for (int c = 0; c < 3; c++) {
+            int first = (0 == c) ? first_row : first_row / 2;
+            strip->planes[c] = planes[c] + first * steps[c];
+            strip->steps[c] = steps[c];
+        }
+        strip->cols = cols;
+        strip->rows = std::min(strip_mcus * mcu, rows - first_row);
+        strip->channels = 3;
+        strip->quality = quality;
+        strip->first_mcu_row = i * strip_mcus;
+        strip->restart = (count > 1);
+        strip->raw = true;
+        strip->ok = false;
+        strip->pad.resize(3 * mcu * ((cols + mcu - 1) & ~(mcu - 1)) / 2);
+    }
+
+    bool ok = run(count, rows, out);
+    pthread_mutex_unlock(&encode_mutex);
+
+    return ok;
+}
+
+/**
+ * Encode the strips set up by the caller, and stitch them
+ *
+ * Must be called with the encode mutex held.
+ */
+bool
+JpegEncoder::run (const int count, const int rows, std::vector<unsigned char> &out)
+{
+    /* hand them out, and do our share */
+    pthread_mutex_lock(&mutex);
+    strip_count = count;
+    next_strip = 0;
+    finished = 0;
+    generation++;
+    if (count > 1) {
+        pthread_cond_broadcast(&work);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    encode_strips();
+
+    pthread_mutex_lock(&mutex);
+    while (finished < strip_count) {
+        pthread_cond_wait(&done, &mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return stitch(rows, out);
+}
+
+/**
+ * Pick up and encode strips until there are none left
+ */
+void
+JpegEncoder::encode_strips (void)
+{
+    pthread_mutex_lock(&mutex);
+    while (next_strip < strip_count) {
+        encoder_strip_st *strip = strips[next_strip++];
+        pthread_mutex_unlock(&mutex);
+
+        strip->ok = encoder_compress_strip(strip);
+
+        pthread_mutex_lock(&mutex);
+        if (++finished == strip_count) {
+            pthread_cond_signal(&done);
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Stitch the encoded strips into a single JPEG
+ *
+ * The headers come from the first strip, with the image height patched in the
+ * frame header. The entropy coded data of the strips follow each other with a
+ * restart marker in between, and the restart markers within the strips are
+ * renumbered to continue the sequence of the previous strip.
+ */
+bool
+JpegEncoder::stitch (const int rows, std::vector<unsigned char> &out)
+{
+    size_t sof = 0, scan = 0;
+
+    for (int i = 0; i < strip_count; i++) {
+        if (!strips[i]->ok) {
+            return false;
+        }
+    }
+
+    /* headers and the data of the first strip, without EOI */
+    const std::vector<unsigned char> &first = strips[0]->data;
+    if (!encoder_parse(first, sof, scan)) {
+        return false;
+    }
+    out.assign(first.begin(), first.end() - 2);
+    out[sof + 5] = (rows >> 8) & 0xff;
+    out[sof + 6] = rows & 0xff;
+
+    for (int i = 1; i < strip_count; i++) {
+        const std::vector<unsigned char> &data = strips[i]->data;
+        if (!encoder_parse(data, sof, scan)) {
+            return false;
+        }
+
+        /* end the previous restart interval */
+        int shift = strips[i]->first_mcu_row;
+        out.push_back(0xff);
+        out.push_back(0xd0 + ((shift - 1) & 7));
+
+        /* copy the entropy coded data, renumbering the restart markers */
+        size_t pos = out.size();
+        out.insert(out.end(), data.begin() + scan, data.end() - 2);
+        for (; pos + 1 < out.size(); pos++) {
+            if ((0xff == out[pos]) && ((out[pos + 1] & 0xf8) == 0xd0)) {
+                out[pos + 1] = 0xd0 + (((out[pos + 1] - 0xd0) + shift) & 7);
+                pos++;
+            }
+        }
+    }
+
+    out.push_back(0xff);
+    out.push_back(0xd9);
+    return true;
+}
+
+/**
+ * Helper thread
+ *
+ * Sleeps until the next image is handed out, then encodes strips of it.
+ */
+void*
+JpegEncoder::encoder_thread (void *args)
+{
+    JpegEncoder *encoder = reinterpret_cast<JpegEncoder*>(args);
+    unsigned int seen = 0;
+
+    pthread_mutex_lock(&encoder->mutex);
+    while (true) {
+        while (encoder->running && (seen == encoder->generation)) {
+            pthread_cond_wait(&encoder->work, &encoder->mutex);
+        }
+        if (!encoder->running) {
+            break;
+        }
+        seen = encoder->generation;
+        pthread_mutex_unlock(&encoder->mutex);
+
+        encoder->encode_strips();
+
+        pthread_mutex_lock(&encoder->mutex);
+    }
+    pthread_mutex_unlock(&encoder->mutex);
+
+    pthread_exit(NULL);
+}
+
+} /* namespace sentry */
@@ -0,0 +1,120 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * encoder.h
+ *
+ * JPEG encoder class declaration
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#ifndef ENCODER_H_
+#define ENCODER_H_
+
+#include <pthread.h>
+#include <vector>
+
+namespace sentry {
+
+/** JPEG encoder settings */
+typedef struct encoder_options {
+    int subsampling;   /** chroma subsampling: 420, 422 or 444 */
+    bool fast_dct;     /** fast integer DCT, slightly less accurate */
+    bool optimize;     /** optimized Huffman tables, needs a single strip */
+} encoder_options_st;
+
+/** encoder state of a single strip, defined by the implementation */
+typedef struct encoder_strip encoder_strip_st;
+
+/**
+ * JpegEncoder class
+ *
+ * Encodes an image into a single baseline JPEG. The image is split into
+ * horizontal strips, which are compressed in parallel by a fixed pool of
+ * threads, then stitched together: every MCU row ends with a restart marker,
+ * so the strips can be encoded independently, and the result is one valid
+ * JPEG that any decoder can read. The calling thread encodes strips too, so a
+ * pool of N threads has N-1 helper threads.
+ *
+ * The encoder works straight from the caller's pixels into reused buffers,
+ * through the libjpeg API of libjpeg-turbo, which exposes the subsampling,
+ * DCT and Huffman settings that OpenCV's encoder hides. Optimized Huffman
+ * tables differ from strip to strip, so with optimize set every image is
+ * encoded as a single strip.
+ *
+ * I420 images are fed to libjpeg as raw YCbCr planes, which skips the color
+ * conversion and the chroma downsampling of the encoder. They are always
+ * encoded with 4:2:0 subsampling, as that is what the planes hold.
+ */
+class JpegEncoder {
+  public:
+    /** JPEG encoder constructor, 0 threads means one per core */
+    JpegEncoder (const int threads, const encoder_options_st &options);
+
+    /** JPEG encoder destructor */
+    virtual ~JpegEncoder (void);
+
+    /** number of threads encoding an image */
+    int get_threads (void) const;
+
+    /** encoder settings */
+    encoder_options_st get_options (void);
+
+    /** change the encoder settings, from the next image on */
+    void set_options (const encoder_options_st &options);
+
+    /** encode an image (BGR or grayscale) into out */
+    bool encode (const unsigned char *pixels, const int cols, const int rows,
+                 const int step, const int channels, const int quality,
+                 std::vector<unsigned char> &out);
+
+    /** encode an I420 image, given as Y, U and V planes, into out */
+    bool encode_yuv (const unsigned char *const planes[3], const int steps[3],
+                     const int cols, const int rows, const int quality,
+                     std::vector<unsigned char> &out);
+
+  private:
+    int threads;                          /** number of encoding threads */
+    encoder_options_st options;           /** encoder settings */
+    std::vector<pthread_t> thrds;         /** helper threads */
+    std::vector<encoder_strip_st*> strips; /** strip encoders, one per thread */
+    pthread_mutex_t encode_mutex;         /** one image at a time */
+    pthread_mutex_t mutex;                /** mutex to protect the job */
+    pthread_cond_t work;                  /** signals a new job to the helpers */
+    pthread_cond_t done;                  /** signals the last strip to the caller */
+    bool running;                         /** flag to indicate helpers should run */
+    unsigned int generation;              /** job counter */
+    int strip_count;                      /** number of strips of the job */
+    int next_strip;                       /** next strip to pick up */
+    int finished;                         /** number of strips done */
+
+    /** encode the strips set up by the caller, and stitch them */
+    bool run (const int count, const int rows, std::vector<unsigned char> &out);
+
+    /** pick up and encode strips until there are none left */
+    void encode_strips (void);
+
+    /** stitch the encoded strips into a single JPEG */
+    bool stitch (const int rows, std::vector<unsigned char> &out);
+
+    /** helper thread */
+    static void* encoder_thread (void *args);
+};
+
+} /* namespace sentry */
+
+#endif /* ENCODER_H_ */
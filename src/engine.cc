@@ -41,9 +41,11 @@ Engine::Engine (void)
 
     /* reset members */
     camera = NULL;
+    detector = NULL;
     rcmgr = NULL;
     chmgr = NULL;
     netcom = NULL;
+    sessions = NULL;
 }
 
 /**
@@ -65,17 +67,30 @@ Engine::~Engine (void)
     }
 
     /* destroy netcom uplink threads */
-    std::map<int, Worker*>::iterator it;
-    for (it = clients.begin(); it != clients.end(); ++it) {
-        delete it->second;
+    if (NULL != sessions) {
+        unsigned int slot = 0;
+        session_st *session;
+        while (NULL != (session = sessions->next(slot))) {
+            delete session->uplink;
+            session->uplink = NULL;
+        }
     }
-    clients.clear();
 
     /* delete netcom server */
     if (NULL != netcom) {
         delete netcom;
     }
 
+    /* delete the sessions, nobody uses them anymore */
+    if (NULL != sessions) {
+        delete sessions;
+    }
+
+    /* the detector uses the camera */
+    if (NULL != detector) {
+        delete detector;
+    }
+
     /* delete camera object */
     if (NULL != camera) {
         delete camera;
@@ -106,10 +121,15 @@ Engine::start (void)
 {
     /* initialize the objects and worker threads */
     try {
+        framework::Config config("netcom");
+        sessions = new SessionTable(config.get_int("max_sessions"));
         camera = new Camera();
+        if (framework::Config("camera").get_bool("detect")) {
+            detector = new Detector(get_queue(), camera);
+        }
         rcmgr = new RemoteControlManager(get_queue());
         chmgr = new ChassisManager(get_queue());
-        netcom = new Netcom(get_queue());
+        netcom = new Netcom(get_queue(), sessions);
     } catch (const return_code_en &rc) {
         dbug(DEBUG_LEVEL_ERROR, DEBUG_TYPE_ENGINE,
              "failed to initialize objects, return code " << rc);
@@ -153,58 +173,99 @@ Engine::start (void)
             }
 
             case MESSAGE_NETCOM_CLIENT_ALIVE: {
+                /* the client may have hung up in the meantime */
                 message_netcom_st *netcom_msg =
                     reinterpret_cast<message_netcom_st*>(msg);
-                netcom_uplink_st *uplink =
-                    reinterpret_cast<netcom_uplink_st*>(netcom_msg->client);
+                int idx = sessions->read_lock();
+                session_st *session = sessions->lookup(netcom_msg->id);
+                sessions->read_unlock(idx);
+                if ((NULL == session) || (NULL != session->uplink)) {
+                    break;
+                }
                 try {
-                    Worker *client_worker = new NetcomUplink(get_queue(),
-                                                             uplink, camera);
-                    clients.insert(std::pair<int, Worker*>
-                                   (netcom_msg->id, client_worker));
+                    session->uplink = new NetcomUplink(get_queue(), session, camera);
                     chmgr->get_queue()->push_msg(MESSAGE_USER_UP);
                 } catch (const return_code_en &rc) {
                     dbug(DEBUG_LEVEL_ERROR, DEBUG_TYPE_ENGINE,
                          "failed to create netcom uplink for client " <<
-                         uplink->name);
+                         session->name);
                 }
                 break;
             }
 
             case MESSAGE_NETCOM_CLIENT_DEAD: {
+                /* the uplink goes first, it uses the session until it's deleted */
                 message_netcom_st *netcom_msg =
                     reinterpret_cast<message_netcom_st*>(msg);
-                std::map<int, Worker*>::iterator it =
-                    clients.find(netcom_msg->id);
-                if (it != clients.end()) {
-                    delete it->second;
-                    clients.erase(it);
+                int idx = sessions->read_lock();
+                session_st *session = sessions->lookup(netcom_msg->id);
+                sessions->read_unlock(idx);
+                if (NULL == session) {
+                    break;
+                }
+                if (NULL != session->uplink) {
+                    delete session->uplink;
+                    session->uplink = NULL;
                     chmgr->get_queue()->push_msg(MESSAGE_USER_DOWN);
                 }
+                sessions->remove(netcom_msg->id);
                 break;
             }
 
-            case MESSAGE_CAMERA_REQUEST: {
-                message_netcom_st *netcom_msg =
-                    reinterpret_cast<message_netcom_st*>(msg);
-                std::map<int, Worker*>::iterator it =
-                    clients.find(netcom_msg->id);
-                if (it != clients.end()) {
-                    it->second->get_queue()->push_msg(msg);
+            case MESSAGE_CAMERA_REQUEST:
+            case MESSAGE_CAMERA_REPORT:
+            case MESSAGE_SNAPSHOT_REQUEST:
+            case MESSAGE_RING_DUMP:
+            case MESSAGE_CAMERA_ROI:
+            case MESSAGE_CAMERA_MODE:
+            case MESSAGE_CAMERA_NACK:
+            case MESSAGE_DETECTION_SUBSCRIBE: {
+                message_client_st *client_msg =
+                    reinterpret_cast<message_client_st*>(msg);
+                int idx = sessions->read_lock();
+                session_st *session = sessions->lookup(client_msg->id);
+                if ((NULL != session) && (NULL != session->uplink)) {
+                    session->uplink->get_queue()->push_msg(msg);
                     msg_forwarded = true;
                 }
+                sessions->read_unlock(idx);
                 break;
             }
 
             case MESSAGE_SENSOR_DATA: {
                 message_sensor_st *sensor_msg =
                     reinterpret_cast<message_sensor_st*>(msg);
-                std::map<int, Worker*>::iterator it;
-                for (it = clients.begin(); it != clients.end(); ++it) {
+                int idx = sessions->read_lock();
+                unsigned int slot = 0;
+                session_st *session;
+                while (NULL != (session = sessions->next(slot))) {
+                    if (NULL == session->uplink) {
+                        continue;
+                    }
                     message_sensor_st *tmp_msg = new message_sensor_st;
                     *tmp_msg = *sensor_msg;
-                    it->second->get_queue()->push_msg(tmp_msg);
+                    session->uplink->get_queue()->push_msg(tmp_msg);
+                }
+                sessions->read_unlock(idx);
+                break;
+            }
+
+            case MESSAGE_DETECTION: {
+                /* the uplinks drop it unless their client subscribed */
+                message_detection_st *detection_msg =
+                    reinterpret_cast<message_detection_st*>(msg);
+                int idx = sessions->read_lock();
+                unsigned int slot = 0;
+                session_st *session;
+                while (NULL != (session = sessions->next(slot))) {
+                    if (NULL == session->uplink) {
+                        continue;
+                    }
+                    message_detection_st *tmp_msg = new message_detection_st;
+                    *tmp_msg = *detection_msg;
+                    session->uplink->get_queue()->push_msg(tmp_msg);
                 }
+                sessions->read_unlock(idx);
                 break;
             }
 
@@ -25,10 +25,10 @@
 #ifndef ENGINE_H_
 #define ENGINE_H_
 
-#include <map>
-
 #include "worker.h"
 #include "camera.h"
+#include "detector.h"
+#include "session.h"
 #include "message_queue.h"
 #include "framework.h"
 
@@ -53,10 +53,11 @@ class Engine : public Worker {
 
   private:
     Camera *camera;                 /** camera object */
+    Detector *detector;             /** person detector, NULL if disabled */
     Worker *rcmgr;                  /** remote control manager worker */
     Worker *chmgr;                  /** chassis manager worker */
     Worker *netcom;                 /** netcom server */
-    std::map<int, Worker*> clients; /** netcom uplink workers */
+    SessionTable *sessions;         /** netcom client sessions */
 };
 
 } /* namespace sentry */
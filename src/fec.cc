@@ -0,0 +1,290 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * fec.cc
+ *
+ * Forward error correction of image fragments
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <string.h>
+#include <algorithm>
+
+#include "fec.h"
+
+namespace sentry {
+
+/**
+ * Parity code constructor
+ *
+ * A group of 0 (or less) turns parity off, there are never more parity
+ * fragments in a group than data fragments.
+ */
+ParityCode::ParityCode (const int group, const int parity)
+        : group(std::max(0, group)), parity(std::max(1, std::min(parity, group)))
+{
+}
+
+/**
+ * Data fragments per group, 0 if parity is off
+ */
+int
+ParityCode::get_group (void) const
+{
+    return group;
+}
+
+/**
+ * Parity fragments per group
+ */
+int
+ParityCode::get_parity (void) const
+{
+    return parity;
+}
+
+/**
+ * Number of parity fragments of an image of frags data fragments
+ */
+int
+ParityCode::get_parity_count (const int frags) const
+{
+    if (0 == group) {
+        return 0;
+    }
+    return (frags / group) * parity + std::min(parity, frags % group);
+}
+
+/**
+ * Data fragments of a parity fragment, from first to end, parity apart
+ */
+void
+ParityCode::get_stripe (const int frags, const int index, int &first, int &end) const
+{
+    int start = (index / parity) * group;
+    first = start + index % parity;
+    end = std::min(start + group, frags);
+}
+
+/**
+ * Parity fragment covering a data fragment
+ */
+int
+ParityCode::get_parity_index (const int frag) const
+{
+    return (frag / group) * parity + (frag % group) % parity;
+}
+
+/**
+ * Fragment assembler constructor
+ */
+FragmentAssembler::FragmentAssembler (void)
+        : size(0), frag_size(1), frags(0), received(0), recovered(0)
+{
+}
+
+/**
+ * Start over with a new image of the given size
+ *
+ * An empty image still takes a fragment, like the sender sends it.
+ */
+void
+FragmentAssembler::start (const int size, const int frag_size, const ParityCode &code)
+{
+    this->code = code;
+    this->size = size;
+    this->frag_size = std::max(1, frag_size);
+    frags = std::max(1, (size + this->frag_size - 1) / this->frag_size);
+    received = 0;
+    recovered = 0;
+    data.resize(frags * this->frag_size);
+    data_received.assign(frags, false);
+    int count = code.get_parity_count(frags);
+    parity.assign(count * this->frag_size, 0);
+    parity_received.assign(count, false);
+}
+
+/**
+ * Add a fragment by its sequence number, returns false if not needed
+ *
+ * Duplicates, fragments of the wrong size and the ones of a stripe already
+ * complete aren't needed.
+ */
+bool
+FragmentAssembler::add (const int seq, const char *payload, const int length)
+{
+    int frag = seq - 1;
+    if ((frag < 0) || (length < 0) || (length > frag_size)) {
+        return false;
+    }
+
+    if (frag < frags) {
+        if (data_received[frag] || (length != get_length(frag))) {
+            return false;
+        }
+        memcpy(&data[frag * frag_size], payload, length);
+        data_received[frag] = true;
+        received++;
+        if (0 != code.get_group()) {
+            recover(code.get_parity_index(frag));
+        }
+        return true;
+    }
+
+    int index = frag - frags;
+    if ((index >= (int)parity_received.size()) || parity_received[index]) {
+        return false;
+    }
+    memcpy(&parity[index * frag_size], payload, length);
+    parity_received[index] = true;
+    recover(index);
+    return true;
+}
+
+/**
+ * Recover the data fragment missing from a stripe, if it's the only one
+ */
+void
+FragmentAssembler::recover (const int index)
+{
+    if (!parity_received[index]) {
+        return;
+    }
+    int first, end, missing = -1;
+    code.get_stripe(frags, index, first, end);
+    for (int frag = first; frag < end; frag += code.get_parity()) {
+        if (!data_received[frag]) {
+            if (missing >= 0) {
+                return;
+            }
+            missing = frag;
+        }
+    }
+    if (missing < 0) {
+        return;
+    }
+
+    scratch.assign(parity.begin() + index * frag_size,
+                   parity.begin() + (index + 1) * frag_size);
+    for (int frag = first; frag < end; frag += code.get_parity()) {
+        if (frag == missing) {
+            continue;
+        }
+        const char *src = &data[frag * frag_size];
+        for (int i = 0; i < get_length(frag); i++) {
+            scratch[i] ^= src[i];
+        }
+    }
+    memcpy(&data[missing * frag_size], &scratch[0], get_length(missing));
+    data_received[missing] = true;
+    received++;
+    recovered++;
+}
+
+/**
+ * All data fragments are in, received or recovered
+ */
+bool
+FragmentAssembler::is_complete (void) const
+{
+    return (0 != frags) && (received == frags);
+}
+
+/**
+ * An image was started
+ */
+bool
+FragmentAssembler::is_started (void) const
+{
+    return (0 != frags);
+}
+
+/**
+ * Data fragments still missing
+ */
+int
+FragmentAssembler::get_missing (void) const
+{
+    return frags - received;
+}
+
+/**
+ * Data fragments recovered from parity
+ */
+int
+FragmentAssembler::get_recovered (void) const
+{
+    return recovered;
+}
+
+/**
+ * Number of fragments of the image, data and parity
+ */
+int
+FragmentAssembler::get_count (void) const
+{
+    return frags + parity_received.size();
+}
+
+/**
+ * Data fragments missing, as sequence number and count of each gap
+ */
+void
+FragmentAssembler::get_gaps (std::vector<std::pair<int, int> > &gaps) const
+{
+    gaps.clear();
+    for (int frag = 0; frag < frags; frag++) {
+        if (data_received[frag]) {
+            continue;
+        }
+        if (!gaps.empty() && (gaps.back().first + gaps.back().second == frag + 1)) {
+            gaps.back().second++;
+        } else {
+            gaps.push_back(std::make_pair(frag + 1, 1));
+        }
+    }
+}
+
+/**
+ * The image, complete or not
+ */
+char*
+FragmentAssembler::get_data (void)
+{
+    return &data[0];
+}
+
+/**
+ * Size of the image
+ */
+int
+FragmentAssembler::get_size (void) const
+{
+    return size;
+}
+
+/**
+ * Size of a data fragment
+ */
+int
+FragmentAssembler::get_length (const int frag) const
+{
+    return std::max(0, std::min(frag_size, size - frag * frag_size));
+}
+
+} /* namespace sentry */
@@ -0,0 +1,139 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * fec.h
+ *
+ * Forward error correction of image fragments
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#ifndef FEC_H_
+#define FEC_H_
+
+#include <utility>
+#include <vector>
+
+namespace sentry {
+
+/**
+ * ParityCode class
+ *
+ * XOR parity of the fragments of an image. The data fragments are split into
+ * groups of "group" fragments, and each group gets "parity" parity
+ * fragments: parity fragment j of a group is the XOR of the group's data
+ * fragments j, j + parity, j + 2 * parity and so on (a stripe), the shorter
+ * ones padded with zeros. A group survives the loss of a fragment per
+ * stripe, so any burst of up to "parity" fragments in a row, for an overhead
+ * of parity / group.
+ *
+ * Parity fragments follow the data fragments of the image, numbered on from
+ * them, group by group; the last group may be short, and has no more stripes
+ * than data fragments. Receivers that don't know about them drop them as out
+ * of range. A group of 0 turns parity off.
+ */
+class ParityCode {
+  public:
+    /** parity code constructor */
+    ParityCode (const int group = 0, const int parity = 1);
+
+    /** data fragments per group, 0 if parity is off */
+    int get_group (void) const;
+
+    /** parity fragments per group */
+    int get_parity (void) const;
+
+    /** number of parity fragments of an image of frags data fragments */
+    int get_parity_count (const int frags) const;
+
+    /** data fragments of a parity fragment, from first to end, parity apart */
+    void get_stripe (const int frags, const int index, int &first, int &end) const;
+
+    /** parity fragment covering a data fragment */
+    int get_parity_index (const int frag) const;
+
+  private:
+    int group;    /** data fragments per group */
+    int parity;   /** parity fragments per group */
+};
+
+/**
+ * FragmentAssembler class
+ *
+ * Puts an image back together from its data and parity fragments, as they
+ * arrive, in any order. A stripe missing a single data fragment gets it
+ * back from the parity as soon as the rest of the stripe is in, without
+ * waiting for the whole image.
+ */
+class FragmentAssembler {
+  public:
+    /** fragment assembler constructor */
+    FragmentAssembler (void);
+
+    /** start over with a new image of the given size */
+    void start (const int size, const int frag_size, const ParityCode &code);
+
+    /** add a fragment by its sequence number, returns false if not needed */
+    bool add (const int seq, const char *payload, const int length);
+
+    /** all data fragments are in, received or recovered */
+    bool is_complete (void) const;
+
+    /** an image was started */
+    bool is_started (void) const;
+
+    /** data fragments still missing */
+    int get_missing (void) const;
+
+    /** data fragments recovered from parity */
+    int get_recovered (void) const;
+
+    /** number of fragments of the image, data and parity */
+    int get_count (void) const;
+
+    /** data fragments missing, as sequence number and count of each gap */
+    void get_gaps (std::vector<std::pair<int, int> > &gaps) const;
+
+    /** the image, complete or not */
+    char* get_data (void);
+
+    /** size of the image */
+    int get_size (void) const;
+
+  private:
+    ParityCode code;                      /** parity layout of the image */
+    int size;                             /** size of the image */
+    int frag_size;                        /** size of a whole fragment */
+    int frags;                            /** data fragments of the image */
+    int received;                         /** data fragments received or recovered */
+    int recovered;                        /** data fragments recovered from parity */
+    std::vector<char> data;               /** the image */
+    std::vector<bool> data_received;      /** data fragments received or recovered */
+    std::vector<char> parity;             /** parity fragments, frag_size apart */
+    std::vector<bool> parity_received;    /** parity fragments received */
+    std::vector<char> scratch;            /** recovery workspace */
+
+    /** size of a data fragment */
+    int get_length (const int frag) const;
+
+    /** recover the data fragment missing from a stripe, if it's the only one */
+    void recover (const int index);
+};
+
+} /* namespace sentry */
+
+#endif /* FEC_H_ */
@@ -0,0 +1,399 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * frame.cc
+ *
+ * Camera frame implementation
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "frame.h"
+
+namespace sentry {
+
+/** heap allocations of the capture and encode path */
+static std::atomic<unsigned long> alloc_count(0);
+
+/**
+ * Count a heap allocation of the capture and encode path
+ */
+void
+frame_count_alloc (void)
+{
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Number of heap allocations of the capture and encode path so far
+ *
+ * Once the camera has been streaming for a little while, this must stay the
+ * same from frame to frame.
+ */
+unsigned long
+frame_alloc_count (void)
+{
+    return alloc_count.load(std::memory_order_relaxed);
+}
+
+/**
+ * Frame constructor
+ */
+Frame::Frame (FramePool *pool)
+        : pool(pool), refcnt(1), seq(0), time(), format(FRAME_FORMAT_BGR),
+          bgr_valid(false), used(0)
+{
+    pthread_mutex_init(&mutex, NULL);
+}
+
+/**
+ * Frame destructor
+ */
+Frame::~Frame (void)
+{
+    pthread_mutex_destroy(&mutex);
+}
+
+/**
+ * Take a reference
+ */
+void
+Frame::get (void)
+{
+    refcnt.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Take a reference unless the frame is already back in its pool
+ *
+ * For readers that found the frame through a shared pointer without holding
+ * a reference: the frame may have been released (or even reused) meanwhile.
+ * Frames are never freed while the pool exists, so looking at the counter is
+ * safe, and a frame whose counter dropped to zero is not resurrected. The
+ * caller must check that the pointer it followed still leads to this frame.
+ */
+bool
+Frame::try_get (void)
+{
+    int count = refcnt.load(std::memory_order_relaxed);
+    while (count > 0) {
+        if (refcnt.compare_exchange_weak(count, count + 1, std::memory_order_acquire,
+                                         std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Drop a reference
+ *
+ * The last owner gives the frame back to the pool. The release/acquire pair
+ * makes sure that every write to the frame happens before it is reused.
+ */
+void
+Frame::put (void)
+{
+    if (1 == refcnt.fetch_sub(1, std::memory_order_release)) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        pool->release(this);
+    }
+}
+
+/**
+ * Sequence number of the frame
+ */
+uint32_t
+Frame::get_seq (void) const
+{
+    return seq;
+}
+
+/**
+ * Set the sequence number, before the frame is published
+ */
+void
+Frame::set_seq (const uint32_t seq)
+{
+    this->seq = seq;
+}
+
+/**
+ * Capture time of the frame (CLOCK_MONOTONIC)
+ */
+const struct timespec&
+Frame::get_time (void) const
+{
+    return time;
+}
+
+/**
+ * Set the capture time, before the frame is published
+ */
+void
+Frame::set_time (const struct timespec &time)
+{
+    this->time = time;
+}
+
+/**
+ * Number of cols (i.e. width)
+ */
+int
+Frame::get_cols (void) const
+{
+    return image.cols;
+}
+
+/**
+ * Number of rows (i.e. height)
+ */
+int
+Frame::get_rows (void) const
+{
+    if (FRAME_FORMAT_I420 == format) {
+        return image.rows * 2 / 3;
+    }
+    return image.rows;
+}
+
+/**
+ * Pixel layout of the captured image
+ */
+frame_format_en
+Frame::get_format (void) const
+{
+    return format;
+}
+
+/**
+ * Set the pixel layout, before the frame is published
+ */
+void
+Frame::set_format (const frame_format_en format)
+{
+    this->format = format;
+}
+
+/**
+ * Captured image
+ */
+const cv::Mat&
+Frame::get_image (void) const
+{
+    return image;
+}
+
+/**
+ * Luma of the image (or the image itself if BGR), for detection
+ *
+ * The Y plane of an I420 image is a grayscale image as is, so the detectors
+ * can skip their own color conversion.
+ */
+cv::Mat
+Frame::get_luma (void) const
+{
+    if (FRAME_FORMAT_I420 == format) {
+        return image.rowRange(0, get_rows());
+    }
+    return image;
+}
+
+/**
+ * Y, U and V planes of an I420 image
+ *
+ * The planes are views into the image, nothing is copied.
+ */
+void
+Frame::get_planes (cv::Mat planes[3]) const
+{
+    int cols = get_cols();
+    int rows = get_rows();
+    unsigned char *u = image.data + cols * rows;
+    unsigned char *v = u + (cols / 2) * (rows / 2);
+
+    planes[0] = image.rowRange(0, rows);
+    planes[1] = cv::Mat(rows / 2, cols / 2, CV_8UC1, u);
+    planes[2] = cv::Mat(rows / 2, cols / 2, CV_8UC1, v);
+}
+
+/**
+ * The image in BGR, converted if needed, with the frame locked
+ *
+ * I420 frames are converted on the first call only, into a buffer the frame
+ * keeps from one use to the next.
+ */
+const cv::Mat&
+Frame::get_bgr (void)
+{
+    if (FRAME_FORMAT_BGR == format) {
+        return image;
+    }
+    if (!bgr_valid) {
+        const unsigned char *buffer = bgr.data;
+        cv::cvtColor(image, bgr, CV_YUV2BGR_I420);
+        if (bgr.data != buffer) {
+            frame_count_alloc();
+        }
+        bgr_valid = true;
+    }
+    return bgr;
+}
+
+/**
+ * Capture buffer, only for the producer before the frame is published
+ */
+cv::Mat&
+Frame::get_buffer (void)
+{
+    return image;
+}
+
+/**
+ * Lock the encoding cache
+ */
+void
+Frame::lock (void)
+{
+    pthread_mutex_lock(&mutex);
+}
+
+/**
+ * Unlock the encoding cache
+ */
+void
+Frame::unlock (void)
+{
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Encoding of the given variant (and tile), NULL if not yet encoded
+ *
+ * Must be called with the frame locked. The returned encoding stays valid as
+ * long as the caller holds a reference to the frame.
+ */
+frame_encoding_st*
+Frame::find_encoding (const frame_variant_st &variant, const int tile)
+{
+    std::list<frame_encoding_st>::iterator it = encodings.begin();
+    for (unsigned int i = 0; i < used; i++, ++it) {
+        if ((it->tile == tile) && (it->variant == variant)) {
+            return &(*it);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Add an empty encoding for the given variant (and tile)
+ *
+ * Must be called with the frame locked. Slots left over from the previous use
+ * of the frame are reused, along with their buffers.
+ */
+frame_encoding_st*
+Frame::add_encoding (const frame_variant_st &variant, const int tile)
+{
+    std::list<frame_encoding_st>::iterator it = encodings.begin();
+    for (unsigned int i = 0; i < used; i++) {
+        ++it;
+    }
+    if (it == encodings.end()) {
+        frame_count_alloc();
+        it = encodings.insert(it, frame_encoding_st());
+    }
+    used++;
+
+    frame_encoding_st *encoding = &(*it);
+    encoding->data.clear();
+    encoding->variant = variant;
+    encoding->tile = tile;
+    encoding->x = 0;
+    encoding->y = 0;
+    encoding->encode_usec = 0;
+    encoding->cols = 0;
+    encoding->rows = 0;
+    return encoding;
+}
+
+/**
+ * Frame pool constructor
+ */
+FramePool::FramePool (void)
+{
+    pthread_mutex_init(&mutex, NULL);
+    frames.reserve(16);
+}
+
+/**
+ * Frame pool destructor, every frame must be back in the pool
+ */
+FramePool::~FramePool (void)
+{
+    for (unsigned int i = 0; i < frames.size(); i++) {
+        delete frames[i];
+    }
+    pthread_mutex_destroy(&mutex);
+}
+
+/**
+ * Get a free frame, the caller owns the first reference
+ *
+ * The frame keeps the image and the encoding slots of its previous use, but
+ * none of its encodings are valid.
+ */
+Frame*
+FramePool::acquire (void)
+{
+    Frame *frame = NULL;
+
+    pthread_mutex_lock(&mutex);
+    if (!frames.empty()) {
+        frame = frames.back();
+        frames.pop_back();
+    }
+    pthread_mutex_unlock(&mutex);
+
+    if (NULL == frame) {
+        frame_count_alloc();
+        frame = new Frame(this);
+    }
+    frame->refcnt.store(1, std::memory_order_relaxed);
+    frame->seq = 0;
+    frame->format = FRAME_FORMAT_BGR;
+    frame->bgr_valid = false;
+    frame->used = 0;
+    return frame;
+}
+
+/**
+ * Put a frame back, called when its last reference is dropped
+ */
+void
+FramePool::release (Frame *frame)
+{
+    pthread_mutex_lock(&mutex);
+    if (frames.size() == frames.capacity()) {
+        frame_count_alloc();
+    }
+    frames.push_back(frame);
+    pthread_mutex_unlock(&mutex);
+}
+
+} /* namespace sentry */
@@ -0,0 +1,217 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * frame.h
+ *
+ * Camera frame class declaration
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#ifndef FRAME_H_
+#define FRAME_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <atomic>
+#include <list>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+namespace sentry {
+
+/** pixel layout of a captured image */
+typedef enum frame_format {
+    FRAME_FORMAT_BGR = 0,    /** packed BGR, 3 bytes per pixel */
+    FRAME_FORMAT_I420 = 1    /** planar YUV 4:2:0, Y plane then quarter size U and V */
+} frame_format_en;
+
+/** encoding parameters of a frame */
+typedef struct frame_variant {
+    int scale;     /** downscale factor, 1 means full resolution */
+    int quality;   /** JPEG quality */
+    cv::Rect roi;  /** region of interest, empty for the whole frame */
+    cv::Size size; /** output size before downscaling, empty for the size of the roi */
+} frame_variant_st;
+
+/** true if two variants have the same encoding parameters */
+inline bool
+operator== (const frame_variant_st &a, const frame_variant_st &b)
+{
+    return ((a.scale == b.scale) && (a.quality == b.quality) && (a.roi == b.roi) &&
+            (a.size.width == b.size.width) && (a.size.height == b.size.height));
+}
+
+/** encoded image of a frame */
+typedef struct frame_encoding {
+    frame_variant_st variant;          /** encoding parameters */
+    int tile;                          /** tile index, -1 for the whole frame */
+    int x;                             /** left edge of the tile, scaled */
+    int y;                             /** top edge of the tile, scaled */
+    int cols;                          /** cols of the encoded image */
+    int rows;                          /** rows of the encoded image */
+    std::vector<unsigned char> data;   /** JPEG image */
+    cv::Mat scaled;                    /** scaled image, kept for reuse */
+    unsigned long encode_usec;         /** time it took to encode */
+} frame_encoding_st;
+
+class FramePool;
+
+/** count a heap allocation of the capture and encode path */
+extern void frame_count_alloc (void);
+
+/** number of heap allocations of the capture and encode path so far */
+extern unsigned long frame_alloc_count (void);
+
+/**
+ * Frame class
+ *
+ * A captured camera frame, published by the camera thread and shared by every
+ * netcom uplink. Frames are reference counted: whoever holds a pointer to a
+ * frame owns a reference, and must drop it with put() when done. The frame
+ * deletes itself when the last reference is dropped.
+ *
+ * Frames come from a FramePool, and go back to it instead of being deleted, so
+ * the capture buffer, the encoding slots and their output buffers are reused
+ * from frame to frame.
+ *
+ * Besides the captured image, a frame caches its encodings, so each variant
+ * (scale and quality) is encoded at most once no matter how many clients ask
+ * for it. Tiles of the frame, used by delta streams, are cached the same way.
+ * The cache is protected by the frame lock.
+ *
+ * The image is either BGR, or I420 as it comes from the sensor. I420 images
+ * are a single channel cv::Mat, 3/2 times as high as the frame, with the U and
+ * V planes under the Y plane (the layout OpenCV uses). The BGR version of an
+ * I420 frame is only made if a stage can't work with the planes, once.
+ */
+class Frame {
+  public:
+    /** take a reference */
+    void get (void);
+
+    /** take a reference unless the frame is already back in its pool */
+    bool try_get (void);
+
+    /** drop a reference */
+    void put (void);
+
+    /** sequence number of the frame */
+    uint32_t get_seq (void) const;
+
+    /** set the sequence number, before the frame is published */
+    void set_seq (const uint32_t seq);
+
+    /** capture time of the frame (CLOCK_MONOTONIC) */
+    const struct timespec& get_time (void) const;
+
+    /** set the capture time, before the frame is published */
+    void set_time (const struct timespec &time);
+
+    /** number of cols (i.e. width) */
+    int get_cols (void) const;
+
+    /** number of rows (i.e. height) */
+    int get_rows (void) const;
+
+    /** pixel layout of the captured image */
+    frame_format_en get_format (void) const;
+
+    /** set the pixel layout, before the frame is published */
+    void set_format (const frame_format_en format);
+
+    /** captured image */
+    const cv::Mat& get_image (void) const;
+
+    /** luma of the image (or the image itself if BGR), for detection */
+    cv::Mat get_luma (void) const;
+
+    /** Y, U and V planes of an I420 image */
+    void get_planes (cv::Mat planes[3]) const;
+
+    /** the image in BGR, converted if needed, with the frame locked */
+    const cv::Mat& get_bgr (void);
+
+    /** capture buffer, only for the producer before the frame is published */
+    cv::Mat& get_buffer (void);
+
+    /** lock the encoding cache */
+    void lock (void);
+
+    /** unlock the encoding cache */
+    void unlock (void);
+
+    /** encoding of the given variant (and tile), NULL if not yet encoded */
+    frame_encoding_st* find_encoding (const frame_variant_st &variant,
+                                      const int tile = -1);
+
+    /** add an empty encoding for the given variant (and tile) */
+    frame_encoding_st* add_encoding (const frame_variant_st &variant,
+                                     const int tile = -1);
+
+  private:
+    friend class FramePool;
+
+    FramePool *pool;                          /** pool the frame belongs to */
+    std::atomic<int> refcnt;                  /** reference counter */
+    uint32_t seq;                             /** frame sequence number */
+    struct timespec time;                     /** capture time */
+    frame_format_en format;                   /** pixel layout of the image */
+    cv::Mat image;                            /** captured image */
+    cv::Mat bgr;                              /** BGR version of an I420 image */
+    bool bgr_valid;                           /** true if bgr is the current image */
+    pthread_mutex_t mutex;                    /** mutex to protect the encodings */
+    std::list<frame_encoding_st> encodings;   /** encoding slots, used or not */
+    unsigned int used;                        /** number of encodings in use */
+
+    /** frame constructor, only the pool creates frames */
+    Frame (FramePool *pool);
+
+    /** frame destructor, only the pool destroys frames */
+    virtual ~Frame (void);
+};
+
+/**
+ * FramePool class
+ *
+ * Keeps the frames that are not in use. The pool only allocates a new frame
+ * when all of its frames are busy, which stops happening once the number of
+ * frames in flight (captured, published, being sent) reaches its peak.
+ */
+class FramePool {
+  public:
+    /** frame pool constructor */
+    FramePool (void);
+
+    /** frame pool destructor, every frame must be back in the pool */
+    virtual ~FramePool (void);
+
+    /** get a free frame, the caller owns the first reference */
+    Frame* acquire (void);
+
+    /** put a frame back, called when its last reference is dropped */
+    void release (Frame *frame);
+
+  private:
+    pthread_mutex_t mutex;                    /** mutex to protect the pool */
+    std::vector<Frame*> frames;               /** free frames */
+};
+
+} /* namespace sentry */
+
+#endif /* FRAME_H_ */
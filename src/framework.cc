@@ -61,9 +61,10 @@ Config::Config (const char *section)
             dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_FRAMEWORK,
                  "parsing section '" << section << "' in file " << config_file);
 
-            /* read the entire section at once */
-            file.getline(line, 512, '}');
-            std::istringstream iss(line);
+            /* read the entire section at once, however long it is */
+            std::string body;
+            std::getline(file, body, '}');
+            std::istringstream iss(body);
             std::istream_iterator<std::string> begin(iss);
             std::istream_iterator<std::string> end;
             std::string key;
@@ -65,7 +65,10 @@ typedef enum debug_type {
     DEBUG_TYPE_CHMGR,
     DEBUG_TYPE_NETCOM,
     DEBUG_TYPE_NETCOM_UPLINK,
-    DEBUG_TYPE_CAMERA
+    DEBUG_TYPE_CAMERA,
+    DEBUG_TYPE_RECORDER,
+    DEBUG_TYPE_TIMELAPSE,
+    DEBUG_TYPE_DETECTOR
 } debug_type_en;
 
 /** debug levels */
@@ -89,10 +89,50 @@ message_length (const message_st *msg)
         return sizeof(message_sensor_st);
     }
 
+    case MESSAGE_CAMERA_REQUEST: {
+        return sizeof(message_camera_st);
+    }
+
+    case MESSAGE_CAMERA_REPORT: {
+        return sizeof(message_report_st);
+    }
+
+    case MESSAGE_SNAPSHOT_REQUEST: {
+        return sizeof(message_snapshot_st);
+    }
+
+    case MESSAGE_RING_DUMP: {
+        return sizeof(message_ring_st);
+    }
+
+    case MESSAGE_CAMERA_ROI: {
+        return sizeof(message_roi_st);
+    }
+
+    case MESSAGE_DETECTION_SUBSCRIBE: {
+        return sizeof(message_subscribe_st);
+    }
+
+    case MESSAGE_CAMERA_MODE: {
+        return sizeof(message_mode_st);
+    }
+
+    case MESSAGE_CAMERA_NACK: {
+        return sizeof(message_nack_st);
+    }
+
+    case MESSAGE_DETECTION: {
+        return sizeof(message_detection_st);
+    }
+
     case MESSAGE_CAMERA_FRAME: {
         return sizeof(message_frame_st);
     }
 
+    case MESSAGE_CAMERA_TILE: {
+        return sizeof(message_tile_st);
+    }
+
     case MESSAGE_NETCOM_CONNECT: {
         return sizeof(message_connect_st);
     }
@@ -125,9 +165,83 @@ message_print (message_st *msg)
            << " length " << message_length(msg);
 
     switch (type) {
+    case MESSAGE_CAMERA_REQUEST: {
+        message_camera_st *cmsg = reinterpret_cast<message_camera_st*>(msg);
+        strstr << " id " << cmsg->id << " fps " << cmsg->fps
+               << " tier " << cmsg->tier << " mode " << cmsg->mode;
+        break;
+    }
+
+    case MESSAGE_SNAPSHOT_REQUEST: {
+        message_snapshot_st *smsg = reinterpret_cast<message_snapshot_st*>(msg);
+        strstr << " id " << smsg->id << " tier " << smsg->tier;
+        break;
+    }
+
+    case MESSAGE_RING_DUMP: {
+        message_ring_st *rmsg = reinterpret_cast<message_ring_st*>(msg);
+        strstr << " id " << rmsg->id << " target " << rmsg->target
+               << " seconds " << rmsg->seconds;
+        break;
+    }
+
+    case MESSAGE_CAMERA_ROI: {
+        message_roi_st *omsg = reinterpret_cast<message_roi_st*>(msg);
+        strstr << " id " << omsg->id << " roi " << omsg->cols << "x" << omsg->rows
+               << "+" << omsg->x << "+" << omsg->y << " out " << omsg->out_cols << "x"
+               << omsg->out_rows;
+        break;
+    }
+
+    case MESSAGE_CAMERA_MODE: {
+        message_mode_st *mmsg = reinterpret_cast<message_mode_st*>(msg);
+        strstr << " id " << mmsg->id << " mode " << mmsg->cols << "x" << mmsg->rows
+               << " fps " << mmsg->fps << " subsampling " << mmsg->subsampling
+               << " fast dct " << mmsg->fast_dct;
+        break;
+    }
+
+    case MESSAGE_DETECTION_SUBSCRIBE: {
+        message_subscribe_st *smsg = reinterpret_cast<message_subscribe_st*>(msg);
+        strstr << " id " << smsg->id << " enable " << smsg->enable;
+        break;
+    }
+
+    case MESSAGE_DETECTION: {
+        message_detection_st *dmsg = reinterpret_cast<message_detection_st*>(msg);
+        strstr << " frame id " << dmsg->frame_id << " objects " << dmsg->count
+               << " latency " << dmsg->latency << " ms";
+        break;
+    }
+
+    case MESSAGE_CAMERA_REPORT: {
+        message_report_st *rmsg = reinterpret_cast<message_report_st*>(msg);
+        strstr << " id " << rmsg->id << " received " << rmsg->frags_received
+               << " lost " << rmsg->frags_lost << " completed "
+               << rmsg->frames_completed;
+        break;
+    }
+
+    case MESSAGE_CAMERA_NACK: {
+        message_nack_st *nmsg = reinterpret_cast<message_nack_st*>(msg);
+        strstr << " id " << nmsg->id << " frame id " << nmsg->frame_id << " tile "
+               << nmsg->tile_id << " fragments " << nmsg->frag_seq << "+"
+               << nmsg->frag_count;
+        break;
+    }
+
     case MESSAGE_CAMERA_FRAME: {
         message_frame_st *fmsg = reinterpret_cast<message_frame_st*>(msg);
-        strstr << " frame size " << fmsg->frame_size << " bytes";
+        strstr << " frame id " << fmsg->frame_id << " frame size "
+               << fmsg->frame_size << " bytes";
+        break;
+    }
+
+    case MESSAGE_CAMERA_TILE: {
+        message_tile_st *tmsg = reinterpret_cast<message_tile_st*>(msg);
+        strstr << " frame id " << tmsg->frame_id << " tile " << tmsg->tile_id
+               << " of " << tmsg->tile_count << " tile size " << tmsg->tile_size
+               << " bytes";
         break;
     }
 
@@ -47,6 +47,15 @@
     list_macro(MESSAGE_NETCOM_KEY,          "NETCOM_KEY"),          \
     list_macro(MESSAGE_NETCOM_CLIENT_ALIVE, "NETCOM_CLIENT_ALIVE"), \
     list_macro(MESSAGE_NETCOM_CLIENT_DEAD,  "NETCOM_CLIENT_DEAD"),  \
+    list_macro(MESSAGE_CAMERA_REPORT,       "CAMERA_REPORT"),       \
+    list_macro(MESSAGE_CAMERA_TILE,         "CAMERA_TILE"),         \
+    list_macro(MESSAGE_SNAPSHOT_REQUEST,    "SNAPSHOT_REQUEST"),    \
+    list_macro(MESSAGE_RING_DUMP,           "RING_DUMP"),           \
+    list_macro(MESSAGE_CAMERA_ROI,          "CAMERA_ROI"),          \
+    list_macro(MESSAGE_DETECTION,           "DETECTION"),           \
+    list_macro(MESSAGE_DETECTION_SUBSCRIBE, "DETECTION_SUBSCRIBE"), \
+    list_macro(MESSAGE_CAMERA_MODE,         "CAMERA_MODE"),         \
+    list_macro(MESSAGE_CAMERA_NACK,         "CAMERA_NACK"),         \
 
 /** message types */
 #define MESSAGE_TYPE_ENUM(__enum, __str) __enum
@@ -97,8 +106,26 @@ typedef enum sensor_type {
 #define SENSOR_TYPE_STR(__enum, __str) __str
 extern const char* sensor_type_str(const sensor_type_en type);
 
-/** maximum buffer size in bytes */
-const int max_buf_size = 512;
+/** camera stream modes */
+typedef enum stream_mode {
+    STREAM_MODE_FRAMES = 0,   /** every frame is sent whole */
+    STREAM_MODE_TILES  = 1,   /** keyframes, then only the changed tiles */
+} stream_mode_en;
+
+/** fragment payload size in bytes, unless the client negotiates a larger one */
+const int default_frag_size = 512;
+
+/** largest fragment payload size in bytes, leaves room for jumbo frames */
+const int max_frag_size = 8192;
+
+/** size of the one-time password in bytes */
+const int otp_size = 512;
+
+/** size of the client specific key in bytes */
+const int key_size = 512;
+
+/** maximum number of objects in a detection message */
+const int max_detections = 8;
 
 /** simple message header structure */
 typedef struct message {
@@ -116,31 +143,174 @@ typedef struct message_sensor : message_st {
     uint16_t data;     /** sensor data */
 } message_sensor_st;
 
+/** message from or to a specific netcom client */
+typedef struct message_client : message_st {
+    int32_t id;   /** client ID, filled in by netcom */
+} message_client_st;
+
+/** camera stream request message from clients */
+typedef struct message_camera : message_client_st {
+    uint16_t fps;    /** requested frame rate, 0 means server default */
+    uint16_t tier;   /** requested encoding tier, 0 is the first tier */
+    uint16_t mode;   /** requested stream mode */
+} message_camera_st;
+
+/** single still request from clients, answered with a camera frame */
+typedef struct message_snapshot : message_client_st {
+    uint16_t tier;   /** requested encoding tier, 0 is the first tier */
+} message_snapshot_st;
+
+/** where the pre-event ring goes */
+typedef enum ring_target {
+    RING_TARGET_DISK = 0,     /** written to the SD card of the robot */
+    RING_TARGET_CLIENT = 1,   /** sent to the client as camera frames */
+} ring_target_en;
+
+/** pre-event ring dump request from clients */
+typedef struct message_ring : message_client_st {
+    uint16_t target;    /** ring_target_en */
+    uint16_t seconds;   /** last seconds to dump, 0 means the whole ring */
+} message_ring_st;
+
+/**
+ * region of interest request from clients, in pixels of the whole frame
+ *
+ * Applies to the client's frame stream and snapshots, the frames then carry
+ * the output size. A zero sized region resets to the whole frame, a zero
+ * output size keeps the size of the region.
+ */
+typedef struct message_roi : message_client_st {
+    uint16_t x;          /** left edge of the region */
+    uint16_t y;          /** top edge of the region */
+    uint16_t cols;       /** width of the region */
+    uint16_t rows;       /** height of the region */
+    uint16_t out_cols;   /** width of the frames sent */
+    uint16_t out_rows;   /** height of the frames sent */
+} message_roi_st;
+
+/**
+ * capture mode change request from clients
+ *
+ * Applies to the camera itself, so to every client. Zero fields keep the
+ * current setting; clients learn the new resolution from the frames.
+ */
+typedef struct message_mode : message_client_st {
+    uint16_t cols;          /** cols of the captured frames */
+    uint16_t rows;          /** rows of the captured frames */
+    uint16_t fps;           /** capture frame rate */
+    uint16_t subsampling;   /** JPEG chroma subsampling: 420, 422 or 444 */
+    uint16_t fast_dct;      /** 1 for the fast DCT, 2 for the accurate one */
+} message_mode_st;
+
+/** detection event subscription from clients */
+typedef struct message_subscribe : message_client_st {
+    uint16_t enable;   /** 1 to receive detection events, 0 to stop */
+} message_subscribe_st;
+
+/** object found by the detector, in pixels of the whole frame */
+typedef struct message_box {
+    uint16_t x;       /** left edge */
+    uint16_t y;       /** top edge */
+    uint16_t cols;    /** width */
+    uint16_t rows;    /** height */
+    uint16_t score;   /** detector confidence, in hundredths */
+} message_box_st;
+
+/**
+ * detection event to subscribed clients
+ *
+ * Sent when objects are found in a frame, and once with no objects when they
+ * are gone.
+ */
+typedef struct message_detection : message_st {
+    uint32_t frame_id;                       /** frame the objects were found in */
+    uint16_t cols;                           /** cols of the frame */
+    uint16_t rows;                           /** rows of the frame */
+    uint16_t latency;                        /** milliseconds from capture to result */
+    uint16_t count;                          /** number of objects */
+    message_box_st boxes[max_detections];    /** objects found */
+} message_detection_st;
+
+/** camera stream receiver report from clients */
+typedef struct message_report : message_client_st {
+    uint32_t frags_received;     /** fragments received since last report */
+    uint32_t frags_lost;         /** fragments lost since last report */
+    uint32_t frames_completed;   /** frames completed since last report */
+} message_report_st;
+
+/** tile ID of the NACKs of whole frames */
+const uint16_t nack_whole_frame = 0xffff;
+
+/**
+ * missing fragments of a frame or tile, asked for again by clients
+ *
+ * Fragments are given by their sequence number, as in the frame and tile
+ * messages. The server resends them if it still has the image and the
+ * retransmit budget of the client allows it, otherwise they stay lost.
+ */
+typedef struct message_nack : message_client_st {
+    uint32_t frame_id;     /** frame identifier */
+    uint16_t tile_id;      /** tile index, nack_whole_frame for frames */
+    uint16_t frag_seq;     /** first fragment missing */
+    uint16_t frag_count;   /** fragments missing from there on */
+} message_nack_st;
+
 /** camera frame message */
 typedef struct message_frame : message_st {
+    uint32_t frame_id;          /** frame identifier */
     uint32_t frame_size;        /** total size of the frame */
     uint16_t cols;              /** cols, also known as width */
     uint16_t rows;              /** rows, also known as height */
     uint16_t frag_size;         /** current fragment size */
     uint16_t frag_seq;          /** fragment sequence number */
-    char frame[max_buf_size];   /** frame data */
+    char frame[max_frag_size];  /** frame data */
 } message_frame_st;
 
-/** netcom client connect message */
+/** camera frame tile message, sent between keyframes of tile streams */
+typedef struct message_tile : message_st {
+    uint32_t frame_id;         /** frame identifier */
+    uint32_t tile_size;        /** total size of the tile */
+    uint16_t cols;             /** cols of the whole frame */
+    uint16_t rows;             /** rows of the whole frame */
+    uint16_t frag_size;        /** current fragment size */
+    uint16_t frag_seq;         /** fragment sequence number */
+    uint16_t tile_id;          /** tile index within the frame */
+    uint16_t tile_count;       /** number of tiles sent for this frame */
+    uint16_t x;                /** left edge of the tile */
+    uint16_t y;                /** top edge of the tile */
+    uint16_t tile_cols;        /** cols of the tile */
+    uint16_t tile_rows;        /** rows of the tile */
+    char tile[max_frag_size];  /** tile data */
+} message_tile_st;
+
+/**
+ * netcom client connect message
+ *
+ * The server sends the credentials on the control channel, with the largest
+ * fragment it supports, the client sends them back on the uplink, with the
+ * largest fragment it takes. Clients that don't know about it get the
+ * default fragment size.
+ */
 typedef struct message_connect : message_st {
     uint32_t id;              /** client ID */
-    char otp[max_buf_size];   /** one-time password generated by server */
+    char otp[otp_size];       /** one-time password generated by server */
+    uint16_t frag_size;       /** largest fragment payload supported */
 } message_connect_st;
 
-/** random key generated by server for each client */
+/**
+ * Random key generated by server for each client, the fragment size and the
+ * parity code of the uplink: "fec_parity" parity fragments follow each group
+ * of "fec_group" data fragments of an image, none if the group is 0
+ */
 typedef struct message_key : message_st {
-    char key[max_buf_size];   /** key generated by server */
+    char key[key_size];       /** key generated by server */
+    uint16_t frag_size;       /** fragment payload size of the uplink */
+    uint16_t fec_group;       /** data fragments per parity group, 0 if none */
+    uint16_t fec_parity;      /** parity fragments per group */
 } message_key_st;
 
-/** netcom client message */
-typedef struct message_netcom : message_st {
-    int32_t id;     /** client ID */
-    void *client;   /** pointer to uplink data */
+/** netcom client message, the client is looked up in the session table */
+typedef struct message_netcom : message_client_st {
 } message_netcom_st;
 
 /** message related helper functions */
@@ -22,6 +22,9 @@
  *
  *------------------------------------------------------------------------------
  */
+#include <unistd.h>
+#include <sys/eventfd.h>
+
 #include "message_queue.h"
 #include "framework.h"
 
@@ -39,6 +42,7 @@ MessageQueue::MessageQueue (const std::string name)
     pthread_mutex_init(&mutex, NULL);
     pthread_cond_init(&cv, NULL);
     more = false;
+    efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 }
 
 /**
@@ -63,6 +67,9 @@ MessageQueue::~MessageQueue (void)
     /* cleanup members */
     pthread_mutex_destroy(&mutex);
     pthread_cond_destroy(&cv);
+    if (efd >= 0) {
+        close(efd);
+    }
 }
 
 /**
@@ -72,6 +79,13 @@ void
 MessageQueue::push_msg (void *msg)
 {
     pthread_mutex_lock(&mutex);
+    if (msgs.empty() && (efd >= 0)) {
+        uint64_t one = 1;
+        if (write(efd, &one, sizeof(one)) != sizeof(one)) {
+            dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_MESSAGEQUEUE,
+                 "unable to signal eventfd");
+        }
+    }
     msgs.push(reinterpret_cast<message_st*>(msg));
     pthread_cond_signal(&cv);
     pthread_mutex_unlock(&mutex);
@@ -104,6 +118,13 @@ MessageQueue::pop_msg (void)
             more = true;
         } else {
             more = false;
+            if (efd >= 0) {
+                uint64_t count;
+                if (read(efd, &count, sizeof(count)) != sizeof(count)) {
+                    dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_MESSAGEQUEUE,
+                         "unable to reset eventfd");
+                }
+            }
         }
     }
     pthread_mutex_unlock(&mutex);
@@ -128,4 +149,17 @@ MessageQueue::wait_msg (void)
     pthread_mutex_unlock(&mutex);
 }
 
+/**
+ * File descriptor that is readable while messages are waiting
+ *
+ * Lets a worker wait for messages and other events (e.g. timers) with a single
+ * poll(). The descriptor is only readable, it must never be read directly,
+ * messages are still taken with pop_msg().
+ */
+int
+MessageQueue::get_fd (void) const
+{
+    return efd;
+}
+
 } /* namespace sentry */
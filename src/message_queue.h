@@ -54,11 +54,15 @@ class MessageQueue {
     /** go to sleep if there are no messages waiting to be processed */
     void wait_msg (void);
 
+    /** file descriptor that is readable while messages are waiting */
+    int get_fd (void) const;
+
   private:
     pthread_mutex_t         mutex;   /** mutex to protect the queue */
     pthread_cond_t          cv;      /** queue condition variable */
     std::queue<message_st*> msgs;    /** message queue */
     bool                    more;    /** true means messages are waiting in queue */
+    int                     efd;     /** eventfd, readable while queue is not empty */
 };
 
 } /* namespace sentry */
@@ -0,0 +1,304 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * motion.cc
+ *
+ * Motion detector implementation
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <opencv2/imgproc/imgproc.hpp>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "motion.h"
+
+namespace sentry {
+
+/**
+ * Number of bytes where a and b differ by more than threshold
+ *
+ * The vector loops compute |a - b| with two saturating subtractions, and
+ * compare it against the threshold 16 pixels at a time. The tail is done by
+ * the scalar loop.
+ */
+unsigned int
+motion_count_changed (const uint8_t *a, const uint8_t *b, const unsigned int n,
+                      const uint8_t threshold)
+{
+    unsigned int count = 0;
+    unsigned int i = 0;
+
+#if defined(__SSE2__)
+    const __m128i thr = _mm_set1_epi8((char)threshold);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        __m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        /* bytes at or below the threshold saturate to zero */
+        __m128i same = _mm_cmpeq_epi8(_mm_subs_epu8(diff, thr), zero);
+        count += 16 - __builtin_popcount(_mm_movemask_epi8(same));
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const uint8x16_t thr = vdupq_n_u8(threshold);
+    uint32x4_t acc = vdupq_n_u32(0);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t diff = vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+        /* 0xff where changed, shifted down to 1 and accumulated */
+        uint8x16_t changed = vshrq_n_u8(vcgtq_u8(diff, thr), 7);
+        acc = vpadalq_u16(acc, vpaddlq_u8(changed));
+    }
+    count += vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) +
+             vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+#endif
+
+    for (; i < n; i++) {
+        int diff = (int)a[i] - (int)b[i];
+        if ((diff > threshold) || (-diff > threshold)) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Move the background a quarter of the way towards the current image
+ *
+ * Two rounding averages give 3/4 background + 1/4 image, so slow changes (e.g.
+ * daylight) fade into the background, while moving objects stand out.
+ */
+void
+motion_update_background (uint8_t *background, const uint8_t *image,
+                          const unsigned int n)
+{
+    unsigned int i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 16 <= n; i += 16) {
+        __m128i bg = _mm_loadu_si128(reinterpret_cast<const __m128i*>(background + i));
+        __m128i im = _mm_loadu_si128(reinterpret_cast<const __m128i*>(image + i));
+        bg = _mm_avg_epu8(bg, _mm_avg_epu8(bg, im));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(background + i), bg);
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t bg = vld1q_u8(background + i);
+        uint8x16_t im = vld1q_u8(image + i);
+        vst1q_u8(background + i, vrhaddq_u8(bg, vrhaddq_u8(bg, im)));
+    }
+#endif
+
+    for (; i < n; i++) {
+        unsigned int half = (background[i] + image[i] + 1) >> 1;
+        background[i] = (uint8_t)((background[i] + half + 1) >> 1);
+    }
+}
+
+/**
+ * Motion detector constructor
+ *
+ * Uses the "motion_scale", "motion_threshold" and "motion_area" keys of the
+ * camera section.
+ */
+MotionDetector::MotionDetector (framework::Config *config)
+{
+    scale = config->get_int("motion_scale");
+    if (scale < 1) {
+        scale = 8;
+    }
+    int thr = config->get_int("motion_threshold");
+    threshold = (thr > 0 && thr < 256) ? thr : 25;
+    area = config->get_float("motion_area");
+
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_CAMERA,
+         "motion detection at scale 1/" << scale << ", threshold " <<
+         (int)threshold << ", area " << area << "%");
+}
+
+/**
+ * Motion detector destructor
+ */
+MotionDetector::~MotionDetector (void)
+{
+}
+
+/**
+ * True if the image differs from the background
+ */
+bool
+MotionDetector::detect (const cv::Mat &image)
+{
+    /* scale down first, it's cheaper to convert the small image to gray */
+    cv::resize(image, small, cv::Size(image.cols / scale, image.rows / scale),
+               0, 0, cv::INTER_AREA);
+    if (small.channels() > 1) {
+        cv::cvtColor(small, gray, CV_BGR2GRAY);
+    } else {
+        gray = small;
+    }
+
+    unsigned int n = gray.total();
+    if (!gray.isContinuous() || (0 == n)) {
+        return true;
+    }
+
+    /* first image after a reset (or a resolution change) is the background */
+    if (background.size() != n) {
+        background.assign(gray.ptr(), gray.ptr() + n);
+        return true;
+    }
+
+    unsigned int changed = motion_count_changed(gray.ptr(), &background[0], n,
+                                                threshold);
+    motion_update_background(&background[0], gray.ptr(), n);
+
+    dbug(DEBUG_LEVEL_VERY_VERBOSE, DEBUG_TYPE_CAMERA,
+         changed << " of " << n << " pixels changed");
+
+    return (100.0 * changed > area * n);
+}
+
+/**
+ * Forget the background, the next image is considered motion
+ */
+void
+MotionDetector::reset (void)
+{
+    background.clear();
+}
+
+/** tiles are compared at this fraction of the resolution */
+static const int tile_scale = 4;
+
+/**
+ * Tile detector constructor
+ *
+ * Uses the "tile_size", "tile_threshold" and "tile_area" keys of the camera
+ * section. The tile size is rounded to a multiple of 16 pixels, which keeps
+ * the tiles aligned with the JPEG blocks at every scale.
+ */
+TileDetector::TileDetector (framework::Config *config)
+{
+    size = (config->get_int("tile_size") + 15) & ~15;
+    if (size <= 0) {
+        size = 64;
+    }
+    int thr = config->get_int("tile_threshold");
+    threshold = (thr > 0 && thr < 256) ? thr : 25;
+    area = config->get_float("tile_area");
+
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_CAMERA,
+         "tile detection with " << size << "x" << size << " tiles, threshold " <<
+         (int)threshold << ", area " << area << "%");
+}
+
+/**
+ * Tile detector destructor
+ */
+TileDetector::~TileDetector (void)
+{
+}
+
+/**
+ * Mark the tiles that changed
+ *
+ * A tile is dirty if more than "tile_area" percent of its pixels differ from
+ * the tile's reference by more than the threshold. The reference of a dirty
+ * tile is replaced with its current content.
+ */
+void
+TileDetector::detect (const cv::Mat &image, std::vector<uint8_t> &dirty)
+{
+    int count = get_count(image.cols, image.rows);
+    dirty.assign(count, 1);
+
+    cv::resize(image, small, cv::Size(image.cols / tile_scale, image.rows / tile_scale),
+               0, 0, cv::INTER_AREA);
+    if (small.channels() > 1) {
+        cv::cvtColor(small, gray, CV_BGR2GRAY);
+    } else {
+        small.copyTo(gray);
+    }
+
+    /* first image after a reset (or a resolution change) is all dirty */
+    if ((reference.cols != gray.cols) || (reference.rows != gray.rows)) {
+        gray.copyTo(reference);
+        return;
+    }
+
+    for (int tile = 0; tile < count; tile++) {
+        cv::Rect full = get_rect(image.cols, image.rows, tile);
+        cv::Rect rect(full.x / tile_scale, full.y / tile_scale,
+                      full.width / tile_scale, full.height / tile_scale);
+        rect &= cv::Rect(0, 0, gray.cols, gray.rows);
+        if (rect.area() <= 0) {
+            continue;
+        }
+
+        unsigned int changed = 0;
+        for (int y = rect.y; y < rect.y + rect.height; y++) {
+            changed += motion_count_changed(gray.ptr(y) + rect.x,
+                                            reference.ptr(y) + rect.x,
+                                            rect.width, threshold);
+        }
+        if (100.0 * changed > area * rect.area()) {
+            gray(rect).copyTo(reference(rect));
+        } else {
+            dirty[tile] = 0;
+        }
+    }
+}
+
+/**
+ * Forget the references, every tile of the next image is dirty
+ */
+void
+TileDetector::reset (void)
+{
+    reference.release();
+}
+
+/**
+ * Number of tiles in an image of the given size
+ */
+int
+TileDetector::get_count (const int cols, const int rows) const
+{
+    return ((cols + size - 1) / size) * ((rows + size - 1) / size);
+}
+
+/**
+ * Area of the given tile in an image of the given size
+ *
+ * Tiles are numbered in row-major order, the last column and row of tiles
+ * may be smaller than the rest.
+ */
+cv::Rect
+TileDetector::get_rect (const int cols, const int rows, const int tile) const
+{
+    int tiles_x = (cols + size - 1) / size;
+    cv::Rect rect((tile % tiles_x) * size, (tile / tiles_x) * size, size, size);
+    return rect & cv::Rect(0, 0, cols, rows);
+}
+
+} /* namespace sentry */
@@ -0,0 +1,115 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * motion.h
+ *
+ * Motion detector class declaration
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#ifndef MOTION_H_
+#define MOTION_H_
+
+#include <stdint.h>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+#include "framework.h"
+
+namespace sentry {
+
+/**
+ * MotionDetector class
+ *
+ * Compares a downscaled grayscale copy of each frame against a slowly adapting
+ * background. A pixel is changed if it differs from the background by more
+ * than the threshold, and the frame has motion if enough pixels changed. The
+ * per-pixel kernels use SSE2 or NEON when available.
+ */
+class MotionDetector {
+  public:
+    /** motion detector constructor */
+    MotionDetector (framework::Config *config);
+
+    /** motion detector destructor */
+    virtual ~MotionDetector (void);
+
+    /** true if the image differs from the background */
+    bool detect (const cv::Mat &image);
+
+    /** forget the background, the next image is considered motion */
+    void reset (void);
+
+  private:
+    int scale;                         /** downscale factor */
+    uint8_t threshold;                 /** per-pixel difference threshold */
+    float area;                        /** changed pixels needed, in percent */
+    cv::Mat small;                     /** downscaled image */
+    cv::Mat gray;                      /** downscaled grayscale image */
+    std::vector<uint8_t> background;   /** running background */
+};
+
+/**
+ * TileDetector class
+ *
+ * Splits the frame into a fixed grid of square tiles, and tells which tiles
+ * changed since they were last marked dirty. Each tile is compared against its
+ * own reference, which is only updated when the tile is marked dirty, so small
+ * changes can't creep in unnoticed frame by frame.
+ */
+class TileDetector {
+  public:
+    /** tile detector constructor */
+    TileDetector (framework::Config *config);
+
+    /** tile detector destructor */
+    virtual ~TileDetector (void);
+
+    /** mark the tiles that changed, one flag per tile in row-major order */
+    void detect (const cv::Mat &image, std::vector<uint8_t> &dirty);
+
+    /** forget the references, every tile of the next image is dirty */
+    void reset (void);
+
+    /** number of tiles in an image of the given size */
+    int get_count (const int cols, const int rows) const;
+
+    /** area of the given tile in an image of the given size */
+    cv::Rect get_rect (const int cols, const int rows, const int tile) const;
+
+  private:
+    int size;                          /** tile size in pixels */
+    uint8_t threshold;                 /** per-pixel difference threshold */
+    float area;                        /** changed pixels needed, in percent */
+    cv::Mat small;                     /** downscaled image */
+    cv::Mat gray;                      /** downscaled grayscale image */
+    cv::Mat reference;                 /** last dirty content of each tile */
+};
+
+/** number of bytes where a and b differ by more than threshold */
+extern unsigned int motion_count_changed (const uint8_t *a, const uint8_t *b,
+                                          const unsigned int n,
+                                          const uint8_t threshold);
+
+/** move the background a quarter of the way towards the current image */
+extern void motion_update_background (uint8_t *background, const uint8_t *image,
+                                      const unsigned int n);
+
+} /* namespace sentry */
+
+#endif /* MOTION_H_ */
@@ -22,9 +22,14 @@
  *
  *------------------------------------------------------------------------------
  */
+#include <time.h>
 #include <unistd.h>
+#include <poll.h>
+#include <algorithm>
+#include <sys/timerfd.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <netinet/in.h>
 #include <openssl/rand.h>
 #include <openssl/err.h>
 
@@ -32,11 +37,14 @@
 
 namespace sentry {
 
+/** size of the IPv4 and UDP headers of a datagram */
+static const int netcom_ip_udp_header_size = 28;
+
 /**
  * Netcom server constructor
  */
-Netcom::Netcom (MessageQueue* const engine_queue)
-        : Worker("netcom server", false), engine_queue(engine_queue)
+Netcom::Netcom (MessageQueue* const engine_queue, SessionTable *sessions)
+        : Worker("netcom server", false), engine_queue(engine_queue), sessions(sessions)
 {
     dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_NETCOM,
          "initializing " << get_name());
@@ -54,9 +62,6 @@ Netcom::Netcom (MessageQueue* const engine_queue)
     init_server_socket(NETCOM_SOCKET_STREAM);
     init_server_socket(NETCOM_SOCKET_DGRAM);
 
-    /* reset client map */
-    clients.clear();
-
     /* ready to start the worker thread */
     run();
 }
@@ -72,6 +77,18 @@ Netcom::~Netcom (void)
     /* terminate the worker thread */
     terminate();
 
+    /* close the control channels, the sessions are freed with the table */
+    unsigned int slot = 0;
+    session_st *client;
+    while (NULL != (client = sessions->next(slot))) {
+        if (client->sd >= 0) {
+            SSL_free(client->ssl);
+            close(client->sd);
+            client->ssl = NULL;
+            client->sd = -1;
+        }
+    }
+
     /* close the server sockets and SSL context */
     if (server_socket[NETCOM_SOCKET_STREAM] != NETCOM_SOCKET_INVALID) {
         close(server_socket[NETCOM_SOCKET_STREAM]);
@@ -182,6 +199,17 @@ Netcom::init_server_socket (const netcom_sockets_en type)
             continue;
         }
 
+        /*
+         * uplinks with their own datagram socket share the server port, the
+         * kernel only lets sockets of the same user join in, and hands the
+         * datagrams of a client to its uplink's socket (see drain())
+         */
+        if ((NETCOM_SOCKET_DGRAM == type) &&
+            (TRANSMIT_MODE_BATCH != FragmentSender::parse_mode(config->get_string("transmit")))) {
+            int on = 1;
+            setsockopt(server_socket[type], SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        }
+
         if (bind(server_socket[type], rp->ai_addr, rp->ai_addrlen) != -1) {
             /* success */
             break;
@@ -226,18 +254,18 @@ Netcom::init_server_socket (const netcom_sockets_en type)
 }
 
 /**
- * Create new client
+ * Create new client session
  *
  * There are a few tasks to be done when a new client arrives:
  *   - establish connection with the client using SSL
- *   - create netcom client and uplink objects for storing client information
+ *   - add a session to the session table for storing client information
  *   - generate random byte stream used as one time password during the datagram
  *     connection establishment
- *   - send the client ID (socket file descriptor ID) along with the one time
- *     password to the client via the SSL connection
+ *   - send the client ID (session ID) along with the one time password to the
+ *     client via the SSL connection
  */
-netcom_client_st*
-Netcom::create_client (void) const
+session_st*
+Netcom::create_client (void)
 {
     /* accept the client connection */
     struct sockaddr_storage client_addr;
@@ -291,34 +319,39 @@ Netcom::create_client (void) const
                  "no client certificates available");
         }
 
-        /* intialize client data */
-        netcom_client_st *client = new netcom_client_st;
+        /* intialize client data, the uplink is connected later */
+        session_st *client = new session_st;
         client->name = client_name;
         client->sd = client_sd;
         client->ssl = ssl;
         RAND_bytes(client->otp, sizeof(client->otp));
+        client->uplink_sd = NETCOM_SOCKET_INVALID;
+        client->frag_size = default_frag_size;
+        client->fec_group = 0;
+        client->fec_parity = 1;
+        client->uplink = NULL;
+        if (0 == sessions->insert(client)) {
+            SSL_free(client->ssl);
+            close(client->sd);
+            delete client;
+            return NULL;
+        }
 
         /* let the client know its credentials via the SSL socket */
         message_connect_st *msg = new message_connect_st;
         msg->type = htonl(MESSAGE_NETCOM_CONNECT);
-        msg->id = htonl(client_sd);
+        msg->id = htonl(client->id);
         memcpy(msg->otp, client->otp, sizeof(client->otp));
+        msg->frag_size = htons(max_frag_size);
         if (SSL_write(client->ssl, msg, sizeof(*msg)) <= 0) {
             dbug(DEBUG_LEVEL_ERROR, DEBUG_TYPE_NETCOM,
                  "unable to send client credentials to client");
-            SSL_free(client->ssl);
-            close(client->sd);
-            delete client;
+            close_client(client);
             delete msg;
             return NULL;
         }
         delete msg;
 
-        /* create the uplink counterpart */
-        netcom_uplink_st *uplink = new netcom_uplink_st;
-        uplink->name = client_name;
-        uplink->sd = NETCOM_SOCKET_INVALID;
-        client->uplink = uplink;
         return client;
     } else {
         dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_NETCOM,
@@ -360,21 +393,26 @@ Netcom::connect_uplink (struct sockaddr_storage &client_addr, char *buf, int len
         return;
     }
 
-    /* find the client */
+    /*
+     * find the client, a session with an open control channel stays in the
+     * table until this thread announces it dead, no read lock needed after this
+     */
     message_connect_st *connect_msg = reinterpret_cast<message_connect_st*>(buf);
-    int client_sd = ntohl(connect_msg->id);
-    std::map<int, netcom_client_st*>::iterator it = clients.find(client_sd);
-    if (it == clients.end()) {
+    uint32_t client_id = ntohl(connect_msg->id);
+    int idx = sessions->read_lock();
+    session_st *client = sessions->lookup(client_id);
+    if ((NULL != client) && (client->sd < 0)) {
+        client = NULL;
+    }
+    sessions->read_unlock(idx);
+    if (NULL == client) {
         dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_NETCOM,
-             "unknown client " << client_sd);
+             "unknown client " << client_id);
         return;
     }
 
-    netcom_client_st *client = it->second;
-    netcom_uplink_st *uplink = client->uplink;
-
     /* check if this client is already connected */
-    if (uplink->sd != NETCOM_SOCKET_INVALID) {
+    if (client->uplink_sd != NETCOM_SOCKET_INVALID) {
         dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_NETCOM,
              "client is already connected, ignoring message");
         return;
@@ -383,40 +421,96 @@ Netcom::connect_uplink (struct sockaddr_storage &client_addr, char *buf, int len
     /* make sure password is correct */
     if (memcmp(connect_msg->otp, client->otp, sizeof(client->otp)) != 0) {
         dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_NETCOM,
-             "password mismatch, client " << client_name << " id " << client->sd);
+             "password mismatch, client " << client_name << " id " << client->id);
         return;
     }
 
     /* generate encryption key for this client */
-    RAND_bytes(uplink->key, sizeof(uplink->key));
+    RAND_bytes(client->key, sizeof(client->key));
+
+    /* clients that don't negotiate get the default fragment size */
+    int wish = 0;
+    if (length >= (int)sizeof(message_connect_st)) {
+        wish = ntohs(connect_msg->frag_size);
+    }
+    client->frag_size = negotiate_frag_size(client_addr, wish);
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_NETCOM,
+         "client " << client_name << " asked for " << wish << " byte fragments, " <<
+         "gets " << client->frag_size);
+
+    /* parity fragments on the uplink, if configured */
+    ParityCode code(config->get_int("fec_group"), config->get_int("fec_parity"));
+    client->fec_group = code.get_group();
+    client->fec_parity = code.get_parity();
 
     /* send the client key securely */
     message_key_st *msg = new message_key_st;
     msg->type = htonl(MESSAGE_NETCOM_KEY);
-    memcpy(msg->key, uplink->key, sizeof(uplink->key));
+    memcpy(msg->key, client->key, sizeof(client->key));
+    msg->frag_size = htons(client->frag_size);
+    msg->fec_group = htons(client->fec_group);
+    msg->fec_parity = htons(client->fec_parity);
     if (SSL_write(client->ssl, msg, sizeof(*msg)) <= 0) {
         delete msg;
         return;
     }
+    delete msg;
 
     /* update uplink info */
-    uplink->id = client->sd;
-    uplink->sd = server_socket[NETCOM_SOCKET_DGRAM];
-    uplink->addr = client_addr;
+    client->uplink_sd = server_socket[NETCOM_SOCKET_DGRAM];
+    client->addr = client_addr;
 
     /* send a message to main to notify about new client */
     message_netcom_st *netcom_msg = new message_netcom_st;
     netcom_msg->type = MESSAGE_NETCOM_CLIENT_ALIVE;
-    netcom_msg->id = client->sd;
-    netcom_msg->client = uplink;
+    netcom_msg->id = client->id;
     engine_queue->push_msg(netcom_msg);
 }
 
+/**
+ * Fragment payload size for a client, the largest that fits the path MTU
+ *
+ * The path MTU is what the kernel knows of the route to the client: the
+ * interface MTU on a LAN, or less once an ICMP "fragmentation needed" came
+ * back from the way. A fragment leaves room for the IP, UDP and the largest
+ * fragment header, and stays within the client's wish and the "frag_size"
+ * ceiling, but never below the default size.
+ */
+int
+Netcom::negotiate_frag_size (const struct sockaddr_storage &addr, const int wish)
+{
+    int ceiling = config->get_int("frag_size");
+    ceiling = (ceiling > 0) ? std::min(ceiling, max_frag_size) : default_frag_size;
+    int size = std::min(wish, ceiling);
+
+    int mtu = 0;
+    socklen_t length = sizeof(mtu);
+    int discover = IP_PMTUDISC_DO;
+    int sd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if ((sd < 0) ||
+        (setsockopt(sd, IPPROTO_IP, IP_MTU_DISCOVER, &discover, sizeof(discover)) < 0) ||
+        (connect(sd, (struct sockaddr*)&addr, sizeof(struct sockaddr_in)) < 0) ||
+        (getsockopt(sd, IPPROTO_IP, IP_MTU, &mtu, &length) < 0)) {
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_NETCOM,
+             "unable to find the path MTU: " << strerror(errno));
+        mtu = 0;
+    }
+    if (sd >= 0) {
+        close(sd);
+    }
+    if (mtu > 0) {
+        size = std::min(size, mtu - netcom_ip_udp_header_size -
+                              (int)(sizeof(message_tile_st) - max_frag_size));
+    }
+
+    return std::max(size, default_frag_size);
+}
+
 /**
  * Process control message from client
  */
 void
-Netcom::proc_control_message (const netcom_client_st *client, char *buf, int length)
+Netcom::proc_control_message (const session_st *client, char *buf, int length)
 {
     message_st *socket_msg = reinterpret_cast<message_st*>(buf);
     message_type_en type = static_cast<message_type_en>(ntohl(socket_msg->type));
@@ -435,9 +529,128 @@ Netcom::proc_control_message (const netcom_client_st *client, char *buf, int len
     }
 
     case MESSAGE_CAMERA_REQUEST: {
-        message_netcom_st *msg = new message_netcom_st;
+        /* older clients send the bare message header */
+        message_camera_st *msg = new message_camera_st;
         msg->type = MESSAGE_CAMERA_REQUEST;
-        msg->id = client->sd;
+        msg->id = client->id;
+        msg->fps = 0;
+        msg->tier = 0;
+        msg->mode = STREAM_MODE_FRAMES;
+        message_camera_st *socket_msg = reinterpret_cast<message_camera_st*>(buf);
+        if (length >= (int)(sizeof(message_client_st) + 2 * sizeof(uint16_t))) {
+            msg->fps = ntohs(socket_msg->fps);
+            msg->tier = ntohs(socket_msg->tier);
+        }
+        if (length >= (int)sizeof(*msg)) {
+            msg->mode = ntohs(socket_msg->mode);
+        }
+        engine_queue->push_msg(msg);
+        break;
+    }
+
+    case MESSAGE_SNAPSHOT_REQUEST: {
+        message_snapshot_st *msg = new message_snapshot_st;
+        msg->type = MESSAGE_SNAPSHOT_REQUEST;
+        msg->id = client->id;
+        msg->tier = 0;
+        message_snapshot_st *socket_msg = reinterpret_cast<message_snapshot_st*>(buf);
+        if (length >= (int)(sizeof(message_client_st) + sizeof(uint16_t))) {
+            msg->tier = ntohs(socket_msg->tier);
+        }
+        engine_queue->push_msg(msg);
+        break;
+    }
+
+    case MESSAGE_DETECTION_SUBSCRIBE: {
+        if (length < (int)sizeof(message_subscribe_st)) {
+            break;
+        }
+        message_subscribe_st *socket_msg = reinterpret_cast<message_subscribe_st*>(buf);
+        message_subscribe_st *msg = new message_subscribe_st;
+        msg->type = MESSAGE_DETECTION_SUBSCRIBE;
+        msg->id = client->id;
+        msg->enable = ntohs(socket_msg->enable);
+        engine_queue->push_msg(msg);
+        break;
+    }
+
+    case MESSAGE_CAMERA_ROI: {
+        if (length < (int)sizeof(message_roi_st)) {
+            break;
+        }
+        message_roi_st *socket_msg = reinterpret_cast<message_roi_st*>(buf);
+        message_roi_st *msg = new message_roi_st;
+        msg->type = MESSAGE_CAMERA_ROI;
+        msg->id = client->id;
+        msg->x = ntohs(socket_msg->x);
+        msg->y = ntohs(socket_msg->y);
+        msg->cols = ntohs(socket_msg->cols);
+        msg->rows = ntohs(socket_msg->rows);
+        msg->out_cols = ntohs(socket_msg->out_cols);
+        msg->out_rows = ntohs(socket_msg->out_rows);
+        engine_queue->push_msg(msg);
+        break;
+    }
+
+    case MESSAGE_CAMERA_MODE: {
+        if (length < (int)sizeof(message_mode_st)) {
+            break;
+        }
+        message_mode_st *socket_msg = reinterpret_cast<message_mode_st*>(buf);
+        message_mode_st *msg = new message_mode_st;
+        msg->type = MESSAGE_CAMERA_MODE;
+        msg->id = client->id;
+        msg->cols = ntohs(socket_msg->cols);
+        msg->rows = ntohs(socket_msg->rows);
+        msg->fps = ntohs(socket_msg->fps);
+        msg->subsampling = ntohs(socket_msg->subsampling);
+        msg->fast_dct = ntohs(socket_msg->fast_dct);
+        engine_queue->push_msg(msg);
+        break;
+    }
+
+    case MESSAGE_RING_DUMP: {
+        message_ring_st *msg = new message_ring_st;
+        msg->type = MESSAGE_RING_DUMP;
+        msg->id = client->id;
+        msg->target = RING_TARGET_DISK;
+        msg->seconds = 0;
+        message_ring_st *socket_msg = reinterpret_cast<message_ring_st*>(buf);
+        if (length >= (int)sizeof(*msg)) {
+            msg->target = ntohs(socket_msg->target);
+            msg->seconds = ntohs(socket_msg->seconds);
+        }
+        engine_queue->push_msg(msg);
+        break;
+    }
+
+    case MESSAGE_CAMERA_REPORT: {
+        if (length < (int)sizeof(message_report_st)) {
+            break;
+        }
+        message_report_st *socket_msg = reinterpret_cast<message_report_st*>(buf);
+        message_report_st *msg = new message_report_st;
+        msg->type = MESSAGE_CAMERA_REPORT;
+        msg->id = client->id;
+        msg->frags_received = ntohl(socket_msg->frags_received);
+        msg->frags_lost = ntohl(socket_msg->frags_lost);
+        msg->frames_completed = ntohl(socket_msg->frames_completed);
+        engine_queue->push_msg(msg);
+        break;
+    }
+
+    case MESSAGE_CAMERA_NACK: {
+        if (length < (int)sizeof(message_nack_st)) {
+            break;
+        }
+        message_nack_st *socket_msg = reinterpret_cast<message_nack_st*>(buf);
+        message_nack_st *msg = new message_nack_st;
+        msg->type = MESSAGE_CAMERA_NACK;
+        msg->id = client->id;
+        msg->frame_id = ntohl(socket_msg->frame_id);
+        msg->tile_id = ntohs(socket_msg->tile_id);
+        msg->frag_seq = ntohs(socket_msg->frag_seq);
+        msg->frag_count = ntohs(socket_msg->frag_count);
         engine_queue->push_msg(msg);
         break;
     }
@@ -491,6 +704,7 @@ Netcom::loop (void)
     dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_NETCOM,
          "starting " << get_name() << " loop");
 
+    std::vector<session_st*> ready;
     while (true) {
         tmp_fds = read_fds;
         if (select(max_fd + 1, &tmp_fds, NULL, NULL, NULL) == -1) {
@@ -498,73 +712,65 @@ Netcom::loop (void)
                  "select() returned error " << strerror(errno));
         }
 
-        /* look for incoming messages */
-        for (int i = 0; i <= max_fd; i++) {
-            if (!FD_ISSET(i, &tmp_fds)) {
-                continue;
-            }
-
-            if (i == server_socket[NETCOM_SOCKET_STREAM]) {
-                /* new connection */
-                netcom_client_st *client = create_client();
-                if (NULL == client) {
-                    continue;
-                }
-
+        /* new connection */
+        if (FD_ISSET(server_socket[NETCOM_SOCKET_STREAM], &tmp_fds)) {
+            session_st *client = create_client();
+            if (NULL != client) {
                 /* store the new file descriptor */
                 FD_SET(client->sd, &read_fds);
                 if (client->sd > max_fd) {
                     max_fd = client->sd;
                 }
+            }
+        }
 
-                /* store the new client data */
-                clients.insert(std::pair<int, netcom_client_st*>(client->sd, client));
-            } else if (i == server_socket[NETCOM_SOCKET_DGRAM]) {
-                /* message on the datagram socket, must be uplink connection request */
-                struct sockaddr_storage client_addr;
-                socklen_t addr_size = sizeof(client_addr);
-                int length = recvfrom(server_socket[NETCOM_SOCKET_DGRAM], buf,
-                                      sizeof(buf), 0, (struct sockaddr*)&client_addr,
-                                      &addr_size);
-                if (length > 0) {
-                    connect_uplink(client_addr, buf, length);
-                }
-            } else {
-                /* message from an existing client */
-                std::map<int, netcom_client_st*>::iterator it = clients.find(i);
-                if (it == clients.end()) {
-                    continue;
-                }
+        /* message on the datagram socket, must be uplink connection request */
+        if (FD_ISSET(server_socket[NETCOM_SOCKET_DGRAM], &tmp_fds)) {
+            struct sockaddr_storage client_addr;
+            socklen_t addr_size = sizeof(client_addr);
+            int length = recvfrom(server_socket[NETCOM_SOCKET_DGRAM], buf,
+                                  sizeof(buf), 0, (struct sockaddr*)&client_addr,
+                                  &addr_size);
+            if (length > 0) {
+                connect_uplink(client_addr, buf, length);
+            }
+        }
 
-                netcom_client_st *client = it->second;
-                int length = SSL_read(client->ssl, buf, sizeof(buf));
-                if (length > 0) {
-                    proc_control_message(client, buf, length);
-                } else {
-                    if (0 == length) {
-                        /* connection closed by client */
-                        dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_NETCOM,
-                             "client " << client->name << " hung up");
-                    } else {
-                        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_NETCOM,
-                             "garbage received from client " <<
-                             client->name << ", closing socket");
-                    }
-
-                    /* inform main thread about the dead client */
-                    message_netcom_st *msg = new message_netcom_st;
-                    msg->type = MESSAGE_NETCOM_CLIENT_DEAD;
-                    msg->id = client->sd;
-                    engine_queue->push_msg(msg);
-
-                    /* close the SSL connection and socket */
-                    FD_CLR(client->sd, &read_fds);
-                    SSL_free(client->ssl);
-                    close(client->sd);
-                    clients.erase(it);
-                    delete client;
-                }
+        /*
+         * messages from existing clients, the sessions with an open control
+         * channel are this thread's until it announces them dead, so they are
+         * only looked for with the read lock held
+         */
+        ready.clear();
+        int idx = sessions->read_lock();
+        unsigned int slot = 0;
+        session_st *client;
+        while (NULL != (client = sessions->next(slot))) {
+            if ((client->sd >= 0) && FD_ISSET(client->sd, &tmp_fds)) {
+                ready.push_back(client);
+            }
+        }
+        sessions->read_unlock(idx);
+
+        for (unsigned int i = 0; i < ready.size(); i++) {
+            client = ready[i];
+            int length = SSL_read(client->ssl, buf, sizeof(buf));
+            if (length > 0) {
+                proc_control_message(client, buf, length);
+                continue;
+            }
+
+            if (0 == length) {
+                /* connection closed by client */
+                dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_NETCOM,
+                     "client " << client->name << " hung up");
+            } else {
+                dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_NETCOM,
+                     "garbage received from client " <<
+                     client->name << ", closing socket");
             }
+            FD_CLR(client->sd, &read_fds);
+            close_client(client);
         }
     }
 
@@ -572,17 +778,71 @@ Netcom::loop (void)
          get_name() << " exiting");
 }
 
+/**
+ * Close the control channel of a client and announce it dead
+ *
+ * The engine removes the session from the table when it gets the message,
+ * thus the session must not be touched after this.
+ */
+void
+Netcom::close_client (session_st *client)
+{
+    /* close the SSL connection and socket */
+    SSL_free(client->ssl);
+    close(client->sd);
+    client->ssl = NULL;
+    client->sd = -1;
+
+    /* inform main thread about the dead client */
+    message_netcom_st *msg = new message_netcom_st;
+    msg->type = MESSAGE_NETCOM_CLIENT_DEAD;
+    msg->id = client->id;
+    engine_queue->push_msg(msg);
+}
+
 /**
  * Netcom uplink constructor
  */
 NetcomUplink::NetcomUplink (MessageQueue* const engine_queue,
-                            netcom_uplink_st *client, Camera *camera)
+                            session_st *client, Camera *camera)
         : Worker(client->name, true), engine_queue(engine_queue), client(client),
-          camera(camera)
+          camera(camera), last_seq(0), level(0), good_reports(0),
+          mode(STREAM_MODE_FRAMES), tier(0), detection_events(false), keyframe_due(true),
+          ring_next(0)
 {
     dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_NETCOM_UPLINK,
          "initializing netcom client " << get_name());
 
+    /* read configuration */
+    config = new framework::Config("netcom");
+
+    /* frame rate governor, armed only while streaming */
+    timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer < 0) {
+        dbug(DEBUG_LEVEL_ERROR, DEBUG_TYPE_NETCOM_UPLINK,
+             "timerfd_create() failed with " << strerror(errno));
+        delete config;
+        throw RC_WORKER_THREAD_ERROR;
+    }
+
+    last_keyframe.tv_sec = 0;
+    last_keyframe.tv_nsec = 0;
+    keyframe_interval = config->get_int("keyframe_interval");
+    if (keyframe_interval <= 0) {
+        keyframe_interval = 10;
+    }
+
+    /* fragment headers are built in place, no allocation per frame */
+    frame_msg = new message_frame_st;
+    tile_msg = new message_tile_st;
+    sender = new FragmentSender(get_name(), client->uplink_sd, client->addr, client->key,
+                                client->frag_size,
+                                FragmentSender::parse_mode(config->get_string("transmit")),
+                                config->get_int("send_batch"),
+                                atoi(config->get_string("port").c_str()),
+                                ParityCode(client->fec_group, client->fec_parity));
+    sender->set_cache(config->get_int("nack_cache"), config->get_int("nack_budget"));
+
     /* ready to start the worker thread */
     run();
 }
@@ -601,69 +861,250 @@ NetcomUplink::~NetcomUplink (void)
     /* make sure to release camera if it was used */
     camera->release(client->id);
 
-    /* delete the uplink data */
-    delete client;
+    /* the session belongs to the session table */
+    close(timer);
+    delete sender;
+    delete frame_msg;
+    delete tile_msg;
+    delete config;
 }
 
 /**
- * Grab a camera frame and stream it to the client
+ * Stream the next camera frame to the client
  *
- * The frame is encrypted with the client-specific key, and sent in small
- * chunks to avoid IP level fragmentation, as well as to minimize lost
- * information when there is a packet loss.
+ * Tile streams only get the tiles that changed since the previous frame sent
+ * to the client, unless it's time for a keyframe.
  */
 void
-NetcomUplink::upload_frame (void) const
+NetcomUplink::upload_frame (void)
 {
-    static std::vector<unsigned char> buf;
+    /* skip this period if the camera has nothing new */
+    Frame *frame = camera->get_frame(last_seq);
+    if (NULL == frame) {
+        return;
+    }
+    uint32_t since = last_seq;
+    last_seq = frame->get_seq();
 
-    /* capture an image from the camera */
-    camera->get_image(buf);
+    if ((STREAM_MODE_TILES == mode) && upload_tiles(frame, since)) {
+        frame->put();
+        return;
+    }
 
-    /* encrypt frame with client specific key */
-    int k = 0;
-    for (unsigned int i = 0; i < buf.size(); i++) {
-        buf[i] ^= client->key[k++];
-        if (k >= max_buf_size) {
-            k = 0;
-        }
+    /* get the encoding that suits the client's link */
+    const frame_encoding_st *encoding = camera->encode(frame, ladder[level]);
+    if (NULL == encoding) {
+        frame->put();
+        return;
     }
+    send_frame(frame->get_seq(), encoding->cols, encoding->rows, encoding->data);
 
+    /* every whole frame is a keyframe for tile streams */
+    keyframe_due = false;
+    clock_gettime(CLOCK_MONOTONIC, &last_keyframe);
+
+    /* cleanup */
+    frame->put();
+}
+
+/**
+ * Send an encoded frame to the client
+ */
+void
+NetcomUplink::send_frame (const uint32_t seq, const int cols, const int rows,
+                          const std::vector<unsigned char> &buf)
+{
     dbug(DEBUG_LEVEL_VERY_VERBOSE, DEBUG_TYPE_NETCOM_UPLINK,
          "sending frame (" << buf.size() << " bytes) to client " << get_name());
 
     /* send the message, fragment if necessary */
-    message_frame_st *msg = new message_frame_st;
+    message_frame_st *msg = frame_msg;
     msg->type = htonl(MESSAGE_CAMERA_FRAME);
+    msg->frame_id = htonl(seq);
     msg->frame_size = htonl(buf.size());
-    msg->cols = htons(camera->get_cols());
-    msg->rows = htons(camera->get_rows());
+    msg->cols = htons(cols);
+    msg->rows = htons(rows);
+    sender->send(msg, msg->frame, buf);
+}
+
+/**
+ * Send a single still of the given tier, without starting a stream
+ *
+ * The still comes from the camera's latest frame cache, so if the camera is
+ * running (or still warm), the answer goes out right away. Otherwise the
+ * camera is reserved until it produced a frame, for at most
+ * "snapshot_timeout" seconds, which blocks the uplink meanwhile.
+ */
+void
+NetcomUplink::send_snapshot (const int tier)
+{
+    Frame *frame = camera->get_frame(0);
+    if (NULL == frame) {
+        int timeout = config->get_int("snapshot_timeout");
+        struct timespec after = {0, 0};
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += (timeout > 0) ? timeout : 5;
+        camera->reserve(client->id);
+        frame = camera->wait_frame(after, deadline);
+        camera->release(client->id);
+    }
+    if (NULL == frame) {
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_NETCOM_UPLINK,
+             "no frame for snapshot of client " << get_name());
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_NETCOM_UPLINK,
+         "snapshot of frame " << frame->get_seq() << " (" <<
+         (now.tv_sec - frame->get_time().tv_sec) * 1000 +
+         (now.tv_nsec - frame->get_time().tv_nsec) / 1000000 << " ms old) " <<
+         "for client " << get_name());
+
+    const frame_encoding_st *encoding =
+        camera->encode(frame, get_top(tier, STREAM_MODE_FRAMES));
+    if (NULL != encoding) {
+        send_frame(frame->get_seq(), encoding->cols, encoding->rows, encoding->data);
+    }
+    frame->put();
+}
+
+/**
+ * Write the pre-event ring to disk, or send it to the client
+ *
+ * Disk dumps are written by the recorder's thread, so the stream doesn't
+ * wait for the card. The client gets the frames of the ring oldest first, as
+ * ordinary camera frames with their original sequence numbers, one per tick
+ * of the frame rate governor in place of the live frame, so it has to tell
+ * them apart from a live stream by itself. A new dump starts over.
+ */
+void
+NetcomUplink::dump_ring (const int target, const int seconds, const bool streaming)
+{
+    FrameRing *ring = camera->get_ring();
+    if (NULL == ring) {
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_NETCOM_UPLINK,
+             "pre-event ring is disabled, ignoring dump of client " << get_name());
+        return;
+    }
+
+    if (RING_TARGET_CLIENT != target) {
+        camera->dump_ring(seconds);
+        return;
+    }
+
+    ring->copy(ring_frames, seconds);
+    ring_next = 0;
+    dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_NETCOM_UPLINK,
+         "sending " << ring_frames.size() << " frames of the pre-event ring to client " <<
+         get_name());
+    if (streaming) {
+        return;
+    }
+    if (ring_frames.empty()) {
+        disarm_timer();
+    } else {
+        arm_timer(get_rate(0));
+    }
+}
+
+/**
+ * Send the next frame of the pre-event ring to the client
+ *
+ * Once the last one is out, the copies are freed, and the governor stops if
+ * the client isn't streaming.
+ */
+void
+NetcomUplink::upload_ring_frame (const bool streaming)
+{
+    const ring_frame_st &frame = ring_frames[ring_next++];
+    send_frame(frame.seq, frame.cols, frame.rows, frame.data);
+    if (ring_next < ring_frames.size()) {
+        return;
+    }
+
+    dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_NETCOM_UPLINK,
+         "sent the pre-event ring to client " << get_name());
+    std::vector<ring_frame_st>().swap(ring_frames);
+    ring_next = 0;
+    if (!streaming) {
+        disarm_timer();
+    }
+}
+
+/**
+ * Stream the tiles of the frame that changed since the given frame
+ *
+ * Returns false if the client needs a keyframe instead: on join, after a
+ * change of the encoding variant, after lost fragments, every
+ * "keyframe_interval" seconds, when the changes can't be tracked back to the
+ * client's last frame, or when most of the frame changed anyway.
+ */
+bool
+NetcomUplink::upload_tiles (Frame *frame, const uint32_t since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int count = camera->get_tile_count(frame);
+    if (keyframe_due || (0 == count) ||
+        (now.tv_sec - last_keyframe.tv_sec >= keyframe_interval)) {
+        return false;
+    }
+
+    if (!camera->get_dirty_tiles(since, frame->get_seq(), dirty) ||
+        ((int)dirty.size() != count)) {
+        return false;
+    }
+    int dirty_count = 0;
+    for (int i = 0; i < count; i++) {
+        dirty_count += dirty[i] ? 1 : 0;
+    }
+    if (2 * dirty_count > count) {
+        return false;
+    }
+    if (0 == dirty_count) {
+        /* nothing changed, the client's picture is up to date */
+        return true;
+    }
+
+    /* the tile header is the same for every fragment of a tile */
+    const frame_variant_st &variant = ladder[level];
+    message_tile_st *msg = tile_msg;
+    msg->type = htonl(MESSAGE_CAMERA_TILE);
+    msg->frame_id = htonl(frame->get_seq());
+    msg->cols = htons(frame->get_cols() / variant.scale);
+    msg->rows = htons(frame->get_rows() / variant.scale);
+    msg->tile_count = htons(dirty_count);
 
-    int rem_size = buf.size();
     int sent_bytes = 0;
-    int frag_seq = 1;
-    do {
-        /* prepare current fragment */
-        int frag_size = rem_size;
-        if (frag_size > max_buf_size) {
-            frag_size = max_buf_size;
-        }
-        msg->frag_size = htons(frag_size);
-        msg->frag_seq = htons(frag_seq);
-        memcpy(msg->frame, &buf[0] + sent_bytes, frag_size);
-
-        /* ship it */
-        sendto(client->sd, msg, sizeof(*msg) - max_buf_size + frag_size,
-               0, (struct sockaddr*)&client->addr, sizeof(client->addr));
-
-        /* readjust counters */
-        rem_size -= frag_size;
-        sent_bytes += frag_size;
-        frag_seq++;
-    } while (rem_size > 0);
+    for (int tile = 0; tile < count; tile++) {
+        if (!dirty[tile]) {
+            continue;
+        }
+        const frame_encoding_st *encoding = camera->encode(frame, variant, tile);
+        if (NULL == encoding) {
+            /* the client's picture is broken from now on */
+            keyframe_due = true;
+            continue;
+        }
 
-    /* cleanup */
-    delete msg;
+        msg->tile_size = htonl(encoding->data.size());
+        msg->tile_id = htons(tile);
+        msg->x = htons(encoding->x);
+        msg->y = htons(encoding->y);
+        msg->tile_cols = htons(encoding->cols);
+        msg->tile_rows = htons(encoding->rows);
+        sender->send(msg, msg->tile, encoding->data);
+        sent_bytes += encoding->data.size();
+    }
+
+    dbug(DEBUG_LEVEL_VERY_VERBOSE, DEBUG_TYPE_NETCOM_UPLINK,
+         "sent " << dirty_count << " of " << count << " tiles (" << sent_bytes <<
+         " bytes) to client " << get_name());
+
+    return true;
 }
 
 /**
@@ -681,15 +1122,339 @@ NetcomUplink::upload_sensor (message_st *msg) const
     sensor_msg->sensor = htons(sensor_msg->sensor);
     sensor_msg->data = htons(sensor_msg->data);
 
-    sendto(client->sd, sensor_msg, sizeof(*sensor_msg), 0,
+    sendto(client->uplink_sd, sensor_msg, sizeof(*sensor_msg), 0,
+           (struct sockaddr*)&client->addr, sizeof(client->addr));
+}
+
+/**
+ * Send a detection event to the client, if subscribed
+ *
+ * Goes out on the uplink like the sensor data, only the boxes found are sent.
+ */
+void
+NetcomUplink::upload_detection (message_st *msg) const
+{
+    if (!detection_events) {
+        return;
+    }
+    message_detection_st *detection_msg = reinterpret_cast<message_detection_st*>(msg);
+
+    dbug(DEBUG_LEVEL_VERY_VERBOSE, DEBUG_TYPE_NETCOM_UPLINK,
+         "sending message " << message_print(msg) << " to client " << get_name());
+
+    int count = std::min((int)detection_msg->count, max_detections);
+    size_t length = sizeof(*detection_msg) - sizeof(detection_msg->boxes) +
+                    count * sizeof(message_box_st);
+    for (int i = 0; i < count; i++) {
+        message_box_st &box = detection_msg->boxes[i];
+        box.x = htons(box.x);
+        box.y = htons(box.y);
+        box.cols = htons(box.cols);
+        box.rows = htons(box.rows);
+        box.score = htons(box.score);
+    }
+    detection_msg->type = htonl(detection_msg->type);
+    detection_msg->frame_id = htonl(detection_msg->frame_id);
+    detection_msg->cols = htons(detection_msg->cols);
+    detection_msg->rows = htons(detection_msg->rows);
+    detection_msg->latency = htons(detection_msg->latency);
+    detection_msg->count = htons(count);
+
+    sendto(client->uplink_sd, detection_msg, length, 0,
            (struct sockaddr*)&client->addr, sizeof(client->addr));
 }
 
+/**
+ * Start streaming at the given frame rate, encoding tier and mode
+ *
+ * The client may ask for any frame rate up to the configured "fps" of the
+ * netcom section, 0 means the configured rate. The governor timer fires once
+ * per frame period, and the uplink sleeps in between.
+ */
+void
+NetcomUplink::start_stream (const int fps, const int tier, const int mode)
+{
+    int rate = get_rate(fps);
+
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_NETCOM_UPLINK,
+         "netcom client " << get_name() << " streaming tier '" <<
+         camera->get_tier_name(tier) << "' at " << rate << " fps" <<
+         ((STREAM_MODE_TILES == mode) ? ", tiles" : ""));
+
+    arm_timer(rate);
+
+    /* start with the tier's quality, and let the receiver reports adjust it */
+    this->tier = tier;
+    build_ladder(get_top(tier, mode));
+    level = 0;
+    good_reports = 0;
+    camera->subscribe(ladder[level]);
+
+    /* tile streams start with a keyframe */
+    this->mode = mode;
+    keyframe_due = true;
+
+    /* a running camera has a recent frame cached, send it right away */
+    camera->reserve(client->id);
+    last_seq = 0;
+    upload_frame();
+}
+
+/**
+ * Stop streaming
+ */
+void
+NetcomUplink::stop_stream (void)
+{
+    /* a pre-event ring being sent keeps the governor going */
+    if (ring_next >= ring_frames.size()) {
+        disarm_timer();
+    }
+
+    camera->unsubscribe(ladder[level]);
+    camera->release(client->id);
+
+    /* syscalls and CPU per image, to compare the transmit modes */
+    sender->report();
+}
+
+/**
+ * Frame rate of the governor for the asked rate, 0 means the configured one
+ *
+ * The rate is capped at the configured "fps" of the netcom section.
+ */
+int
+NetcomUplink::get_rate (const int fps) const
+{
+    int max_fps = config->get_int("fps");
+    int rate = fps;
+    if ((rate <= 0) || ((max_fps > 0) && (rate > max_fps))) {
+        rate = max_fps;
+    }
+    if (rate <= 0) {
+        rate = 30;
+    }
+    return rate;
+}
+
+/**
+ * Arm the frame rate governor
+ */
+void
+NetcomUplink::arm_timer (const int rate)
+{
+    long period = 1000000000L / rate;
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = period / 1000000000L;
+    spec.it_interval.tv_nsec = period % 1000000000L;
+    spec.it_value = spec.it_interval;
+    timerfd_settime(timer, 0, &spec, NULL);
+}
+
+/**
+ * Stop the frame rate governor
+ */
+void
+NetcomUplink::disarm_timer (void)
+{
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    timerfd_settime(timer, 0, &spec, NULL);
+}
+
+/**
+ * Build the ladder of encoding variants for loss adaptation
+ *
+ * The ladder starts with the client's encoding tier. Each step lowers the
+ * quality by "quality_step" down to "quality_min", then halves the resolution
+ * (up to "scale_max") and starts over from the tier's quality. The steps are
+ * the same for every client of a tier, so clients on the same step share the
+ * same encodes.
+ */
+void
+NetcomUplink::build_ladder (const frame_variant_st &top)
+{
+    int bottom = config->get_int("quality_min");
+    int step = config->get_int("quality_step");
+    int scale_max = config->get_int("scale_max");
+
+    ladder.clear();
+    if (!config->get_bool("adaptive") || (step <= 0)) {
+        bottom = top.quality;
+        scale_max = top.scale;
+        step = 1;
+    }
+    if (bottom > top.quality) {
+        bottom = top.quality;
+    }
+
+    for (int scale = top.scale; scale <= std::max(scale_max, top.scale); scale *= 2) {
+        for (int quality = top.quality; quality >= bottom; quality -= step) {
+            frame_variant_st variant = top;
+            variant.scale = scale;
+            variant.quality = quality;
+            ladder.push_back(variant);
+        }
+    }
+}
+
+/**
+ * Top variant of the given tier, with the region of interest if any
+ *
+ * Tile streams always get the whole frame. An explicit output size replaces
+ * the tier's downscaling, but the ladder may still scale it down further.
+ */
+frame_variant_st
+NetcomUplink::get_top (const int tier, const int mode) const
+{
+    frame_variant_st top = camera->get_tier(tier);
+    if ((STREAM_MODE_FRAMES != mode) || (roi.area() <= 0)) {
+        return top;
+    }
+    top.roi = roi;
+    top.size = roi_size;
+    if (roi_size.area() > 0) {
+        top.scale = 1;
+    }
+    return top;
+}
+
+/**
+ * Set the region of interest, applied right away if streaming
+ *
+ * The ladder is rebuilt around the new region, at the same step as before,
+ * so a zooming client doesn't start over from the best quality.
+ */
+void
+NetcomUplink::set_roi (const message_roi_st *msg, const bool streaming)
+{
+    roi = cv::Rect(msg->x, msg->y, msg->cols, msg->rows);
+    roi_size = cv::Size(msg->out_cols, msg->out_rows);
+    if (roi.area() <= 0) {
+        roi = cv::Rect();
+        roi_size = cv::Size();
+    }
+
+    dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_NETCOM_UPLINK,
+         "netcom client " << get_name() << " region of interest " << roi.width <<
+         "x" << roi.height << "+" << roi.x << "+" << roi.y << ", output " <<
+         roi_size.width << "x" << roi_size.height);
+
+    if (!streaming) {
+        return;
+    }
+    if (STREAM_MODE_FRAMES != mode) {
+        dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_NETCOM_UPLINK,
+             "netcom client " << get_name() << " streams tiles, region of " <<
+             "interest applies to snapshots only");
+        return;
+    }
+
+    frame_variant_st old_variant = ladder[level];
+    build_ladder(get_top(tier, mode));
+    if (level >= ladder.size()) {
+        level = ladder.size() - 1;
+    }
+    camera->subscribe(ladder[level]);
+    camera->unsubscribe(old_variant);
+}
+
+/**
+ * Change the capture mode of the camera
+ *
+ * The switch is done in the uplink's thread, so only this client waits for
+ * it; the streams of the others pause for the switch and carry on at the new
+ * resolution. Modes beyond "mode_cols_max" x "mode_rows_max" at "mode_fps_max"
+ * are refused before the camera is touched, since a switch pauses every
+ * client's stream.
+ */
+void
+NetcomUplink::set_mode (const message_mode_st *msg)
+{
+    int max_cols = config->get_int("mode_cols_max");
+    int max_rows = config->get_int("mode_rows_max");
+    int max_fps = config->get_int("mode_fps_max");
+    if ((msg->cols > ((max_cols > 0) ? max_cols : 1920)) ||
+        (msg->rows > ((max_rows > 0) ? max_rows : 1080)) ||
+        (msg->fps > ((max_fps > 0) ? max_fps : 30))) {
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_NETCOM_UPLINK,
+             "netcom client " << get_name() << " asked for capture mode " << msg->cols <<
+             "x" << msg->rows << " at " << msg->fps << " fps, beyond the limits, refused");
+        return;
+    }
+
+    capture_mode_st request;
+    request.cols = msg->cols;
+    request.rows = msg->rows;
+    request.fps = msg->fps;
+    request.subsampling = msg->subsampling;
+    request.fast_dct = (1 == msg->fast_dct) ? 1 : ((2 == msg->fast_dct) ? -1 : 0);
+
+    dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_NETCOM_UPLINK,
+         "netcom client " << get_name() << " asks for capture mode " << msg->cols <<
+         "x" << msg->rows << " at " << msg->fps << " fps");
+    camera->reconfigure(request);
+}
+
+/**
+ * Adapt the encoding variant to the loss seen by the client
+ *
+ * A single lost fragment ruins the whole frame, so when the fragment loss is
+ * above "loss_target" percent we step down immediately to make frames smaller.
+ * Stepping back up needs a few consecutive reports well below the target, to
+ * avoid oscillating around the link's capacity.
+ */
+void
+NetcomUplink::adapt (const message_report_st *report)
+{
+    static const int reports_to_step_up = 3;
+
+    uint32_t total = report->frags_received + report->frags_lost;
+    if ((0 == total) || ladder.empty()) {
+        return;
+    }
+
+    float loss = 100.0 * report->frags_lost / total;
+    float target = config->get_float("loss_target");
+    unsigned int old_level = level;
+
+    /* lost tiles leave holes in the client's picture until the next keyframe */
+    if (report->frags_lost > 0) {
+        keyframe_due = true;
+    }
+
+    if (loss > target) {
+        good_reports = 0;
+        if (level + 1 < ladder.size()) {
+            level++;
+        }
+    } else if (loss <= target / 2) {
+        if ((++good_reports >= reports_to_step_up) && (level > 0)) {
+            level--;
+            good_reports = 0;
+        }
+    } else {
+        good_reports = 0;
+    }
+
+    if (level != old_level) {
+        keyframe_due = true;
+        camera->subscribe(ladder[level]);
+        camera->unsubscribe(ladder[old_level]);
+        dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_NETCOM_UPLINK,
+             "netcom client " << get_name() << " loss " << loss << "%, " <<
+             "switching to scale 1/" << ladder[level].scale << " quality " <<
+             ladder[level].quality);
+    }
+}
+
 /**
  * Netcom client uplink thread loop
  *
  * This thread's job is to send messages to the corresponding netcom client
- * via it's datagram socket, such as camera frames and sensor data.
+ * via it's datagram socket, such as camera frames and sensor data. It sleeps
+ * until either a message arrives or the frame rate governor says it's time
+ * for the next frame.
  */
 void
 NetcomUplink::loop (void)
@@ -697,20 +1462,47 @@ NetcomUplink::loop (void)
     message_st *msg;
     bool loop = true;
     bool stream = false;
+    struct pollfd fds[3];
+
+    fds[0].fd = get_queue()->get_fd();
+    fds[0].events = POLLIN;
+    fds[1].fd = timer;
+    fds[1].events = POLLIN;
+    fds[2].events = POLLIN;
 
     dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_NETCOM_UPLINK,
          "starting netcom client " << get_name() << " loop");
 
     while (loop) {
         /* go to sleep if there's nothing to do */
-        if (!stream) {
-            get_queue()->wait_msg();
-        } else {
-            upload_frame();
+        fds[2].fd = sender->get_socket();
+        if (poll(fds, 3, -1) < 0) {
+            if (errno != EINTR) {
+                dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_NETCOM_UPLINK,
+                     "poll() returned error " << strerror(errno));
+            }
+            continue;
         }
 
-        /* process message */
-        if (NULL != (msg = get_queue()->pop_msg())) {
+        /* the client sent to the uplink's own socket */
+        if (fds[2].revents) {
+            sender->drain();
+        }
+
+        /* time for the next frame */
+        if (fds[1].revents & POLLIN) {
+            uint64_t expirations;
+            if (read(timer, &expirations, sizeof(expirations)) > 0) {
+                if (ring_next < ring_frames.size()) {
+                    upload_ring_frame(stream);
+                } else if (stream) {
+                    upload_frame();
+                }
+            }
+        }
+
+        /* process messages */
+        while (loop && (NULL != (msg = get_queue()->pop_msg()))) {
             dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_NETCOM_UPLINK,
                  "netcom client " << get_name() << " message " <<
                  message_print(msg));
@@ -718,23 +1510,76 @@ NetcomUplink::loop (void)
             switch (msg->type) {
             case MESSAGE_CAMERA_REQUEST: {
                 if (!stream) {
-                    camera->reserve(client->id);
+                    message_camera_st *camera_msg =
+                        reinterpret_cast<message_camera_st*>(msg);
+                    start_stream(camera_msg->fps, camera_msg->tier,
+                                 camera_msg->mode);
                 } else {
-                    camera->release(client->id);
+                    stop_stream();
                 }
                 stream = !stream;
                 break;
             }
 
+            case MESSAGE_CAMERA_REPORT: {
+                if (stream) {
+                    adapt(reinterpret_cast<message_report_st*>(msg));
+                }
+                break;
+            }
+
+            case MESSAGE_SNAPSHOT_REQUEST: {
+                send_snapshot(reinterpret_cast<message_snapshot_st*>(msg)->tier);
+                break;
+            }
+
+            case MESSAGE_CAMERA_ROI: {
+                set_roi(reinterpret_cast<message_roi_st*>(msg), stream);
+                break;
+            }
+
+            case MESSAGE_CAMERA_MODE: {
+                set_mode(reinterpret_cast<message_mode_st*>(msg));
+                break;
+            }
+
+            case MESSAGE_CAMERA_NACK: {
+                message_nack_st *nack_msg = reinterpret_cast<message_nack_st*>(msg);
+                sender->resend(nack_msg->frame_id, nack_msg->tile_id, nack_msg->frag_seq,
+                               nack_msg->frag_count);
+                break;
+            }
+
+            case MESSAGE_RING_DUMP: {
+                message_ring_st *ring_msg = reinterpret_cast<message_ring_st*>(msg);
+                dump_ring(ring_msg->target, ring_msg->seconds, stream);
+                break;
+            }
+
             case MESSAGE_SENSOR_DATA: {
                 upload_sensor(msg);
                 break;
             }
 
+            case MESSAGE_DETECTION_SUBSCRIBE: {
+                detection_events =
+                    (0 != reinterpret_cast<message_subscribe_st*>(msg)->enable);
+                dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_NETCOM_UPLINK,
+                     "netcom client " << get_name() <<
+                     (detection_events ? " subscribed to" : " unsubscribed from") <<
+                     " detection events");
+                break;
+            }
+
+            case MESSAGE_DETECTION: {
+                upload_detection(msg);
+                break;
+            }
+
             case MESSAGE_TERMINATE: {
                 if (stream) {
                     stream = false;
-                    camera->release(client->id);
+                    stop_stream();
                 }
                 loop = false;
                 break;
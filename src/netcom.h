@@ -26,10 +26,11 @@
 #define NETCOM_H_
 
 #include <string>
-#include <map>
 #include <openssl/ssl.h>
 
 #include "camera.h"
+#include "sender.h"
+#include "session.h"
 #include "worker.h"
 #include "message.h"
 #include "message_queue.h"
@@ -37,31 +38,13 @@
 
 namespace sentry {
 
-/** netcom uplink data */
-typedef struct netcom_uplink {
-    int id;                            /** client ID */
-    int sd;                            /** uplink stream socket */
-    struct sockaddr_storage addr;      /** client's address info */
-    unsigned char key[max_buf_size];   /** client specific key */
-    std::string name;                  /** uplink client name */
-} netcom_uplink_st;
-
-/** netcom client specific data */
-typedef struct netcom_client {
-    int sd;                            /** control socket descriptor */
-    SSL *ssl;                          /** SSL context of the client */
-    unsigned char otp[max_buf_size];   /** password used during connection init */
-    netcom_uplink_st *uplink;          /** pointer to the uplink object */
-    std::string name;                  /** client name */
-} netcom_client_st;
-
 /**
  * Netcom server class
  */
 class Netcom : public Worker {
   public:
     /** netcom server constructor */
-    Netcom (MessageQueue* const engine_queue);
+    Netcom (MessageQueue* const engine_queue, SessionTable *sessions);
 
     /** netcom server destructor */
     virtual ~Netcom (void);
@@ -79,7 +62,7 @@ class Netcom : public Worker {
     MessageQueue* const engine_queue;         /** main message queue */
     SSL_CTX *ssl_ctx;                         /** SSL context */
     int server_socket[NETCOM_SOCKET_MAX];     /** server sockets */
-    std::map<int, netcom_client_st*> clients; /** sd => client map */
+    SessionTable *sessions;                   /** client sessions */
 
     /** main thread loop */
     void loop (void);
@@ -90,14 +73,20 @@ class Netcom : public Worker {
     /** initialize server socket */
     void init_server_socket (const netcom_sockets_en type);
 
-    /** create new client */
-    netcom_client_st* create_client (void) const;
+    /** create new client session */
+    session_st* create_client (void);
 
     /** connect uplink socket */
     void connect_uplink (struct sockaddr_storage &client_addr, char *buf, int length);
 
+    /** fragment payload size for a client, the largest that fits the path MTU */
+    int negotiate_frag_size (const struct sockaddr_storage &addr, const int wish);
+
     /** process control message from client */
-    void proc_control_message (const netcom_client_st *client, char *buf, int length);
+    void proc_control_message (const session_st *client, char *buf, int length);
+
+    /** close the control channel of a client and announce it dead */
+    void close_client (session_st *client);
 };
 
 /**
@@ -106,25 +95,93 @@ class Netcom : public Worker {
 class NetcomUplink : public Worker {
   public:
     /** netcom uplink constructor */
-    NetcomUplink (MessageQueue* const engine_queue, netcom_uplink_st *client,
-                  Camera *camera);
+    NetcomUplink (MessageQueue* const engine_queue, session_st *client, Camera *camera);
 
     /** netcom uplink destructor */
     virtual ~NetcomUplink (void);
 
   private:
+    framework::Config *config;          /** netcom configuration */
     MessageQueue* const engine_queue;   /** main message queue */
-    netcom_uplink_st *client;           /** client object from the netcom server */
+    session_st *client;                 /** client session, outlives the uplink */
     Camera *camera;                     /** pointer to the camera object */
+    uint32_t last_seq;                  /** sequence number of the last frame sent */
+    int timer;                          /** frame rate governor timerfd */
+    std::vector<frame_variant_st> ladder; /** encoding variants, best first */
+    unsigned int level;                 /** current variant in the ladder */
+    int good_reports;                   /** consecutive reports below loss target */
+    int mode;                           /** stream mode */
+    int tier;                           /** encoding tier of the stream */
+    bool detection_events;              /** client subscribed to detection events */
+    cv::Rect roi;                       /** region of interest, empty for the whole frame */
+    cv::Size roi_size;                  /** output size of the region, empty for its own */
+    bool keyframe_due;                  /** next frame must be sent whole */
+    struct timespec last_keyframe;      /** time of the last whole frame */
+    int keyframe_interval;              /** seconds between keyframes */
+    std::vector<uint8_t> dirty;         /** tiles to send */
+    message_frame_st *frame_msg;        /** frame fragment header being sent */
+    message_tile_st *tile_msg;          /** tile fragment header being sent */
+    FragmentSender *sender;             /** encrypts and sends the fragments */
+    std::vector<ring_frame_st> ring_frames; /** pre-event ring being sent */
+    unsigned int ring_next;             /** next frame of the ring to send */
 
     /** main thread loop */
     void loop (void);
 
-    /** grab a camera frame and stream it to the client */
-    void upload_frame (void) const;
+    /** start streaming at the given frame rate, encoding tier and mode */
+    void start_stream (const int fps, const int tier, const int mode);
+
+    /** stop streaming */
+    void stop_stream (void);
+
+    /** frame rate of the governor for the asked rate, 0 means the configured one */
+    int get_rate (const int fps) const;
+
+    /** arm the frame rate governor */
+    void arm_timer (const int rate);
+
+    /** stop the frame rate governor */
+    void disarm_timer (void);
+
+    /** build the ladder of encoding variants for loss adaptation */
+    void build_ladder (const frame_variant_st &top);
+
+    /** top variant of the given tier, with the region of interest if any */
+    frame_variant_st get_top (const int tier, const int mode) const;
+
+    /** set the region of interest, applied right away if streaming */
+    void set_roi (const message_roi_st *msg, const bool streaming);
+
+    /** change the capture mode of the camera */
+    void set_mode (const message_mode_st *msg);
+
+    /** adapt the encoding variant to the loss seen by the client */
+    void adapt (const message_report_st *report);
+
+    /** stream the next camera frame to the client */
+    void upload_frame (void);
+
+    /** send an encoded frame to the client */
+    void send_frame (const uint32_t seq, const int cols, const int rows,
+                     const std::vector<unsigned char> &buf);
+
+    /** send a single still of the given tier, without starting a stream */
+    void send_snapshot (const int tier);
+
+    /** write the pre-event ring to disk, or send it to the client */
+    void dump_ring (const int target, const int seconds, const bool streaming);
+
+    /** send the next frame of the pre-event ring to the client */
+    void upload_ring_frame (const bool streaming);
+
+    /** stream the tiles of the frame that changed since the given frame */
+    bool upload_tiles (Frame *frame, const uint32_t since);
 
     /** upload sensor data to the client */
     void upload_sensor (message_st *msg) const;
+
+    /** send a detection event to the client, if subscribed */
+    void upload_detection (message_st *msg) const;
 };
 
 } /* namespace sentry */
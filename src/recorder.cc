@@ -0,0 +1,585 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * recorder.cc
+ *
+ * Segmented on-disk recorder implementation
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <iomanip>
+
+#include "recorder.h"
+
+namespace sentry {
+
+/** alignment of the block buffer, enough for O_DIRECT */
+static const size_t record_align = 4096;
+
+/**
+ * Milliseconds from since to now
+ */
+static long
+record_elapsed_msec (const struct timespec &since, const struct timespec &now)
+{
+    return (now.tv_sec - since.tv_sec) * 1000 + (now.tv_nsec - since.tv_nsec) / 1000000;
+}
+
+/**
+ * Order segments by name, the names start with the time of their first frame
+ */
+static bool
+record_segment_older (const std::pair<std::string, struct stat> &a,
+                      const std::pair<std::string, struct stat> &b)
+{
+    return a.first < b.first;
+}
+
+/**
+ * Recorder constructor
+ *
+ * Allocates the queue and the block buffer up front, and starts the I/O
+ * thread. Segment sizes are rounded up to whole blocks.
+ */
+Recorder::Recorder (void)
+        : first(0), count(0), queued(0), pushed(0), dropped(0), max_depth(0),
+          dump_ring(NULL), dump_seconds(0), fill(0), dirty(false), fd(-1), offset(0),
+          total_size(0), written(0), write_usec(0)
+{
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_RECORDER,
+         "parsing file " << framework::config_file << " for recorder config");
+    config = new framework::Config("recorder");
+
+    dir = config->get_string("dir");
+    if (dir.empty()) {
+        dir = "data/record";
+    }
+    int frames = config->get_int("queue_frames");
+    slots.resize((frames > 0) ? frames : 64);
+    int size = config->get_int("queue_size");
+    queue_budget = (size_t)((size > 0) ? size : 8) << 20;
+    size = config->get_int("block_size");
+    block_size = (size_t)((size > 0) ? size : 1024) << 10;
+    block_size = (block_size + record_align - 1) / record_align * record_align;
+    size = config->get_int("segment_size");
+    segment_size = (off_t)((size > 0) ? size : 64) << 20;
+    segment_size = (segment_size + block_size - 1) / block_size * block_size;
+    max_size = (off_t)std::max(0, config->get_int("max_size")) << 20;
+    max_age = (time_t)std::max(0, config->get_int("max_age")) * 3600;
+
+    if (0 != posix_memalign(reinterpret_cast<void**>(&block), record_align, block_size)) {
+        block = NULL;
+    }
+    if (NULL != block) {
+        memset(block, 0, block_size);
+    }
+
+    if ((mkdir(dir.c_str(), 0755) < 0) && (EEXIST != errno)) {
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_RECORDER,
+             "unable to create " << dir << ": " << strerror(errno));
+    }
+    scan();
+
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_RECORDER,
+         "recording to " << dir << " in " << (segment_size >> 20) << " MB segments, " <<
+         (block_size >> 10) << " KB writes, " << segments.size() << " segments (" <<
+         (total_size >> 20) << " MB) kept from earlier");
+
+    pthread_mutex_init(&mutex, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    running = (NULL != block);
+    if (running && (pthread_create(&thrd, 0, recorder_thread, this) != 0)) {
+        running = false;
+    }
+    if (!running) {
+        dbug(DEBUG_LEVEL_ERROR, DEBUG_TYPE_RECORDER,
+             "unable to start recorder thread");
+        return;
+    }
+    pthread_setname_np(thrd, "recorder");
+}
+
+/**
+ * Recorder destructor
+ *
+ * The I/O thread writes out what is still queued before it exits.
+ */
+Recorder::~Recorder (void)
+{
+    if (running) {
+        pthread_mutex_lock(&mutex);
+        running = false;
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&mutex);
+        pthread_join(thrd, NULL);
+    }
+
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&wake);
+    free(block);
+    delete config;
+}
+
+/**
+ * Queue an encoded frame for recording, dropping the oldest if full
+ *
+ * Called from the camera thread, so it never waits for the card: the lock is
+ * only held by the I/O thread while it takes a frame off the queue. The slot
+ * buffers keep their capacity, thus the steady state doesn't allocate.
+ */
+void
+Recorder::push (const uint32_t seq, const int cols, const int rows,
+                const std::vector<unsigned char> &data)
+{
+    if (data.empty() || (data.size() > queue_budget)) {
+        return;
+    }
+
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+
+    pthread_mutex_lock(&mutex);
+    if (!running) {
+        pthread_mutex_unlock(&mutex);
+        return;
+    }
+    while ((count == slots.size()) || (queued + data.size() > queue_budget)) {
+        queued -= slots[first].header.size;
+        first = (first + 1) % slots.size();
+        count--;
+        dropped++;
+    }
+
+    record_slot_st &slot = slots[(first + count) % slots.size()];
+    slot.header.magic = record_magic;
+    slot.header.seq = seq;
+    slot.header.size = data.size();
+    slot.header.cols = cols;
+    slot.header.rows = rows;
+    slot.header.sec = wall.tv_sec;
+    slot.header.nsec = wall.tv_nsec;
+    slot.header.reserved = 0;
+    slot.data.assign(data.begin(), data.end());
+    count++;
+    queued += data.size();
+    pushed++;
+    max_depth = std::max(max_depth, count);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Queue a dump of the last seconds of the pre-event ring
+ *
+ * The I/O thread copies the frames out of the ring and writes them in between
+ * the recorded frames. A dump asked for while another one is still pending
+ * is merged into it, covering the longer of the two spans.
+ */
+void
+Recorder::dump (FrameRing *ring, const int seconds)
+{
+    pthread_mutex_lock(&mutex);
+    if (!running) {
+        pthread_mutex_unlock(&mutex);
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_RECORDER,
+             "recorder thread is not running, pre-event ring not dumped");
+        return;
+    }
+    if ((NULL != dump_ring) && ((0 == dump_seconds) || (0 == seconds))) {
+        dump_seconds = 0;
+    } else if (NULL != dump_ring) {
+        dump_seconds = std::max(dump_seconds, seconds);
+    } else {
+        dump_seconds = seconds;
+    }
+    dump_ring = ring;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Find the segments of earlier runs
+ *
+ * They count against the retention limits, with their modification time as
+ * the time of their last frame.
+ */
+void
+Recorder::scan (void)
+{
+    DIR *handle = opendir(dir.c_str());
+    if (NULL == handle) {
+        return;
+    }
+
+    std::vector<std::pair<std::string, struct stat> > found;
+    struct dirent *entry;
+    while (NULL != (entry = readdir(handle))) {
+        std::string name(entry->d_name);
+        if ((name.size() < 4) || (".seg" != name.substr(name.size() - 4))) {
+            continue;
+        }
+        std::pair<std::string, struct stat> segment;
+        segment.first = dir + "/" + name;
+        if (0 == stat(segment.first.c_str(), &segment.second)) {
+            found.push_back(segment);
+        }
+    }
+    closedir(handle);
+
+    std::sort(found.begin(), found.end(), record_segment_older);
+    for (unsigned int i = 0; i < found.size(); i++) {
+        record_segment_st segment;
+        segment.path = found[i].first;
+        segment.size = found[i].second.st_size;
+        segment.updated = found[i].second.st_mtime;
+        segments.push_back(segment);
+        total_size += segment.size;
+    }
+}
+
+/**
+ * Append a frame to the current segment
+ *
+ * Frames never span segments, a new segment is started if the frame doesn't
+ * fit into the current one. Full blocks are written right away.
+ */
+void
+Recorder::append (const record_header_st &header, const std::vector<unsigned char> &data)
+{
+    off_t size = sizeof(header) + data.size();
+    if (size > segment_size) {
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_RECORDER,
+             "frame " << header.seq << " is larger than a segment, dropped");
+        return;
+    }
+    if (((fd < 0) || (offset + (off_t)fill + size > segment_size)) && !roll(header)) {
+        return;
+    }
+
+    const unsigned char *parts[2] = {
+        reinterpret_cast<const unsigned char*>(&header), &data[0]
+    };
+    size_t lengths[2] = {sizeof(header), data.size()};
+    for (int i = 0; i < 2; i++) {
+        const unsigned char *src = parts[i];
+        size_t length = lengths[i];
+        while (length > 0) {
+            size_t chunk = std::min(length, block_size - fill);
+            memcpy(block + fill, src, chunk);
+            fill += chunk;
+            src += chunk;
+            length -= chunk;
+            dirty = true;
+            if (fill < block_size) {
+                continue;
+            }
+            if (!write_block()) {
+                close_segment();
+                return;
+            }
+            offset += block_size;
+            fill = 0;
+            memset(block, 0, block_size);
+        }
+    }
+}
+
+/**
+ * Write the block at the current offset
+ *
+ * Always the whole block, the unused tail is zero, which ends the records.
+ */
+bool
+Recorder::write_block (void)
+{
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    size_t done = 0;
+    while (done < block_size) {
+        ssize_t length = pwrite(fd, block + done, block_size - done, offset + done);
+        if (length < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_RECORDER,
+                 "unable to write " << segment_path << ": " << strerror(errno));
+            return false;
+        }
+        done += length;
+    }
+    dirty = false;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    written += block_size;
+    write_usec += (end.tv_sec - begin.tv_sec) * 1000000 +
+                  (end.tv_nsec - begin.tv_nsec) / 1000;
+    return true;
+}
+
+/**
+ * Close the current segment and open a new one
+ *
+ * The segment is named after the time and sequence number of its first
+ * frame, and allocated at its full size right away, so the card doesn't
+ * fragment it while it grows. With "direct_io" the page cache is bypassed,
+ * if the file system supports it.
+ */
+bool
+Recorder::roll (const record_header_st &header)
+{
+    close_segment();
+
+    char stamp[32];
+    time_t sec = header.sec;
+    struct tm local;
+    localtime_r(&sec, &local);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &local);
+    std::stringstream name;
+    name << dir << "/" << stamp << "-" << std::setw(8) << std::setfill('0') <<
+        header.seq << ".seg";
+    segment_path = name.str();
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    if (config->get_bool("direct_io")) {
+        fd = open(segment_path.c_str(), flags | O_DIRECT, 0644);
+    }
+    if (fd < 0) {
+        fd = open(segment_path.c_str(), flags, 0644);
+    }
+    if (fd < 0) {
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_RECORDER,
+             "unable to create " << segment_path << ": " << strerror(errno));
+        return false;
+    }
+    int rc = posix_fallocate(fd, 0, segment_size);
+    if (0 != rc) {
+        dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_RECORDER,
+             "unable to preallocate " << segment_path << ": " << strerror(rc));
+    }
+
+    offset = 0;
+    fill = 0;
+    dirty = false;
+    memset(block, 0, block_size);
+
+    /* make room for the new segment */
+    retain();
+
+    dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_RECORDER,
+         "recording to " << segment_path);
+    return true;
+}
+
+/**
+ * Close the current segment
+ */
+void
+Recorder::close_segment (void)
+{
+    if (fd < 0) {
+        return;
+    }
+    if (fill > 0) {
+        write_block();
+    }
+    fdatasync(fd);
+
+    record_segment_st segment;
+    segment.path = segment_path;
+    struct stat info;
+    segment.size = (0 == fstat(fd, &info)) ? info.st_size : segment_size;
+    segment.updated = time(NULL);
+    close(fd);
+    fd = -1;
+
+    segments.push_back(segment);
+    total_size += segment.size;
+}
+
+/**
+ * Delete the oldest segments beyond the size and age limits
+ *
+ * The current segment counts against "max_size" at its full size, but it is
+ * never deleted.
+ */
+void
+Recorder::retain (void)
+{
+    time_t now = time(NULL);
+    off_t current = (fd < 0) ? 0 : segment_size;
+
+    while (!segments.empty()) {
+        const record_segment_st &oldest = segments.front();
+        bool full = (max_size > 0) && (total_size + current > max_size);
+        bool expired = (max_age > 0) && (now - oldest.updated > max_age);
+        if (!full && !expired) {
+            break;
+        }
+        dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_RECORDER,
+             "deleting " << oldest.path << (full ? ", recordings are full" : ", expired"));
+        if ((unlink(oldest.path.c_str()) < 0) && (ENOENT != errno)) {
+            dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_RECORDER,
+                 "unable to delete " << oldest.path << ": " << strerror(errno));
+        }
+        total_size -= oldest.size;
+        segments.pop_front();
+    }
+}
+
+/**
+ * Log the throughput and queue metrics
+ *
+ * Write throughput is the bytes written to the card over the interval, the
+ * write time shows how long the card took to take them. The queue depth is
+ * the deepest the queue got, which tells how close the recorder came to
+ * dropping frames.
+ */
+void
+Recorder::report (const long msec)
+{
+    pthread_mutex_lock(&mutex);
+    unsigned long frames = pushed;
+    unsigned long lost = dropped;
+    if ((0 != frames) || (0 != written)) {
+        dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_RECORDER,
+             "wrote " << written / 1024 * 1000 / ((msec > 0) ? msec : 1) << " KB/s in " <<
+             written / block_size << " blocks (" << write_usec / 1000 << " ms writing), " <<
+             frames << " frames queued, queue depth max " << max_depth << "/" <<
+             slots.size() << " (" << (queued >> 10) << " KB now)");
+    }
+    pushed = 0;
+    dropped = 0;
+    max_depth = count;
+    pthread_mutex_unlock(&mutex);
+
+    if ((0 == frames) && (0 == written)) {
+        return;
+    }
+
+    if (lost > 0) {
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_RECORDER,
+             "dropped " << lost << " frames, the card can't keep up");
+    }
+    written = 0;
+    write_usec = 0;
+}
+
+/**
+ * I/O thread
+ *
+ * Takes the frames off the queue one by one, and appends them to the current
+ * segment, and writes the pending ring dump in between. The unfinished block
+ * is written every "flush_interval" seconds, and the metrics are logged and
+ * the retention limits enforced every "stats_interval" seconds.
+ */
+void*
+Recorder::recorder_thread (void *args)
+{
+    Recorder *recorder = reinterpret_cast<Recorder*>(args);
+    record_header_st header;
+    std::string dump_path;
+    std::vector<unsigned char> data;
+    int interval = recorder->config->get_int("flush_interval");
+    long flush_msec = ((interval > 0) ? interval : 2) * 1000L;
+    interval = recorder->config->get_int("stats_interval");
+    long stats_msec = ((interval > 0) ? interval : 10) * 1000L;
+    struct timespec last_flush, last_stats;
+    clock_gettime(CLOCK_MONOTONIC, &last_flush);
+    last_stats = last_flush;
+
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_RECORDER,
+         "recorder thread started");
+
+    while (true) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec++;
+
+        /* take the oldest frame, its buffer is swapped for the previous one */
+        bool got = false;
+        pthread_mutex_lock(&recorder->mutex);
+        while (recorder->running && (0 == recorder->count) &&
+               (NULL == recorder->dump_ring)) {
+            if (ETIMEDOUT == pthread_cond_timedwait(&recorder->wake, &recorder->mutex,
+                                                    &deadline)) {
+                break;
+            }
+        }
+        if (recorder->count > 0) {
+            record_slot_st &slot = recorder->slots[recorder->first];
+            header = slot.header;
+            data.swap(slot.data);
+            recorder->queued -= header.size;
+            recorder->first = (recorder->first + 1) % recorder->slots.size();
+            recorder->count--;
+            got = true;
+        }
+        FrameRing *ring = recorder->dump_ring;
+        int seconds = recorder->dump_seconds;
+        recorder->dump_ring = NULL;
+        bool done = !recorder->running && !got && (NULL == ring);
+        pthread_mutex_unlock(&recorder->mutex);
+
+        if (got) {
+            recorder->append(header, data);
+        }
+        if (NULL != ring) {
+            ring->dump(seconds, dump_path);
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (recorder->dirty && (recorder->fd >= 0) &&
+            (record_elapsed_msec(last_flush, now) >= flush_msec)) {
+            recorder->write_block();
+            last_flush = now;
+        }
+        if (record_elapsed_msec(last_stats, now) >= stats_msec) {
+            recorder->report(record_elapsed_msec(last_stats, now));
+            recorder->retain();
+            last_stats = now;
+        }
+        if (done) {
+            break;
+        }
+    }
+
+    recorder->close_segment();
+
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_RECORDER,
+         "recorder thread stopped");
+
+    pthread_exit(NULL);
+}
+
+} /* namespace sentry */
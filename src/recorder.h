@@ -0,0 +1,163 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * recorder.h
+ *
+ * Segmented on-disk recorder class declaration
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#ifndef RECORDER_H_
+#define RECORDER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "ring.h"
+#include "framework.h"
+
+namespace sentry {
+
+/** magic number of a record in a segment file */
+static const uint32_t record_magic = 0x53524543;
+
+/**
+ * Header of a recorded frame in a segment file
+ *
+ * Fields are in host byte order, the JPEG image follows right after. A zero
+ * magic marks the end of the records in a segment.
+ */
+typedef struct record_header {
+    uint32_t magic;     /** record_magic */
+    uint32_t seq;       /** frame sequence number */
+    uint32_t size;      /** size of the JPEG image */
+    uint16_t cols;      /** cols of the encoded image */
+    uint16_t rows;      /** rows of the encoded image */
+    int64_t sec;        /** wall clock time of the frame, seconds */
+    int32_t nsec;       /** wall clock time of the frame, nanoseconds */
+    uint32_t reserved;  /** zero */
+} record_header_st;
+
+/**
+ * Recorder class
+ *
+ * Records encoded frames to "segment_size" megabyte segment files, written
+ * sequentially by a dedicated I/O thread in "block_size" kilobyte blocks, at
+ * block aligned offsets. SD cards are slow and wear quickly with small random
+ * writes, so nothing smaller than a block is ever written; an unfinished
+ * block is rewritten in place when the thread has nothing else to do, so at
+ * most a block is lost on a power cut.
+ *
+ * The camera thread only copies the frame into a bounded queue and never
+ * waits for the card: when the queue is full, the oldest queued frame is
+ * dropped. Whole segments are deleted, oldest first, to keep the recordings
+ * under "max_size" megabytes and "max_age" hours. The I/O thread also writes
+ * the dumps of the pre-event ring, so the card never holds up a client.
+ */
+class Recorder {
+  public:
+    /** recorder constructor */
+    Recorder (void);
+
+    /** recorder destructor */
+    virtual ~Recorder (void);
+
+    /** queue an encoded frame for recording, dropping the oldest if full */
+    void push (const uint32_t seq, const int cols, const int rows,
+               const std::vector<unsigned char> &data);
+
+    /** queue a dump of the last seconds of the pre-event ring */
+    void dump (FrameRing *ring, const int seconds);
+
+  private:
+    /** frame waiting for the I/O thread */
+    typedef struct record_slot {
+        record_header_st header;            /** record header */
+        std::vector<unsigned char> data;    /** JPEG image, capacity is reused */
+    } record_slot_st;
+
+    /** finished segment file */
+    typedef struct record_segment {
+        std::string path;                   /** file name */
+        off_t size;                         /** size on disk */
+        time_t updated;                     /** wall clock time of the last write */
+    } record_segment_st;
+
+    framework::Config *config;            /** recorder configuration */
+    std::string dir;                      /** where the segments go */
+    pthread_t thrd;                       /** I/O thread */
+    bool running;                         /** flag to indicate I/O thread is running */
+    pthread_mutex_t mutex;                /** mutex to protect the queue */
+    pthread_cond_t wake;                  /** wakes up the I/O thread */
+    std::vector<record_slot_st> slots;    /** queue of frames, a circle */
+    unsigned int first;                   /** oldest queued frame */
+    unsigned int count;                   /** number of queued frames */
+    size_t queued;                        /** bytes queued */
+    size_t queue_budget;                  /** max bytes queued */
+    unsigned long pushed;                 /** frames queued since the last stats */
+    unsigned long dropped;                /** frames dropped since the last stats */
+    unsigned int max_depth;               /** deepest queue since the last stats */
+    FrameRing *dump_ring;                 /** ring to dump, NULL if none pending */
+    int dump_seconds;                     /** last seconds to dump, 0 means all */
+    unsigned char *block;                 /** block being filled, aligned */
+    size_t block_size;                    /** size of a write */
+    size_t fill;                          /** bytes in the block */
+    bool dirty;                           /** block changed since it was last written */
+    int fd;                               /** current segment, -1 if none */
+    std::string segment_path;             /** name of the current segment */
+    off_t segment_size;                   /** size of a segment */
+    off_t offset;                         /** file offset of the block */
+    std::deque<record_segment_st> segments; /** finished segments, oldest first */
+    off_t total_size;                     /** size of all segments */
+    off_t max_size;                       /** retention by size, 0 disables */
+    time_t max_age;                       /** retention by age in seconds, 0 disables */
+    unsigned long written;                /** bytes written since the last stats */
+    unsigned long write_usec;             /** time spent writing since the last stats */
+
+    /** find the segments of earlier runs */
+    void scan (void);
+
+    /** append a frame to the current segment */
+    void append (const record_header_st &header, const std::vector<unsigned char> &data);
+
+    /** write the block at the current offset */
+    bool write_block (void);
+
+    /** close the current segment and open a new one */
+    bool roll (const record_header_st &header);
+
+    /** close the current segment */
+    void close_segment (void);
+
+    /** delete the oldest segments beyond the size and age limits */
+    void retain (void);
+
+    /** log the throughput and queue metrics */
+    void report (const long msec);
+
+    /** I/O thread */
+    static void* recorder_thread (void *args);
+};
+
+} /* namespace sentry */
+
+#endif /* RECORDER_H_ */
@@ -0,0 +1,245 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * ring.cc
+ *
+ * Pre-event ring buffer implementation
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fstream>
+
+#include "ring.h"
+
+namespace sentry {
+
+/**
+ * Milliseconds from since to now
+ */
+static long
+ring_elapsed_msec (const struct timespec &since, const struct timespec &now)
+{
+    return (now.tv_sec - since.tv_sec) * 1000 + (now.tv_nsec - since.tv_nsec) / 1000000;
+}
+
+/**
+ * Frame ring constructor
+ *
+ * Uses the "ring_size" (megabytes), "ring_seconds", "ring_dir" and "fps" keys
+ * of the camera section. The index has room for ring_seconds at the camera's
+ * frame rate.
+ */
+FrameRing::FrameRing (framework::Config *config)
+        : first(0), count(0), head(0)
+{
+    int size = config->get_int("ring_size");
+    seconds = config->get_int("ring_seconds");
+    if (seconds <= 0) {
+        seconds = 10;
+    }
+    int fps = config->get_int("fps");
+    dir = config->get_string("ring_dir");
+    if (dir.empty()) {
+        dir = "data/events";
+    }
+
+    pthread_mutex_init(&mutex, NULL);
+    arena.resize((size_t)((size > 0) ? size : 8) << 20);
+    entries.resize(seconds * ((fps > 0) ? fps : 30) + 1);
+
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_CAMERA,
+         "pre-event ring of " << seconds << " seconds in " << (arena.size() >> 20) <<
+         " MB, dumps go to " << dir);
+}
+
+/**
+ * Frame ring destructor
+ */
+FrameRing::~FrameRing (void)
+{
+    pthread_mutex_destroy(&mutex);
+}
+
+/**
+ * Add an encoded frame, evicting the oldest ones as needed
+ *
+ * Frames are evicted if their image is in the way of the new one, if they are
+ * older than the time span, or if the index is full. Images larger than the
+ * whole arena are dropped.
+ */
+void
+FrameRing::push (const uint32_t seq, const struct timespec &time, const int cols,
+                 const int rows, const std::vector<unsigned char> &data)
+{
+    size_t size = data.size();
+    if ((0 == size) || (size > arena.size())) {
+        return;
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    /* wrap around if it doesn't fit, the tail of the arena is lost then */
+    size_t start = head;
+    bool wrapped = (head + size > arena.size());
+    if (wrapped) {
+        head = 0;
+    }
+
+    /* make room, the oldest images are the ones right after the head */
+    while (count > 0) {
+        const ring_entry_st &oldest = entries[first];
+        bool overlap = ((oldest.offset < head + size) &&
+                        (oldest.offset + oldest.size > head)) ||
+                       (wrapped && (oldest.offset + oldest.size > start));
+        bool expired = (ring_elapsed_msec(oldest.time, time) > seconds * 1000L);
+        if (!overlap && !expired && (count < entries.size())) {
+            break;
+        }
+        pop();
+    }
+
+    memcpy(&arena[head], &data[0], size);
+    ring_entry_st &entry = entries[(first + count) % entries.size()];
+    entry.seq = seq;
+    entry.time = time;
+    clock_gettime(CLOCK_REALTIME, &entry.wall);
+    entry.cols = cols;
+    entry.rows = rows;
+    entry.offset = head;
+    entry.size = size;
+    count++;
+    head += size;
+
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Copy the frames of the last seconds (0 means all), oldest first
+ *
+ * Dumps are rare, so the copies are allocated here, and the ring is locked
+ * only while copying.
+ */
+void
+FrameRing::copy (std::vector<ring_frame_st> &frames, const int seconds)
+{
+    pthread_mutex_lock(&mutex);
+    unsigned int start = find_start(seconds);
+    frames.resize(count - start);
+    for (unsigned int i = start; i < count; i++) {
+        const ring_entry_st &entry = entries[(first + i) % entries.size()];
+        ring_frame_st &frame = frames[i - start];
+        frame.seq = entry.seq;
+        frame.wall = entry.wall;
+        frame.cols = entry.cols;
+        frame.rows = entry.rows;
+        frame.data.assign(arena.begin() + entry.offset,
+                          arena.begin() + entry.offset + entry.size);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Write the frames of the last seconds into a new directory
+ *
+ * The directory is named after the current time, under "ring_dir", and each
+ * frame goes into its own JPEG file named after its sequence number. Returns
+ * the number of frames written, or -1 if the directory can't be created.
+ */
+int
+FrameRing::dump (const int seconds, std::string &path)
+{
+    std::vector<ring_frame_st> frames;
+    copy(frames, seconds);
+
+    char name[32];
+    time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    strftime(name, sizeof(name), "%Y%m%d-%H%M%S", &local);
+    path = dir + "/" + name;
+
+    if (((mkdir(dir.c_str(), 0755) < 0) && (EEXIST != errno)) ||
+        ((mkdir(path.c_str(), 0755) < 0) && (EEXIST != errno))) {
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_CAMERA,
+             "unable to create " << path << ": " << strerror(errno));
+        return -1;
+    }
+
+    int written = 0;
+    for (unsigned int i = 0; i < frames.size(); i++) {
+        std::stringstream file_name;
+        file_name << path << "/frame-" << frames[i].seq << ".jpg";
+        std::ofstream file(file_name.str().c_str(), std::ios::binary);
+        file.write(reinterpret_cast<const char*>(&frames[i].data[0]),
+                   frames[i].data.size());
+        if (file.good()) {
+            written++;
+        }
+    }
+
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_CAMERA,
+         "dumped " << written << " frames to " << path);
+
+    return written;
+}
+
+/**
+ * Drop the oldest entry
+ *
+ * Must be called with the ring locked. The head goes back to the start of the
+ * arena once the ring is empty, to keep the images together.
+ */
+void
+FrameRing::pop (void)
+{
+    first = (first + 1) % entries.size();
+    if (0 == --count) {
+        first = 0;
+        head = 0;
+    }
+}
+
+/**
+ * Index of the first entry of the last seconds, relative to the oldest one
+ *
+ * Must be called with the ring locked.
+ */
+unsigned int
+FrameRing::find_start (const int seconds) const
+{
+    if ((seconds <= 0) || (0 == count)) {
+        return 0;
+    }
+
+    const ring_entry_st &newest = entries[(first + count - 1) % entries.size()];
+    unsigned int start = 0;
+    while (start < count) {
+        const ring_entry_st &entry = entries[(first + start) % entries.size()];
+        if (ring_elapsed_msec(entry.time, newest.time) <= seconds * 1000L) {
+            break;
+        }
+        start++;
+    }
+    return start;
+}
+
+} /* namespace sentry */
@@ -0,0 +1,107 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * ring.h
+ *
+ * Pre-event ring buffer class declaration
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#ifndef RING_H_
+#define RING_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "framework.h"
+
+namespace sentry {
+
+/** encoded frame copied out of the ring */
+typedef struct ring_frame {
+    uint32_t seq;                       /** frame sequence number */
+    struct timespec wall;               /** wall clock time of the frame */
+    int cols;                           /** cols of the encoded image */
+    int rows;                           /** rows of the encoded image */
+    std::vector<unsigned char> data;    /** JPEG image */
+} ring_frame_st;
+
+/**
+ * FrameRing class
+ *
+ * Keeps the encoded frames of the last "ring_seconds" seconds, so the moments
+ * before an incident can be reviewed. The JPEG images live in a single arena
+ * of "ring_size" megabytes, allocated up front and written in a circle: a new
+ * image goes after the previous one, or back at the start of the arena if it
+ * doesn't fit before the end, and evicts the oldest images it overlaps. The
+ * index of the images is a fixed size table, so pushing a frame never
+ * allocates. If the arena is too small for the configured time span, the
+ * ring simply holds fewer seconds.
+ */
+class FrameRing {
+  public:
+    /** frame ring constructor */
+    FrameRing (framework::Config *config);
+
+    /** frame ring destructor */
+    virtual ~FrameRing (void);
+
+    /** add an encoded frame, evicting the oldest ones as needed */
+    void push (const uint32_t seq, const struct timespec &time, const int cols,
+               const int rows, const std::vector<unsigned char> &data);
+
+    /** copy the frames of the last seconds (0 means all), oldest first */
+    void copy (std::vector<ring_frame_st> &frames, const int seconds);
+
+    /** write the frames of the last seconds into a new directory */
+    int dump (const int seconds, std::string &path);
+
+  private:
+    /** an image in the arena */
+    typedef struct ring_entry {
+        uint32_t seq;              /** frame sequence number */
+        struct timespec time;      /** capture time (CLOCK_MONOTONIC) */
+        struct timespec wall;      /** wall clock time of the frame */
+        int cols;                  /** cols of the encoded image */
+        int rows;                  /** rows of the encoded image */
+        size_t offset;             /** start of the image in the arena */
+        size_t size;               /** size of the image */
+    } ring_entry_st;
+
+    pthread_mutex_t mutex;                /** mutex to protect the ring */
+    std::vector<unsigned char> arena;     /** JPEG images */
+    std::vector<ring_entry_st> entries;   /** index of the images, a circle too */
+    unsigned int first;                   /** oldest entry */
+    unsigned int count;                   /** number of entries */
+    size_t head;                          /** where the next image goes */
+    int seconds;                          /** time span to keep */
+    std::string dir;                      /** where dumps go */
+
+    /** drop the oldest entry */
+    void pop (void);
+
+    /** index of the first entry of the last seconds */
+    unsigned int find_start (const int seconds) const;
+};
+
+} /* namespace sentry */
+
+#endif /* RING_H_ */
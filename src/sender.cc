@@ -0,0 +1,649 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * sender.cc
+ *
+ * Fragment sender implementation
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
+#include <sstream>
+
+#include "sender.h"
+
+/* older C libraries don't know about these yet, the kernel may still do */
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+namespace sentry {
+
+/** most datagrams the kernel cuts a single send into */
+static const int sender_gso_segments = 64;
+
+/** largest send the kernel cuts into datagrams */
+static const int sender_gso_size = 65000;
+
+/** packed buffers in rotation for zerocopy sends */
+static const int sender_pinned_buffers = 4;
+
+/** milliseconds to wait for a pinned buffer to be completed */
+static const int sender_reap_msec = 5;
+
+/** images kept for retransmits, frames or tiles */
+static const int sender_cache_images = 32;
+
+/** transmit mode names */
+static const char *sender_mode_names[] = { "batch", "gso", "zerocopy" };
+
+/**
+ * Fragment sender constructor
+ *
+ * The segmenting modes need a socket of their own, bound to the server port
+ * (the client, and the NAT in front of it, only take datagrams from there)
+ * and connected to the client, so the zerocopy completions of the client
+ * don't mix with the others'.
+ */
+FragmentSender::FragmentSender (const std::string &name, const int shared_sd,
+                                const struct sockaddr_storage &addr,
+                                const unsigned char *key, const int frag_size,
+                                const transmit_mode_en mode, const int batch, const int port,
+                                const ParityCode &code)
+        : name(name), shared_sd(shared_sd), sd(-1), addr(addr), key(key),
+          frag_size(std::max(1, std::min(frag_size, max_frag_size))), code(code),
+          mode(mode), batch(std::max(0, std::min(batch, UIO_MAXIOV))), current(0),
+          hdr_size(0), count(0), cache_next(0), cache_msec(0), budget_percent(0),
+          budget(0), next_id(0), images(0), frags(0), parity_frags(0), calls(0), usec(0),
+          copied(0), busy(0), resent(0), denied(0), expired(0)
+{
+    if ((TRANSMIT_MODE_BATCH != mode) && !open_socket(port)) {
+        this->mode = TRANSMIT_MODE_BATCH;
+    }
+    buffers.resize((TRANSMIT_MODE_ZEROCOPY == this->mode) ? sender_pinned_buffers + 1 : 1);
+    for (unsigned int i = 0; i < buffers.size(); i++) {
+        buffers[i].first_id = 0;
+        buffers[i].sends = 0;
+        buffers[i].pending = 0;
+    }
+
+    dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_NETCOM_UPLINK,
+         "netcom client " << name << " transmit mode " << sender_mode_names[this->mode] <<
+         ", " << this->frag_size << " byte fragments, " << this->code.get_parity() <<
+         " parity per " << this->code.get_group() << " fragments");
+}
+
+/**
+ * Fragment sender destructor
+ *
+ * Pages of zerocopy sends still in flight are held by the kernel itself, the
+ * buffers may go.
+ */
+FragmentSender::~FragmentSender (void)
+{
+    if (sd >= 0) {
+        close(sd);
+    }
+}
+
+/**
+ * Transmit mode by name, batch if unknown
+ */
+transmit_mode_en
+FragmentSender::parse_mode (const std::string &name)
+{
+    for (int i = TRANSMIT_MODE_ZEROCOPY; i > TRANSMIT_MODE_BATCH; i--) {
+        if (name == sender_mode_names[i]) {
+            return (transmit_mode_en)i;
+        }
+    }
+    return TRANSMIT_MODE_BATCH;
+}
+
+/**
+ * Keep images sent for msec for retransmits, at most percent extra
+ *
+ * No cache at all if either is 0.
+ */
+void
+FragmentSender::set_cache (const int msec, const int percent)
+{
+    cache_msec = std::max(0, msec);
+    budget_percent = std::max(0, percent);
+    cache.clear();
+    if ((0 != cache_msec) && (0 != budget_percent)) {
+        cache.resize(sender_cache_images);
+        for (unsigned int i = 0; i < cache.size(); i++) {
+            cache[i].frame_id = 0;
+            cache[i].tile_id = nack_whole_frame;
+            cache[i].sent.tv_sec = 0;
+            cache[i].sent.tv_nsec = 0;
+            cache[i].hdr_size = 0;
+        }
+    }
+    cache_next = 0;
+    budget = 0;
+}
+
+/**
+ * Transmit mode in use, after the fallbacks
+ */
+transmit_mode_en
+FragmentSender::get_mode (void) const
+{
+    return mode;
+}
+
+/**
+ * Own socket of the segmenting modes, -1 if none
+ */
+int
+FragmentSender::get_socket (void) const
+{
+    return sd;
+}
+
+/**
+ * Handle what came in on the own socket
+ *
+ * Being connected, the own socket gets whatever the client sends to the
+ * server port from then on, instead of the server socket. The client only
+ * sends there to connect an uplink, so the session is starting over from the
+ * same address (e.g. a NAT kept the port): the socket is given up for the
+ * next try to reach the server socket, and the images are batched on the
+ * shared socket. Zerocopy completions are collected too, they keep the
+ * socket polling otherwise.
+ */
+void
+FragmentSender::drain (void)
+{
+    if (sd < 0) {
+        return;
+    }
+    reap(false);
+
+    bool inbound = false;
+    char buf[64];
+    while (true) {
+        if (recv(sd, buf, sizeof(buf), MSG_DONTWAIT) >= 0) {
+            inbound = true;
+        } else if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+            break;
+        }
+    }
+    if (inbound) {
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_NETCOM_UPLINK,
+             "client " << name << " connects again from the same address, batching instead");
+        close(sd);
+        sd = -1;
+        mode = TRANSMIT_MODE_BATCH;
+    }
+}
+
+/**
+ * Open the own socket of the segmenting modes
+ *
+ * Probes for segmentation offload (Linux 4.18) and UDP zerocopy (Linux 5.0),
+ * and steps the mode down to what the kernel can do. Returns false if there
+ * is nothing to gain over batching.
+ */
+bool
+FragmentSender::open_socket (const int port)
+{
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    local.sin_port = htons(port);
+
+    int on = 1;
+    sd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if ((sd < 0) ||
+        (setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) ||
+        (bind(sd, (struct sockaddr*)&local, sizeof(local)) < 0) ||
+        (connect(sd, (struct sockaddr*)&addr, sizeof(struct sockaddr_in)) < 0)) {
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_NETCOM_UPLINK,
+             "unable to open uplink socket of client " << name << ": " <<
+             strerror(errno) << ", batching instead");
+        if (sd >= 0) {
+            close(sd);
+            sd = -1;
+        }
+        return false;
+    }
+
+    int gso = 0;
+    if (setsockopt(sd, SOL_UDP, UDP_SEGMENT, &gso, sizeof(gso)) < 0) {
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_NETCOM_UPLINK,
+             "no UDP segmentation offload: " << strerror(errno) << ", batching instead");
+        close(sd);
+        sd = -1;
+        return false;
+    }
+
+    if ((TRANSMIT_MODE_ZEROCOPY == mode) &&
+        (setsockopt(sd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0)) {
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_NETCOM_UPLINK,
+             "no UDP zerocopy: " << strerror(errno) << ", segmenting only");
+        mode = TRANSMIT_MODE_GSO;
+    }
+    return true;
+}
+
+/**
+ * Pick a buffer for an image, returns where the fragments go
+ *
+ * Zerocopy sends take the first buffer the kernel is done with, waiting a
+ * little if there is none, then settle for the spare one.
+ */
+char*
+FragmentSender::prepare (const int frags, const int header)
+{
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_begin);
+    hdr_size = header;
+    count = frags;
+
+    current = buffers.size() - 1;
+    if (TRANSMIT_MODE_ZEROCOPY == mode) {
+        for (int attempt = 0; (attempt < 2) && (buffers.size() - 1 == current); attempt++) {
+            reap(attempt > 0);
+            for (unsigned int i = 0; i < buffers.size() - 1; i++) {
+                if (0 == buffers[i].pending) {
+                    current = i;
+                    break;
+                }
+            }
+        }
+        if (buffers.size() - 1 == current) {
+            busy++;
+        }
+    }
+
+    tx_buffer_st &buffer = buffers[current];
+    buffer.data.resize(count * (hdr_size + frag_size));
+    buffer.sends = 0;
+    lengths.resize(count);
+    return &buffer.data[0];
+}
+
+/**
+ * XOR a stripe of data fragments into a parity fragment, returns its size
+ *
+ * The parity is as long as the longest fragment of the stripe, the shorter
+ * ones count as padded with zeros.
+ */
+int
+FragmentSender::encode_parity (const int data_frags, const int index)
+{
+    int stride = hdr_size + frag_size;
+    char *data = &buffers[current].data[0];
+    char *parity = data + (data_frags + index) * stride + hdr_size;
+    int first, end;
+    code.get_stripe(data_frags, index, first, end);
+
+    int length = lengths[first];
+    memcpy(parity, data + first * stride + hdr_size, length);
+    for (int frag = first + code.get_parity(); frag < end; frag += code.get_parity()) {
+        const char *payload = data + frag * stride + hdr_size;
+        for (int i = 0; i < lengths[frag]; i++) {
+            parity[i] ^= payload[i];
+        }
+    }
+    lengths[data_frags + index] = length;
+    parity_frags++;
+    return length;
+}
+
+/**
+ * Send the image prepared
+ */
+void
+FragmentSender::transmit (void)
+{
+    const char *data = &buffers[current].data[0];
+    int first = 0;
+    if (TRANSMIT_MODE_BATCH != mode) {
+        first = transmit_segmented(data);
+    }
+    if (first < count) {
+        transmit_batched(data, lengths, hdr_size, first, count);
+    }
+
+    struct timespec cpu_end;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+    images++;
+    frags += count;
+    usec += (cpu_end.tv_sec - cpu_begin.tv_sec) * 1000000 +
+            (cpu_end.tv_nsec - cpu_begin.tv_nsec) / 1000;
+}
+
+/**
+ * Keep a copy of the image sent for retransmits
+ *
+ * The oldest image makes room, and the image pays its share into the
+ * retransmit budget. The budget saves up to the largest image in the cache,
+ * so a keyframe lost among small tiles can still be resent whole.
+ */
+void
+FragmentSender::store (const uint32_t frame_id, const int tile_id)
+{
+    cached_image_st &image = cache[cache_next];
+    cache_next = (cache_next + 1) % cache.size();
+    image.frame_id = frame_id;
+    image.tile_id = tile_id;
+    clock_gettime(CLOCK_MONOTONIC, &image.sent);
+    image.hdr_size = hdr_size;
+    image.data.assign(buffers[current].data.begin(),
+                      buffers[current].data.begin() + count * (hdr_size + frag_size));
+    image.lengths.assign(lengths.begin(), lengths.begin() + count);
+
+    long largest = 0;
+    for (unsigned int i = 0; i < cache.size(); i++) {
+        largest = std::max(largest, (long)cache[i].data.size());
+    }
+    budget = std::min(budget + (long)image.data.size() * budget_percent / 100, largest);
+}
+
+/**
+ * Resend fragments of an image sent lately, returns the number resent
+ *
+ * Nothing is resent of an image no longer in the cache, or older than the
+ * cache time, and neither if the fragments asked for cost more than the
+ * budget left.
+ */
+int
+FragmentSender::resend (const uint32_t frame_id, const int tile_id, const int frag_seq,
+                        const int frag_count)
+{
+    if (cache.empty() || (frag_seq <= 0) || (frag_count <= 0)) {
+        return 0;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (unsigned int i = 0; i < cache.size(); i++) {
+        cached_image_st &image = cache[i];
+        if ((image.frame_id != frame_id) || (image.tile_id != tile_id) ||
+            image.lengths.empty()) {
+            continue;
+        }
+
+        int first = std::min(frag_seq - 1, (int)image.lengths.size());
+        int end = std::min(first + frag_count, (int)image.lengths.size());
+        long age = (now.tv_sec - image.sent.tv_sec) * 1000 +
+                   (now.tv_nsec - image.sent.tv_nsec) / 1000000;
+        if (age > cache_msec) {
+            expired += end - first;
+            return 0;
+        }
+
+        long cost = 0;
+        for (int frag = first; frag < end; frag++) {
+            cost += image.hdr_size + image.lengths[frag];
+        }
+        if (cost > budget) {
+            denied += end - first;
+            return 0;
+        }
+        budget -= cost;
+        transmit_batched(&image.data[0], image.lengths, image.hdr_size, first, end);
+        resent += end - first;
+        return end - first;
+    }
+
+    expired += frag_count;
+    return 0;
+}
+
+/**
+ * Send fragments with sendmmsg, or one by one
+ *
+ * Sends the fragments from first to end of a packed buffer, the ones before
+ * went out already, or aren't asked for.
+ */
+void
+FragmentSender::transmit_batched (const char *data, const std::vector<int> &sizes,
+                                  const int header, const int first, const int end)
+{
+    int stride = header + frag_size;
+    iovs.resize(std::max((int)iovs.size(), end));
+    msgs.resize(std::max((int)msgs.size(), end));
+    for (int frag = first; frag < end; frag++) {
+        iovs[frag].iov_base = const_cast<char*>(data) + frag * stride;
+        iovs[frag].iov_len = header + sizes[frag];
+        memset(&msgs[frag], 0, sizeof(msgs[frag]));
+        msgs[frag].msg_hdr.msg_name = &addr;
+        msgs[frag].msg_hdr.msg_namelen = sizeof(addr);
+        msgs[frag].msg_hdr.msg_iov = &iovs[frag];
+        msgs[frag].msg_hdr.msg_iovlen = 1;
+    }
+
+    int sent = first;
+    while (sent < end) {
+        calls++;
+        if (0 == batch) {
+            sendmsg(shared_sd, &msgs[sent].msg_hdr, 0);
+            sent++;
+            continue;
+        }
+        int length = sendmmsg(shared_sd, &msgs[sent], std::min(batch, end - sent), 0);
+        if (length > 0) {
+            sent += length;
+        } else if (ENOSYS == errno) {
+            dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_NETCOM_UPLINK,
+                 "sendmmsg() is not supported, sending fragments one by one");
+            batch = 0;
+        } else if (EINTR != errno) {
+            sent++;
+        }
+    }
+}
+
+/**
+ * Send fragments with segmentation offload, returns the first one not sent
+ *
+ * Each send carries as many fragments as the kernel cuts up at once, all of
+ * them a stride long but the last, so a short fragment ends the send. If the
+ * kernel turns out not to support it after all, the rest is left to
+ * batching, for good.
+ */
+int
+FragmentSender::transmit_segmented (const char *data)
+{
+    int stride = hdr_size + frag_size;
+    int segments = std::min(sender_gso_segments, sender_gso_size / stride);
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    tx_buffer_st &buffer = buffers[current];
+    bool zerocopy = (TRANSMIT_MODE_ZEROCOPY == mode) && (current < buffers.size() - 1);
+
+    int sent = 0;
+    while (sent < count) {
+        int frags = 1;
+        while ((frags < segments) && (sent + frags < count) &&
+               (lengths[sent + frags - 1] == frag_size)) {
+            frags++;
+        }
+        struct iovec iov;
+        iov.iov_base = const_cast<char*>(data) + sent * stride;
+        iov.iov_len = (frags - 1) * stride + hdr_size + lengths[sent + frags - 1];
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t gso_size = stride;
+        memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+
+        calls++;
+        if (sendmsg(sd, &msg, zerocopy ? MSG_ZEROCOPY : 0) >= 0) {
+            if (zerocopy) {
+                buffer.first_id = (0 == buffer.sends) ? next_id : buffer.first_id;
+                buffer.sends++;
+                buffer.pending++;
+                next_id++;
+            }
+            sent += frags;
+        } else if ((EIO == errno) || (EINVAL == errno) || (EOPNOTSUPP == errno)) {
+            /* no checksum offload on the way out, or no segmentation at all */
+            dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_NETCOM_UPLINK,
+                 "UDP segmentation offload failed with " << strerror(errno) <<
+                 " for client " << name << ", batching instead");
+            mode = TRANSMIT_MODE_BATCH;
+            return sent;
+        } else if (zerocopy && (ENOBUFS == errno)) {
+            /* out of memory to pin the pages, this one is copied */
+            zerocopy = false;
+        } else if (EINTR != errno) {
+            sent += frags;
+        }
+    }
+    return sent;
+}
+
+/**
+ * Collect the zerocopy completions, waiting for one if asked to
+ *
+ * A completion covers a range of send IDs, the pinned buffers with all their
+ * sends completed are free again. When the kernel says it copied the data
+ * anyway, zerocopy only costs the bookkeeping, so it's turned off.
+ */
+void
+FragmentSender::reap (const bool wait)
+{
+    if (wait) {
+        struct pollfd pfd;
+        pfd.fd = sd;
+        pfd.events = 0;
+        poll(&pfd, 1, sender_reap_msec);
+    }
+
+    while (true) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); NULL != cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if ((SOL_IP != cmsg->cmsg_level) || (IP_RECVERR != cmsg->cmsg_type)) {
+                continue;
+            }
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (SO_EE_ORIGIN_ZEROCOPY != err.ee_origin) {
+                continue;
+            }
+
+            uint32_t lo = err.ee_info;
+            uint32_t hi = err.ee_data;
+            for (unsigned int i = 0; i < buffers.size() - 1; i++) {
+                tx_buffer_st &buffer = buffers[i];
+                if (0 == buffer.pending) {
+                    continue;
+                }
+                uint32_t first = std::max(lo, buffer.first_id);
+                uint32_t last = std::min(hi, buffer.first_id + buffer.sends - 1);
+                if (first <= last) {
+                    buffer.pending -= std::min(buffer.pending, last - first + 1);
+                }
+            }
+
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                copied += hi - lo + 1;
+                if (TRANSMIT_MODE_ZEROCOPY == mode) {
+                    dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_NETCOM_UPLINK,
+                         "kernel copies the zerocopy sends of client " << name <<
+                         ", segmenting only");
+                    mode = TRANSMIT_MODE_GSO;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Log the send calls and CPU time per image, and start over
+ *
+ * The CPU time covers the encryption and the syscalls, to compare the
+ * transmit modes.
+ */
+void
+FragmentSender::report (void)
+{
+    if (0 != images) {
+        std::stringstream extra;
+        if (0 != copied) {
+            extra << ", " << copied << " zerocopy sends copied";
+        }
+        if (0 != busy) {
+            extra << ", " << busy << " images without a free pinned buffer";
+        }
+        if (0 != parity_frags) {
+            extra << ", " << parity_frags << " parity fragments";
+        }
+        if (0 != resent + denied + expired) {
+            extra << ", " << resent << " fragments resent, " << denied <<
+                     " over budget, " << expired << " asked for too late";
+        }
+        dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_NETCOM_UPLINK,
+             "netcom client " << name << " was sent " << images << " frames and " <<
+             "tiles in " << frags << " fragments, " << (double)calls / images <<
+             " send calls and " << usec / images << " us CPU each (" <<
+             sender_mode_names[mode] << ((0 == batch) ? ", one by one" : "") << ")" <<
+             extra.str());
+    }
+    images = 0;
+    frags = 0;
+    parity_frags = 0;
+    calls = 0;
+    usec = 0;
+    copied = 0;
+    busy = 0;
+    resent = 0;
+    denied = 0;
+    expired = 0;
+}
+
+} /* namespace sentry */
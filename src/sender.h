@@ -0,0 +1,271 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * sender.h
+ *
+ * Fragment sender class declaration
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#ifndef SENDER_H_
+#define SENDER_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "message.h"
+#include "framework.h"
+#include "fec.h"
+
+namespace sentry {
+
+/** uplink transmit modes */
+typedef enum transmit_mode {
+    TRANSMIT_MODE_BATCH = 0,   /** sendmmsg on the shared server socket */
+    TRANSMIT_MODE_GSO,         /** UDP segmentation offload on an own socket */
+    TRANSMIT_MODE_ZEROCOPY,    /** segmentation offload without copying the payload */
+} transmit_mode_en;
+
+/**
+ * FragmentSender class
+ *
+ * Sends images (frames and tiles) to a single client in fragments. The image
+ * is shared with the other clients, so it is never modified: each fragment
+ * is encrypted with the client's key into a packed buffer of the sender,
+ * header and payload back to back, one fragment every header size +
+ * "frag_size" bytes, the fragment size negotiated with the client. How the
+ * buffer leaves depends on the transmit mode:
+ *
+ *  - batch: up to "batch" fragments per sendmmsg call on the shared server
+ *    socket, or one by one with a batch of 0.
+ *  - gso: the sender opens its own socket, bound to the server port and
+ *    connected to the client, and hands the kernel up to 64 fragments in a
+ *    single sendmsg with UDP_SEGMENT, which cuts them into datagrams.
+ *  - zerocopy: like gso, with MSG_ZEROCOPY, so the payload isn't copied into
+ *    the socket buffers. The packed buffer then belongs to the kernel until
+ *    the completion notifications come in on the socket's error queue, so a
+ *    few of them are kept in rotation; an image that finds them all busy is
+ *    sent from a spare one, copied.
+ *
+ * A mode the kernel doesn't support falls back to the next simpler one, at
+ * setup or at the first send it fails, and so does zerocopy once the kernel
+ * reports it copied the data anyway (as it does over loopback).
+ *
+ * With a parity code, the parity fragments of the image are packed after its
+ * data fragments and go out with them. Fragments shorter than "frag_size"
+ * may then sit in the middle of the buffer, a segmented send ends at each.
+ *
+ * With a retransmit cache, a copy of the last few packed images is kept for
+ * the fragments the client asks for again, until they get too old to be of
+ * any use. Retransmits are batched on the shared socket, and paid for from a
+ * budget that each image sent adds a share of its size to, up to the size of
+ * an image: streaming stays ahead however lossy the link gets, the fragments
+ * over budget are lost.
+ */
+class FragmentSender {
+  public:
+    /** fragment sender constructor */
+    FragmentSender (const std::string &name, const int shared_sd,
+                    const struct sockaddr_storage &addr, const unsigned char *key,
+                    const int frag_size, const transmit_mode_en mode, const int batch,
+                    const int port, const ParityCode &code = ParityCode());
+
+    /** fragment sender destructor */
+    virtual ~FragmentSender (void);
+
+    /** transmit mode by name, batch if unknown */
+    static transmit_mode_en parse_mode (const std::string &name);
+
+    /** transmit mode in use, after the fallbacks */
+    transmit_mode_en get_mode (void) const;
+
+    /** own socket of the segmenting modes, -1 if none */
+    int get_socket (void) const;
+
+    /** handle what came in on the own socket */
+    void drain (void);
+
+    /** keep images sent for msec for retransmits, at most percent extra */
+    void set_cache (const int msec, const int percent);
+
+    /** encrypt and send data in fragments, msg is the header of each */
+    template <typename T>
+    void send (T *msg, char *payload, const std::vector<unsigned char> &buf);
+
+    /** resend fragments of an image sent lately, returns the number resent */
+    int resend (const uint32_t frame_id, const int tile_id, const int frag_seq,
+                const int frag_count);
+
+    /** log the send calls and CPU time per image, and start over */
+    void report (void);
+
+  private:
+    /** packed fragments of an image, kept until the kernel is done with them */
+    typedef struct tx_buffer {
+        std::vector<char> data;   /** fragments, header and payload back to back */
+        uint32_t first_id;        /** zerocopy ID of the first send from the buffer */
+        uint32_t sends;           /** zerocopy sends from the buffer */
+        uint32_t pending;         /** zerocopy sends not completed yet */
+    } tx_buffer_st;
+
+    /** packed copy of an image sent lately, for retransmits */
+    typedef struct cached_image {
+        uint32_t frame_id;        /** frame identifier */
+        int tile_id;              /** tile index, nack_whole_frame for frames */
+        struct timespec sent;     /** when it was sent */
+        int hdr_size;             /** fragment header size */
+        std::vector<char> data;   /** fragments, header and payload back to back */
+        std::vector<int> lengths; /** payload size of each fragment */
+    } cached_image_st;
+
+    std::string name;                     /** client name, for the logs */
+    int shared_sd;                        /** shared server socket */
+    int sd;                               /** own connected socket, -1 if none */
+    struct sockaddr_storage addr;         /** client's uplink address */
+    const unsigned char *key;             /** client specific key */
+    int frag_size;                        /** fragment payload size */
+    ParityCode code;                      /** parity fragments added to each image */
+    transmit_mode_en mode;                /** transmit mode in use */
+    int batch;                            /** fragments per sendmmsg call */
+    std::vector<tx_buffer_st> buffers;    /** packed images, the last is never pinned */
+    unsigned int current;                 /** buffer of the image being sent */
+    int hdr_size;                         /** header size of the image being sent */
+    int count;                            /** fragments of the image being sent */
+    std::vector<int> lengths;             /** payload size of each fragment */
+    struct timespec cpu_begin;            /** CPU time when the image was started */
+    std::vector<struct iovec> iovs;       /** fragments of a batched send */
+    std::vector<struct mmsghdr> msgs;     /** datagrams of a batched send */
+    std::vector<cached_image_st> cache;   /** images sent lately, empty if not kept */
+    unsigned int cache_next;              /** cache slot of the next image */
+    int cache_msec;                       /** how long images are kept */
+    int budget_percent;                   /** retransmits per bytes sent, in percent */
+    long budget;                          /** bytes that may be resent right now */
+    uint32_t next_id;                     /** zerocopy ID of the next send */
+    unsigned long images;                 /** images sent since the last report */
+    unsigned long frags;                  /** fragments sent since the last report */
+    unsigned long parity_frags;           /** parity fragments among them */
+    unsigned long calls;                  /** send syscalls since the last report */
+    unsigned long usec;                   /** CPU time spent sending since the last report */
+    unsigned long copied;                 /** zerocopy sends the kernel copied anyway */
+    unsigned long busy;                   /** images that found no free pinned buffer */
+    unsigned long resent;                 /** fragments resent */
+    unsigned long denied;                 /** fragments over the retransmit budget */
+    unsigned long expired;                /** fragments asked for too late */
+
+    /** open the own socket of the segmenting modes */
+    bool open_socket (const int port);
+
+    /** pick a buffer for an image, returns where the fragments go */
+    char* prepare (const int frags, const int header);
+
+    /** XOR a stripe of data fragments into a parity fragment, returns its size */
+    int encode_parity (const int data_frags, const int index);
+
+    /** send the image prepared */
+    void transmit (void);
+
+    /** keep a copy of the image sent for retransmits */
+    void store (const uint32_t frame_id, const int tile_id);
+
+    /** send fragments with sendmmsg, or one by one */
+    void transmit_batched (const char *data, const std::vector<int> &sizes,
+                           const int header, const int first, const int end);
+
+    /** send fragments with segmentation offload, returns the first one not sent */
+    int transmit_segmented (const char *data);
+
+    /** collect the zerocopy completions, waiting for one if asked to */
+    void reap (const bool wait);
+};
+
+/**
+ * Tile index of a frame for the retransmit cache
+ */
+inline int
+cached_tile_id (const message_frame_st *)
+{
+    return nack_whole_frame;
+}
+
+/**
+ * Tile index of a tile for the retransmit cache
+ */
+inline int
+cached_tile_id (const message_tile_st *msg)
+{
+    return ntohs(msg->tile_id);
+}
+
+/**
+ * Encrypt and send data in fragments, msg is the header of each fragment
+ *
+ * The data is sent in chunks that fit the path MTU to avoid IP level
+ * fragmentation, as well as to minimize lost information when there is a
+ * packet loss. A fragment the kernel refuses is lost, just like one lost on
+ * the way. The key is applied over the whole image, so the client can
+ * decrypt it in one go, whatever the fragment size. Parity is computed over
+ * the encrypted fragments, the client recovers them before decrypting.
+ */
+template <typename T>
+void
+FragmentSender::send (T *msg, char *payload, const std::vector<unsigned char> &buf)
+{
+    /* an empty image still takes a fragment */
+    int header = payload - reinterpret_cast<char*>(msg);
+    int size = buf.size();
+    int frags = std::max(1, (size + frag_size - 1) / frag_size);
+    int parity = code.get_parity_count(frags);
+    char *packet = prepare(frags + parity, header);
+
+    for (int frag = 0; frag < frags; frag++) {
+        int offset = frag * frag_size;
+        int length = std::min(frag_size, size - offset);
+        msg->frag_size = htons(length);
+        msg->frag_seq = htons(frag + 1);
+        memcpy(packet, msg, header);
+        for (int i = 0, k = offset % key_size; i < length; i++) {
+            packet[header + i] = buf[offset + i] ^ key[k];
+            k = (k + 1 < key_size) ? k + 1 : 0;
+        }
+        lengths[frag] = length;
+        packet += header + frag_size;
+    }
+
+    for (int index = 0; index < parity; index++) {
+        msg->frag_size = htons(encode_parity(frags, index));
+        msg->frag_seq = htons(frags + index + 1);
+        memcpy(packet, msg, header);
+        packet += header + frag_size;
+    }
+
+    transmit();
+    if (!cache.empty()) {
+        store(ntohl(msg->frame_id), cached_tile_id(msg));
+    }
+}
+
+} /* namespace sentry */
+
+#endif /* SENDER_H_ */
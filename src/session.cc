@@ -0,0 +1,234 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * session.cc
+ *
+ * Netcom session table implementation
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <sched.h>
+
+#include "session.h"
+#include "framework.h"
+
+namespace sentry {
+
+/**
+ * Session table constructor
+ *
+ * The capacity is rounded up to a power of two, 256 if not given.
+ */
+SessionTable::SessionTable (const int capacity)
+        : capacity(1), shift(0), high(0), count(0), hint(0), epoch(0)
+{
+    unsigned int wanted = (capacity > 0) ? capacity : 256;
+    while (this->capacity < wanted) {
+        this->capacity <<= 1;
+        shift++;
+    }
+
+    slots = new std::atomic<session_st*>[this->capacity];
+    generations = new uint32_t[this->capacity];
+    for (unsigned int i = 0; i < this->capacity; i++) {
+        slots[i].store(NULL);
+        generations[i] = 0;
+    }
+    readers[0].store(0);
+    readers[1].store(0);
+    pthread_mutex_init(&mutex, NULL);
+
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_NETCOM,
+         "session table of " << this->capacity << " slots");
+}
+
+/**
+ * Session table destructor
+ *
+ * Nobody may read the table anymore, the remaining sessions are freed.
+ */
+SessionTable::~SessionTable (void)
+{
+    for (unsigned int i = 0; i < capacity; i++) {
+        delete slots[i].load();
+    }
+    delete [] slots;
+    delete [] generations;
+    pthread_mutex_destroy(&mutex);
+}
+
+/**
+ * Enter a read-side critical section, returns the reader index
+ *
+ * The index must be passed to read_unlock(). Critical sections may nest, but
+ * must be short, since removals wait for them.
+ */
+int
+SessionTable::read_lock (void)
+{
+    int idx = epoch.load() & 1;
+    readers[idx].fetch_add(1);
+    return idx;
+}
+
+/**
+ * Leave the read-side critical section
+ */
+void
+SessionTable::read_unlock (const int idx)
+{
+    readers[idx].fetch_sub(1);
+}
+
+/**
+ * Session with the given ID, NULL if none
+ *
+ * Must be called within a read lock, the session may be used until the read
+ * lock is released.
+ */
+session_st*
+SessionTable::lookup (const uint32_t id) const
+{
+    session_st *session = slots[id & (capacity - 1)].load(std::memory_order_acquire);
+    if ((NULL == session) || (session->id != id)) {
+        return NULL;
+    }
+    return session;
+}
+
+/**
+ * Next session from the given slot on, NULL at the end
+ *
+ * Must be called within a read lock. Start with slot 0, the slot is advanced
+ * past the session returned. Sessions added or removed meanwhile may or may
+ * not be seen.
+ */
+session_st*
+SessionTable::next (unsigned int &slot) const
+{
+    unsigned int end = high.load(std::memory_order_acquire);
+    while (slot < end) {
+        session_st *session = slots[slot++].load(std::memory_order_acquire);
+        if (NULL != session) {
+            return session;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Add a session and assign its ID, returns 0 if the table is full
+ */
+uint32_t
+SessionTable::insert (session_st *session)
+{
+    pthread_mutex_lock(&mutex);
+    if (count.load() == capacity) {
+        pthread_mutex_unlock(&mutex);
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_NETCOM,
+             "session table is full");
+        return 0;
+    }
+
+    /* freed slots are reused round robin, so an ID comes back as late as possible */
+    unsigned int slot = hint;
+    while (NULL != slots[slot].load(std::memory_order_relaxed)) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    hint = (slot + 1) & (capacity - 1);
+
+    /* the ID is never 0 */
+    uint32_t id;
+    do {
+        id = (++generations[slot] << shift) | slot;
+    } while (0 == id);
+    session->id = id;
+    slots[slot].store(session, std::memory_order_release);
+    if (slot >= high.load()) {
+        high.store(slot + 1, std::memory_order_release);
+    }
+    count++;
+    pthread_mutex_unlock(&mutex);
+
+    return id;
+}
+
+/**
+ * Remove a session, and free it after the grace period
+ *
+ * Blocks until every reader that may have found the session is gone, thus
+ * it must not be called within a read lock.
+ */
+bool
+SessionTable::remove (const uint32_t id)
+{
+    pthread_mutex_lock(&mutex);
+    unsigned int slot = id & (capacity - 1);
+    session_st *session = slots[slot].load(std::memory_order_relaxed);
+    if ((NULL == session) || (session->id != id)) {
+        pthread_mutex_unlock(&mutex);
+        return false;
+    }
+    slots[slot].store(NULL);
+    count--;
+
+    /* shrink the range broadcasts walk through */
+    if (slot + 1 == high.load()) {
+        unsigned int end = slot;
+        while ((end > 0) && (NULL == slots[end - 1].load(std::memory_order_relaxed))) {
+            end--;
+        }
+        high.store(end);
+    }
+
+    synchronize();
+    pthread_mutex_unlock(&mutex);
+
+    delete session;
+    return true;
+}
+
+/**
+ * Number of sessions
+ */
+unsigned int
+SessionTable::get_count (void) const
+{
+    return count.load();
+}
+
+/**
+ * Wait until no reader may see a removed session
+ *
+ * Must be called with the table locked. A reader may read the epoch before
+ * the flip and count itself in the old half afterwards, so a single flip
+ * would miss it: the first flip waits for the readers of the old half, the
+ * second one for those who came in late on the other half.
+ */
+void
+SessionTable::synchronize (void)
+{
+    for (int i = 0; i < 2; i++) {
+        int idx = epoch.fetch_add(1) & 1;
+        while (0 != readers[idx].load()) {
+            sched_yield();
+        }
+    }
+}
+
+} /* namespace sentry */
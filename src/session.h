@@ -0,0 +1,131 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * session.h
+ *
+ * Netcom session table class declaration
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <string>
+#include <openssl/ssl.h>
+
+#include "message.h"
+
+namespace sentry {
+
+class Worker;
+
+/**
+ * Netcom client session
+ *
+ * The control channel fields belong to the netcom server thread, the uplink
+ * worker belongs to the engine. The uplink fields are filled in by the netcom
+ * server before it announces the client, and only read after that.
+ */
+typedef struct session {
+    uint32_t id;                       /** session ID, assigned by the table */
+    std::string name;                  /** client name */
+    int sd;                            /** control socket, -1 once closed */
+    SSL *ssl;                          /** SSL context of the control socket */
+    unsigned char otp[otp_size];       /** password used during connection init */
+    int uplink_sd;                     /** uplink datagram socket, -1 until connected */
+    struct sockaddr_storage addr;      /** client's uplink address */
+    unsigned char key[key_size];       /** client specific key */
+    int frag_size;                     /** fragment payload size of the uplink */
+    int fec_group;                     /** data fragments per parity group, 0 if none */
+    int fec_parity;                    /** parity fragments per group */
+    Worker *uplink;                    /** uplink worker, NULL until connected */
+} session_st;
+
+/**
+ * SessionTable class
+ *
+ * Every netcom client has a single session, shared by the netcom server, the
+ * engine and the client's uplink. Sessions live in a fixed array of slots,
+ * and the session ID tells the slot, with a generation count in the upper
+ * bits, so the ID of a closed session never finds a later one in the same
+ * slot.
+ *
+ * Readers don't take any lock: they mark themselves in one of two reader
+ * counters with read_lock(), and may use the sessions they find until
+ * read_unlock(). Removing a session clears its slot, then waits for a grace
+ * period before the session is freed: the counters are flipped twice, and
+ * each time the readers that may still see the old slot are waited for, the
+ * same way sleepable RCU does it. Removal is rare and may block, lookups are
+ * wait-free.
+ *
+ * A thread that owns a session for its lifetime (the netcom server until it
+ * announces the client dead, the uplink until the engine deletes it) doesn't
+ * need a read lock to use it.
+ */
+class SessionTable {
+  public:
+    /** session table constructor */
+    SessionTable (const int capacity);
+
+    /** session table destructor */
+    virtual ~SessionTable (void);
+
+    /** enter a read-side critical section, returns the reader index */
+    int read_lock (void);
+
+    /** leave the read-side critical section */
+    void read_unlock (const int idx);
+
+    /** session with the given ID, NULL if none (within a read lock) */
+    session_st* lookup (const uint32_t id) const;
+
+    /** next session from the given slot on, NULL at the end (within a read lock) */
+    session_st* next (unsigned int &slot) const;
+
+    /** add a session and assign its ID, returns 0 if the table is full */
+    uint32_t insert (session_st *session);
+
+    /** remove a session, and free it after the grace period */
+    bool remove (const uint32_t id);
+
+    /** number of sessions */
+    unsigned int get_count (void) const;
+
+  private:
+    std::atomic<session_st*> *slots;      /** sessions by slot */
+    uint32_t *generations;                /** reuse count of each slot */
+    unsigned int capacity;                /** number of slots, power of two */
+    unsigned int shift;                   /** bits of the slot in the ID */
+    std::atomic<unsigned int> high;       /** slots above are all empty */
+    std::atomic<unsigned int> count;      /** number of sessions */
+    unsigned int hint;                    /** where to look for a free slot */
+    pthread_mutex_t mutex;                /** serializes insert and remove */
+    std::atomic<unsigned long> epoch;     /** its lowest bit picks the reader counter */
+    std::atomic<long> readers[2];         /** readers in each half of the epoch */
+
+    /** wait until no reader may see a removed session */
+    void synchronize (void);
+};
+
+} /* namespace sentry */
+
+#endif /* SESSION_H_ */
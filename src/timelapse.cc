@@ -0,0 +1,356 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * timelapse.cc
+ *
+ * Timelapse capture implementation
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <algorithm>
+
+#include "timelapse.h"
+#include "camera.h"
+#include "recorder.h"
+
+namespace sentry {
+
+/** nanoseconds in a second */
+static const long timelapse_nsec_per_sec = 1000000000L;
+
+/**
+ * Milliseconds from since to now
+ */
+static long
+timelapse_elapsed_msec (const struct timespec &since, const struct timespec &now)
+{
+    return (now.tv_sec - since.tv_sec) * 1000 + (now.tv_nsec - since.tv_nsec) / 1000000;
+}
+
+/**
+ * Time msec milliseconds after the given time
+ */
+static struct timespec
+timelapse_add_msec (const struct timespec &time, const long msec)
+{
+    struct timespec result = time;
+    result.tv_sec += msec / 1000;
+    result.tv_nsec += (msec % 1000) * 1000000;
+    result.tv_sec += result.tv_nsec / timelapse_nsec_per_sec;
+    result.tv_nsec %= timelapse_nsec_per_sec;
+    return result;
+}
+
+/**
+ * Milliseconds of CPU time used by the given clock
+ */
+static long
+timelapse_cpu_msec (const clockid_t clock)
+{
+    struct timespec cpu;
+    if (clock_gettime(clock, &cpu) < 0) {
+        return 0;
+    }
+    return cpu.tv_sec * 1000 + cpu.tv_nsec / 1000000;
+}
+
+/**
+ * Timelapse constructor
+ *
+ * The shots are encoded at tier "tier" of the camera, with "quality" instead
+ * of the tier's quality if given.
+ */
+Timelapse::Timelapse (Camera *camera)
+        : camera(camera), shots(0), failures(0), shot_msec(0)
+{
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_TIMELAPSE,
+         "parsing file " << framework::config_file << " for timelapse config");
+    config = new framework::Config("timelapse");
+
+    dir = config->get_string("dir");
+    if (dir.empty()) {
+        dir = "data/timelapse";
+    }
+    variant = camera->get_tier(config->get_int("tier"));
+    int quality = config->get_int("quality");
+    if ((quality > 0) && (quality <= 100)) {
+        variant.quality = quality;
+    }
+    int interval = config->get_int("interval");
+    interval_msec = ((interval > 0) ? interval : 60) * 1000L;
+    settle_msec = std::max(0, config->get_int("settle"));
+    int timeout = config->get_int("timeout");
+    timeout_msec = ((timeout > 0) ? timeout : 5) * 1000L;
+
+    if ((mkdir(dir.c_str(), 0755) < 0) && (EEXIST != errno)) {
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_TIMELAPSE,
+             "unable to create " << dir << ": " << strerror(errno));
+    }
+
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_TIMELAPSE,
+         "timelapse to " << dir << " every " << interval_msec / 1000 << " s, scale 1/" <<
+         variant.scale << " quality " << variant.quality);
+
+    pthread_mutex_init(&mutex, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    running = true;
+    if (pthread_create(&thrd, 0, timelapse_thread, this) != 0) {
+        running = false;
+        dbug(DEBUG_LEVEL_ERROR, DEBUG_TYPE_TIMELAPSE,
+             "unable to start timelapse thread");
+        return;
+    }
+    pthread_setname_np(thrd, "timelapse");
+}
+
+/**
+ * Timelapse destructor
+ *
+ * A shot in progress is finished first, which takes at most "timeout"
+ * seconds.
+ */
+Timelapse::~Timelapse (void)
+{
+    if (running) {
+        pthread_mutex_lock(&mutex);
+        running = false;
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&mutex);
+        pthread_join(thrd, NULL);
+    }
+
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&wake);
+    delete config;
+}
+
+/**
+ * Take a shot and append it to the file of the day
+ *
+ * The camera is reserved only for the shot. A cold camera is released without
+ * lingering, so it's on for the settling time and a single capture; a camera
+ * that was running already, or kept warm after its last client, is left the
+ * way it was.
+ */
+bool
+Timelapse::shoot (void)
+{
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    /* a running camera has settled already */
+    struct timespec after = begin;
+    Frame *frame = camera->get_frame(0);
+    bool warm = (NULL != frame);
+    if (warm) {
+        frame->put();
+    } else {
+        after = timelapse_add_msec(begin, settle_msec);
+    }
+
+    camera->reserve(timelapse_client_id);
+    frame = camera->wait_frame(after, timelapse_add_msec(begin, timeout_msec));
+    bool ok = false;
+    if (NULL != frame) {
+        const frame_encoding_st *encoding = camera->encode(frame, variant);
+        if (NULL != encoding) {
+            ok = append(frame->get_seq(), encoding->cols, encoding->rows, encoding->data);
+        }
+        frame->put();
+    } else {
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_TIMELAPSE,
+             "no frame for timelapse shot in " << timeout_msec / 1000 << " s");
+    }
+    camera->release(timelapse_client_id, warm);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    shot_msec += timelapse_elapsed_msec(begin, end);
+    return ok;
+}
+
+/**
+ * Append an encoded frame to the file of the day
+ *
+ * The file is opened for each shot and synced before it's closed, so a
+ * power cut loses at most the shot being written.
+ */
+bool
+Timelapse::append (const uint32_t seq, const int cols, const int rows,
+                   const std::vector<unsigned char> &data)
+{
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    char stamp[16];
+    struct tm local;
+    localtime_r(&wall.tv_sec, &local);
+    strftime(stamp, sizeof(stamp), "%Y%m%d", &local);
+    std::string path = dir + "/" + stamp + ".tl";
+
+    record_header_st header;
+    header.magic = record_magic;
+    header.seq = seq;
+    header.size = data.size();
+    header.cols = cols;
+    header.rows = rows;
+    header.sec = wall.tv_sec;
+    header.nsec = wall.tv_nsec;
+    header.reserved = 0;
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_TIMELAPSE,
+             "unable to open " << path << ": " << strerror(errno));
+        return false;
+    }
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = const_cast<unsigned char*>(&data[0]);
+    iov[1].iov_len = data.size();
+    ssize_t length = writev(fd, iov, 2);
+    bool ok = (length == (ssize_t)(sizeof(header) + data.size()));
+    if (!ok) {
+        dbug(DEBUG_LEVEL_WARNING, DEBUG_TYPE_TIMELAPSE,
+             "unable to write " << path << ": " <<
+             ((length < 0) ? strerror(errno) : "short write"));
+    }
+    fdatasync(fd);
+    close(fd);
+
+    dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_TIMELAPSE,
+         "frame " << seq << " (" << cols << "x" << rows << ", " << data.size() <<
+         " bytes) appended to " << path);
+    return ok;
+}
+
+/**
+ * Log the camera-on and CPU time per hour
+ *
+ * Everything is scaled to an hour, whatever the report interval is. The CPU
+ * time of the process includes streaming, if clients were connected, the
+ * thread's own is what the timelapse costs by itself.
+ */
+void
+Timelapse::report (const long msec, const long camera_msec, const long cpu_msec,
+                   const long thread_cpu_msec)
+{
+    if (msec <= 0) {
+        return;
+    }
+
+    /* milliseconds over the interval make seconds per hour */
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_TIMELAPSE,
+         shots << " shots (" << failures << " failed, " <<
+         (shots + failures ? shot_msec / (shots + failures) : 0) << " ms each), " <<
+         "per hour: camera on " << camera_msec * 3600.0 / msec << " s (" <<
+         100.0 * camera_msec / msec << "%), cpu " << cpu_msec * 3600.0 / msec <<
+         " s, timelapse cpu " << thread_cpu_msec * 3600.0 / msec << " s");
+
+    shots = 0;
+    failures = 0;
+    shot_msec = 0;
+}
+
+/**
+ * Timelapse thread
+ *
+ * Sleeps until the next shot is due, takes it, and reports every
+ * "report_interval" seconds (an hour by default).
+ */
+void*
+Timelapse::timelapse_thread (void *args)
+{
+    Timelapse *timelapse = reinterpret_cast<Timelapse*>(args);
+    int interval = timelapse->config->get_int("report_interval");
+    long report_msec = ((interval > 0) ? interval : 3600) * 1000L;
+
+    struct timespec next, last_report;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    last_report = next;
+    long last_camera = timelapse->camera->get_on_msec();
+    long last_cpu = timelapse_cpu_msec(CLOCK_PROCESS_CPUTIME_ID);
+    long last_thread_cpu = timelapse_cpu_msec(CLOCK_THREAD_CPUTIME_ID);
+
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_TIMELAPSE,
+         "timelapse thread started");
+
+    while (true) {
+        bool stop = false;
+        pthread_mutex_lock(&timelapse->mutex);
+        while (timelapse->running) {
+            if (ETIMEDOUT == pthread_cond_timedwait(&timelapse->wake, &timelapse->mutex,
+                                                    &next)) {
+                break;
+            }
+        }
+        stop = !timelapse->running;
+        pthread_mutex_unlock(&timelapse->mutex);
+        if (stop) {
+            break;
+        }
+
+        if (timelapse->shoot()) {
+            timelapse->shots++;
+        } else {
+            timelapse->failures++;
+        }
+
+        /* next shot on schedule, skip the ones already missed */
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        next = timelapse_add_msec(next, timelapse->interval_msec);
+        long behind = timelapse_elapsed_msec(next, now);
+        if (behind >= 0) {
+            long missed = behind / timelapse->interval_msec + 1;
+            dbug(DEBUG_LEVEL_VERBOSE, DEBUG_TYPE_TIMELAPSE,
+                 "skipping " << missed << " timelapse shots");
+            next = timelapse_add_msec(next, missed * timelapse->interval_msec);
+        }
+
+        if (timelapse_elapsed_msec(last_report, now) >= report_msec) {
+            long camera_msec = timelapse->camera->get_on_msec();
+            long cpu = timelapse_cpu_msec(CLOCK_PROCESS_CPUTIME_ID);
+            long thread_cpu = timelapse_cpu_msec(CLOCK_THREAD_CPUTIME_ID);
+            timelapse->report(timelapse_elapsed_msec(last_report, now),
+                              camera_msec - last_camera, cpu - last_cpu,
+                              thread_cpu - last_thread_cpu);
+            last_report = now;
+            last_camera = camera_msec;
+            last_cpu = cpu;
+            last_thread_cpu = thread_cpu;
+        }
+    }
+
+    dbug(DEBUG_LEVEL_NORMAL, DEBUG_TYPE_TIMELAPSE,
+         "timelapse thread stopped");
+
+    pthread_exit(NULL);
+}
+
+} /* namespace sentry */
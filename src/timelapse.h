@@ -0,0 +1,105 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * timelapse.h
+ *
+ * Timelapse capture class declaration
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#ifndef TIMELAPSE_H_
+#define TIMELAPSE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "frame.h"
+#include "framework.h"
+
+namespace sentry {
+
+class Camera;
+
+/** camera client ID of the timelapse, session IDs are never 0 */
+static const int timelapse_client_id = 0;
+
+/**
+ * Timelapse class
+ *
+ * Takes a single still every "interval" seconds and appends it to a file per
+ * day under "dir", in the record format of the recorder. Meant for long
+ * unattended periods on battery: between the shots the thread sleeps on a
+ * condition variable until the next one is due, and the camera is closed
+ * right after each shot, unless a client is streaming or the camera is kept
+ * warm for the pre-event ring or the recorder. Shots are scheduled on
+ * absolute times, so they don't drift, and shots missed while the thread
+ * was busy are skipped rather than taken in a burst.
+ *
+ * A freshly opened camera needs "settle" milliseconds to set its exposure,
+ * frames captured before that are not used. If the camera is running
+ * already, the next frame is taken right away.
+ *
+ * The camera-on time and the CPU time of the process (and of the timelapse
+ * thread itself, which does the encoding) are logged per hour every
+ * "report_interval" seconds.
+ */
+class Timelapse {
+  public:
+    /** timelapse constructor */
+    Timelapse (Camera *camera);
+
+    /** timelapse destructor */
+    virtual ~Timelapse (void);
+
+  private:
+    framework::Config *config;            /** timelapse configuration */
+    Camera *camera;                       /** camera to take the shots with */
+    frame_variant_st variant;             /** encoding of the shots */
+    std::string dir;                      /** where the timelapse files go */
+    long interval_msec;                   /** time between shots */
+    long settle_msec;                     /** exposure settling time of a cold camera */
+    long timeout_msec;                    /** give up on a shot after this long */
+    pthread_t thrd;                       /** timelapse thread */
+    bool running;                         /** flag to indicate timelapse thread is running */
+    pthread_mutex_t mutex;                /** mutex to protect the running flag */
+    pthread_cond_t wake;                  /** wakes up the timelapse thread to stop */
+    unsigned long shots;                  /** shots taken since the last report */
+    unsigned long failures;               /** shots failed since the last report */
+    unsigned long shot_msec;              /** time spent on shots since the last report */
+
+    /** take a shot and append it to the file of the day */
+    bool shoot (void);
+
+    /** append an encoded frame to the file of the day */
+    bool append (const uint32_t seq, const int cols, const int rows,
+                 const std::vector<unsigned char> &data);
+
+    /** log the camera-on and CPU time per hour */
+    void report (const long msec, const long camera_msec, const long cpu_msec,
+                 const long thread_cpu_msec);
+
+    /** timelapse thread */
+    static void* timelapse_thread (void *args);
+};
+
+} /* namespace sentry */
+
+#endif /* TIMELAPSE_H_ */
@@ -0,0 +1,179 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * capture-bench.cc
+ *
+ * Capture path allocation check
+ *
+ * Runs the camera on the synthetic device in both capture formats, with two
+ * subscribed tiers and tile tracking, and consumes the frames like an uplink
+ * does: every tier and the first tile of each frame are encoded. After a warm
+ * up, the heap allocation counter of the capture and encode path must not
+ * move anymore. Exits with failure if it does. Args:
+ *   frames     (optional) number of frames to check, 300 if omitted
+ *   warmup     (optional) number of frames to warm up with, 100 if omitted
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+
+#include "camera.h"
+#include "frame.h"
+#include "framework.h"
+
+/** client ID the camera is reserved for */
+const int client_id = 1;
+
+/**
+ * Write a config with a synthetic camera in the given capture format
+ */
+static void
+write_config (const std::string &path, const std::string &format)
+{
+    std::ofstream file(path.c_str());
+    file << "{" << std::endl
+         << "    \"camera\" : {" << std::endl
+         << "        \"device\" : \"synthetic\"," << std::endl
+         << "        \"cols\" : \"640\"," << std::endl
+         << "        \"rows\" : \"480\"," << std::endl
+         << "        \"fps\" : \"200\"," << std::endl
+         << "        \"capture_format\" : \"" << format << "\"," << std::endl
+         << "        \"linger\" : \"0\"," << std::endl
+         << "        \"quality\" : \"85\"," << std::endl
+         << "        \"encoder\" : \"libjpeg\"," << std::endl
+         << "        \"subsampling\" : \"420\"," << std::endl
+         << "        \"fast_dct\" : \"true\"," << std::endl
+         << "        \"tiers\" : \"full:1:85,half:2:70\"," << std::endl
+         << "        \"tile_size\" : \"64\"," << std::endl
+         << "        \"tile_threshold\" : \"25\"," << std::endl
+         << "        \"tile_area\" : \"2\"" << std::endl
+         << "    }," << std::endl
+         << "    \"timelapse\" : {" << std::endl
+         << "        \"enable\" : \"false\"" << std::endl
+         << "    }" << std::endl
+         << "}" << std::endl;
+}
+
+/**
+ * Take the next frame of the camera, NULL if none came within a second
+ */
+static sentry::Frame*
+next_frame (sentry::Camera &camera, struct timespec &after)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec++;
+
+    sentry::Frame *frame = camera.wait_frame(after, deadline);
+    if (NULL != frame) {
+        after = frame->get_time();
+        if (++after.tv_nsec >= 1000000000L) {
+            after.tv_sec++;
+            after.tv_nsec = 0;
+        }
+    }
+    return frame;
+}
+
+/**
+ * Consume frames like an uplink, returns the allocations after the warm up
+ */
+static long
+measure (const std::string &format, const int frames, const int warmup)
+{
+    sentry::Camera camera;
+    for (int tier = 0; tier < camera.get_tier_count(); tier++) {
+        camera.subscribe(camera.get_tier(tier));
+    }
+    camera.reserve(client_id);
+
+    long allocs = -1;
+    struct timespec after = {0, 0};
+    for (int i = 0; i < warmup + frames; i++) {
+        if (warmup == i) {
+            allocs = sentry::frame_alloc_count();
+        }
+        sentry::Frame *frame = next_frame(camera, after);
+        if (NULL == frame) {
+            std::cout << format << ": no frame from the camera" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        for (int tier = 0; tier < camera.get_tier_count(); tier++) {
+            camera.encode(frame, camera.get_tier(tier));
+        }
+        if (camera.get_tile_count(frame) > 0) {
+            camera.encode(frame, camera.get_tier(0), 0);
+        }
+        frame->put();
+    }
+    allocs = sentry::frame_alloc_count() - allocs;
+
+    camera.release(client_id, false);
+    for (int tier = 0; tier < camera.get_tier_count(); tier++) {
+        camera.unsubscribe(camera.get_tier(tier));
+    }
+    return allocs;
+}
+
+/**
+ * Main function
+ */
+int
+main (int argc, char *argv[])
+{
+    static const char *formats[] = {"bgr", "yuv420"};
+
+    if (argc > 3) {
+        std::cout << "usage: " << argv[0] << " [frames] [warmup]" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    int frames = (argc >= 2) ? atoi(argv[1]) : 300;
+    if (frames <= 0) {
+        frames = 300;
+    }
+    int warmup = (argc >= 3) ? atoi(argv[2]) : 100;
+    if (warmup < 0) {
+        warmup = 100;
+    }
+
+    char path[] = "/tmp/capture-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        std::cout << "unable to create a config file" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    framework::config_file = path;
+
+    bool ok = true;
+    for (unsigned int i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        write_config(path, formats[i]);
+        long allocs = measure(formats[i], frames, warmup);
+        std::cout << formats[i] << ": " << allocs << " allocations in " << frames
+                  << " frames after " << warmup << " frames of warm up" << std::endl;
+        ok = ok && (0 == allocs);
+    }
+    unlink(path);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,120 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * config-check.cc
+ *
+ * Config file check
+ *
+ * Reads every section of a config file through framework::Config, the way
+ * the modules do, and checks that each key comes back with the value written
+ * in that section. Config finds a section by the first line that mentions
+ * its name, so a key named after a section that comes later (e.g. a
+ * "timelapse" key in the camera section) hides that section. Exits with
+ * failure if any value doesn't match. Args:
+ *   file       (optional) config file to check, cfg/default.cfg if omitted
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "framework.h"
+
+/** key-value pairs of a section, as written in the file */
+typedef std::vector<std::pair<std::string, std::string> > section_pairs;
+
+/**
+ * Get the quoted words of a line, in order
+ */
+static std::vector<std::string>
+quoted_words (const std::string &line)
+{
+    std::vector<std::string> words;
+    std::string::size_type begin = line.find('"');
+    while (std::string::npos != begin) {
+        std::string::size_type end = line.find('"', begin + 1);
+        if (std::string::npos == end) {
+            break;
+        }
+        words.push_back(line.substr(begin + 1, end - begin - 1));
+        begin = line.find('"', end + 1);
+    }
+    return words;
+}
+
+/**
+ * Main function
+ */
+int
+main (int argc, char *argv[])
+{
+    if (argc > 2) {
+        std::cout << "usage: " << argv[0] << " [file]" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (argc >= 2) {
+        framework::config_file = argv[1];
+    }
+
+    std::ifstream file(framework::config_file.c_str());
+    if (file.fail()) {
+        std::cout << "unable to open " << framework::config_file << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    /* collect the sections and their pairs straight from the file */
+    std::vector<std::pair<std::string, section_pairs> > sections;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::vector<std::string> words = quoted_words(line);
+        if ((1 == words.size()) && (std::string::npos != line.find('{'))) {
+            sections.push_back(std::make_pair(words[0], section_pairs()));
+        } else if ((2 == words.size()) && !sections.empty()) {
+            sections.back().second.push_back(std::make_pair(words[0], words[1]));
+        }
+    }
+    file.close();
+
+    /* and check that Config reads the same */
+    int errors = 0;
+    for (unsigned int i = 0; i < sections.size(); i++) {
+        const std::string &section = sections[i].first;
+        const section_pairs &pairs = sections[i].second;
+        try {
+            framework::Config config(section.c_str());
+            for (unsigned int j = 0; j < pairs.size(); j++) {
+                std::string value = config.get_string(pairs[j].first);
+                if (value != pairs[j].second) {
+                    std::cout << section << ": " << pairs[j].first << " reads \"" << value
+                              << "\" instead of \"" << pairs[j].second << "\"" << std::endl;
+                    errors++;
+                }
+            }
+        } catch (const return_code_en &rc) {
+            std::cout << section << ": unable to read the section" << std::endl;
+            errors++;
+        }
+        std::cout << section << ": " << pairs.size() << " keys" << std::endl;
+    }
+
+    std::cout << sections.size() << " sections, " << errors << " errors" << std::endl;
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
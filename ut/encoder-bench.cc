@@ -0,0 +1,259 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * encoder-bench.cc
+ *
+ * JPEG encoder benchmark
+ *
+ * Compares the encode latency of a single thread with the strip encoder's
+ * thread pool at the usual camera resolutions. Args:
+ *   threads    (optional) size of the thread pool, one per core if omitted
+ *   count      (optional) number of frames to encode per resolution, 100 if omitted
+ *   prefix     (optional) save the last multi-threaded encode of each resolution
+ *              as <prefix>-<cols>x<rows>.jpg, e.g. to check it with a decoder
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <time.h>
+#include <vector>
+
+#include "encoder.h"
+
+/** JPEG quality used for the measurements */
+const int quality = 85;
+
+/**
+ * Fill the image with something camera-like: gradients, edges and noise
+ */
+static void
+fill_image (std::vector<unsigned char> &image, const int cols, const int rows)
+{
+    image.resize(cols * rows * 3);
+    srand(1);
+    for (int y = 0; y < rows; y++) {
+        for (int x = 0; x < cols; x++) {
+            unsigned char *p = &image[(y * cols + x) * 3];
+            int noise = rand() % 16;
+            bool box = ((x / 64) + (y / 64)) % 2;
+            p[0] = (x * 255 / cols + noise) & 0xff;
+            p[1] = (y * 255 / rows + noise) & 0xff;
+            p[2] = box ? 200 + noise : 40 + noise;
+        }
+    }
+}
+
+/**
+ * Clamp to a byte
+ */
+static inline unsigned char
+clamp (const int value)
+{
+    return (value < 0) ? 0 : ((value > 255) ? 255 : value);
+}
+
+/**
+ * Convert a BGR image to I420, the way the sensor delivers it
+ */
+static void
+bgr_to_i420 (const std::vector<unsigned char> &bgr, std::vector<unsigned char> &yuv,
+             const int cols, const int rows)
+{
+    yuv.resize(cols * rows * 3 / 2);
+    unsigned char *u = &yuv[cols * rows];
+    unsigned char *v = u + (cols / 2) * (rows / 2);
+    for (int y = 0; y < rows; y++) {
+        for (int x = 0; x < cols; x++) {
+            const unsigned char *p = &bgr[(y * cols + x) * 3];
+            yuv[y * cols + x] = clamp((29 * p[0] + 150 * p[1] + 77 * p[2] + 128) >> 8);
+            if ((0 == y % 2) && (0 == x % 2)) {
+                int i = (y / 2) * (cols / 2) + x / 2;
+                u[i] = clamp(((128 * p[0] - 85 * p[1] - 43 * p[2] + 128) >> 8) + 128);
+                v[i] = clamp(((-21 * p[0] - 107 * p[1] + 128 * p[2] + 128) >> 8) + 128);
+            }
+        }
+    }
+}
+
+/**
+ * Convert an I420 image to BGR, the way the camera library does for BGR capture
+ */
+static void
+i420_to_bgr (const std::vector<unsigned char> &yuv, std::vector<unsigned char> &bgr,
+             const int cols, const int rows)
+{
+    const unsigned char *u = &yuv[cols * rows];
+    const unsigned char *v = u + (cols / 2) * (rows / 2);
+    bgr.resize(cols * rows * 3);
+    for (int y = 0; y < rows; y++) {
+        for (int x = 0; x < cols; x++) {
+            int i = (y / 2) * (cols / 2) + x / 2;
+            int l = yuv[y * cols + x] << 8;
+            int cb = u[i] - 128;
+            int cr = v[i] - 128;
+            unsigned char *p = &bgr[(y * cols + x) * 3];
+            p[0] = clamp((l + 454 * cb + 128) >> 8);
+            p[1] = clamp((l - 88 * cb - 183 * cr + 128) >> 8);
+            p[2] = clamp((l + 359 * cr + 128) >> 8);
+        }
+    }
+}
+
+/**
+ * Encode a BGR image, or an I420 image if yuv is set
+ */
+static void
+encode (sentry::JpegEncoder &encoder, const std::vector<unsigned char> &image,
+        const bool yuv, const int cols, const int rows, std::vector<unsigned char> &out)
+{
+    bool ok;
+
+    if (yuv) {
+        const unsigned char *planes[3] = {&image[0], &image[cols * rows],
+                                          &image[cols * rows + (cols / 2) * (rows / 2)]};
+        const int steps[3] = {cols, cols / 2, cols / 2};
+        ok = encoder.encode_yuv(planes, steps, cols, rows, quality, out);
+    } else {
+        ok = encoder.encode(&image[0], cols, rows, cols * 3, 3, quality, out);
+    }
+    if (!ok) {
+        std::cout << "encoding failed" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Milliseconds since start
+ */
+static double
+elapsed (const struct timespec &start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) * 1000.0 +
+           (end.tv_nsec - start.tv_nsec) / 1000000.0;
+}
+
+/**
+ * Average encode time of count frames in milliseconds
+ */
+static double
+measure (sentry::JpegEncoder &encoder, const std::vector<unsigned char> &image,
+         const bool yuv, const int cols, const int rows, const int count,
+         std::vector<unsigned char> &out)
+{
+    struct timespec start;
+
+    /* warm up, the first encode sizes the buffers */
+    encode(encoder, image, yuv, cols, rows, out);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < count; i++) {
+        encode(encoder, image, yuv, cols, rows, out);
+    }
+    return elapsed(start) / count;
+}
+
+/**
+ * Average I420 to BGR conversion time of count frames in milliseconds
+ */
+static double
+measure_conversion (const std::vector<unsigned char> &yuv, const int cols,
+                    const int rows, const int count, std::vector<unsigned char> &bgr)
+{
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < count; i++) {
+        i420_to_bgr(yuv, bgr, cols, rows);
+    }
+    return elapsed(start) / count;
+}
+
+/**
+ * Main function
+ */
+int
+main (int argc, char *argv[])
+{
+    static const int resolutions[][2] = {{640, 480}, {1280, 720}, {1920, 1080}};
+
+    if (argc > 4) {
+        std::cout << "usage: " << argv[0] << " [threads] [count] [prefix]" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    int threads = (argc >= 2) ? atoi(argv[1]) : 0;
+    int count = (argc >= 3) ? atoi(argv[2]) : 100;
+    if (count <= 0) {
+        count = 100;
+    }
+
+    sentry::encoder_options_st options;
+    options.subsampling = 420;
+    options.fast_dct = false;
+    options.optimize = false;
+    sentry::JpegEncoder single(1, options);
+    sentry::JpegEncoder multi(threads, options);
+    std::vector<unsigned char> image;
+    std::vector<unsigned char> yuv;
+    std::vector<unsigned char> bgr;
+    std::vector<unsigned char> out;
+
+    std::cout << "quality " << quality << ", " << count << " frames, "
+              << multi.get_threads() << " threads" << std::endl;
+    for (unsigned int i = 0; i < sizeof(resolutions) / sizeof(resolutions[0]); i++) {
+        int cols = resolutions[i][0];
+        int rows = resolutions[i][1];
+        fill_image(image, cols, rows);
+
+        double single_ms = measure(single, image, false, cols, rows, count, out);
+        size_t single_size = out.size();
+        double multi_ms = measure(multi, image, false, cols, rows, count, out);
+
+        std::cout << cols << "x" << rows << ": 1 thread " << single_ms << " ms ("
+                  << single_size << " bytes), " << multi.get_threads() << " threads "
+                  << multi_ms << " ms (" << out.size() << " bytes), speedup "
+                  << single_ms / multi_ms << std::endl;
+
+        /*
+         * BGR capture converts the sensor's I420 to BGR, then the encoder
+         * converts it back to YCbCr; I420 capture does neither
+         */
+        bgr_to_i420(image, yuv, cols, rows);
+        double convert_ms = measure_conversion(yuv, cols, rows, count, bgr);
+        double bgr_ms = measure(multi, bgr, false, cols, rows, count, out);
+        double yuv_ms = measure(multi, yuv, true, cols, rows, count, out);
+        std::cout << "  color conversion per frame: BGR capture " << convert_ms
+                  << " ms to BGR + " << bgr_ms - yuv_ms << " ms in the encoder, "
+                  << "I420 capture 0 ms; encode " << bgr_ms << " ms from BGR, "
+                  << yuv_ms << " ms from I420 (" << out.size() << " bytes)"
+                  << std::endl;
+
+        if (argc >= 4) {
+            std::stringstream name;
+            name << argv[3] << "-" << cols << "x" << rows << ".jpg";
+            std::ofstream file(name.str().c_str(), std::ios::binary);
+            file.write(reinterpret_cast<const char*>(&out[0]), out.size());
+        }
+    }
+
+    return 0;
+}
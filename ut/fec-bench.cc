@@ -0,0 +1,228 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * fec-bench.cc
+ *
+ * Uplink parity and retransmit benchmark
+ *
+ * Sends a synthetic image over loopback through an uplink sender, with and
+ * without parity fragments, and drops the fragments received at random, at
+ * 1%, 5% and 10% loss. The fragments left are put back together the way the
+ * client does it, and with NACKs, the missing ones are asked for once from
+ * the sender's retransmit cache (200 ms, 20% budget), the retransmits lost
+ * at the same rate. Each image completed is checked against the original.
+ * Prints the share of images delivered complete, and the fragments recovered
+ * and sent extra for it. Args:
+ *   images     (optional) images sent per measurement, 2000 if omitted
+ *   size       (optional) image size in KB, 40 if omitted
+ *   frag       (optional) fragment payload size, 1400 if omitted
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <iostream>
+#include <cstdlib>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <vector>
+
+#include "sender.h"
+#include "fec.h"
+
+/** a parity code to measure */
+typedef struct bench_code {
+    const char *name;   /** name printed */
+    int group;          /** data fragments per group */
+    int parity;         /** parity fragments per group */
+    bool nack;          /** missing fragments asked for again */
+} bench_code_st;
+
+/** codes measured, no parity first */
+static const bench_code_st codes[] = {
+    { "no parity",      0, 1, false },
+    { "1 per 8",        8, 1, false },
+    { "1 per 4",        4, 1, false },
+    { "2 per 8",        8, 2, false },
+    { "nack",           0, 1, true  },
+    { "1 per 8 + nack", 8, 1, true  },
+};
+
+/** loss simulated, in percent */
+static const int losses[] = { 1, 5, 10 };
+
+/** the image sent */
+static std::vector<unsigned char> image;
+
+/** fragment payload size */
+static int frag_size = 1400;
+
+/**
+ * Receive the fragments queued, dropping some, returns the number received
+ */
+static unsigned long
+receive (const int sd, message_frame_st *rcv, sentry::FragmentAssembler &assembler,
+         const int loss, unsigned long &dropped)
+{
+    unsigned long received = 0;
+    while (recv(sd, rcv, sizeof(*rcv), MSG_DONTWAIT) > 0) {
+        received++;
+        if (rand() % 10000 < loss * 100) {
+            dropped++;
+            continue;
+        }
+        assembler.add(ntohs(rcv->frag_seq), rcv->frame, ntohs(rcv->frag_size));
+    }
+    return received;
+}
+
+/**
+ * Send the given number of images with the given code, dropping fragments
+ */
+static void
+measure (const bench_code_st &code, const int loss, const int count)
+{
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(server);
+    int server_sd = socket(AF_INET, SOCK_DGRAM, 0);
+    bind(server_sd, (struct sockaddr*)&server, sizeof(server));
+    getsockname(server_sd, (struct sockaddr*)&server, &length);
+
+    struct sockaddr_in local = server;
+    local.sin_port = 0;
+    length = sizeof(local);
+    int sd = socket(AF_INET, SOCK_DGRAM, 0);
+    int rcvbuf = 4 * 1024 * 1024;
+    setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    bind(sd, (struct sockaddr*)&local, sizeof(local));
+    getsockname(sd, (struct sockaddr*)&local, &length);
+    struct sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
+    memcpy(&addr, &local, sizeof(local));
+
+    unsigned char key[key_size];
+    for (int k = 0; k < key_size; k++) {
+        key[k] = rand();
+    }
+    sentry::ParityCode parity_code(code.group, code.parity);
+    sentry::FragmentSender sender("bench", server_sd, addr, key, frag_size,
+                                  sentry::TRANSMIT_MODE_BATCH, 64,
+                                  ntohs(server.sin_port), parity_code);
+    if (code.nack) {
+        sender.set_cache(200, 20);
+    }
+
+    message_frame_st *msg = new message_frame_st;
+    message_frame_st *rcv = new message_frame_st;
+    sentry::FragmentAssembler assembler;
+    unsigned long delivered = 0;
+    unsigned long corrupt = 0;
+    unsigned long sent = 0;
+    unsigned long dropped = 0;
+    unsigned long recovered = 0;
+    unsigned long resent = 0;
+    std::vector<std::pair<int, int> > gaps;
+    for (int seq = 1; seq <= count; seq++) {
+        msg->type = htonl(MESSAGE_CAMERA_FRAME);
+        msg->frame_id = htonl(seq);
+        msg->frame_size = htonl(image.size());
+        msg->cols = htons(640);
+        msg->rows = htons(480);
+        sender.send(msg, msg->frame, image);
+
+        /* loopback queues the datagrams right away */
+        assembler.start(image.size(), frag_size, parity_code);
+        sent += receive(sd, rcv, assembler, loss, dropped);
+        if (code.nack && !assembler.is_complete()) {
+            assembler.get_gaps(gaps);
+            for (unsigned int i = 0; i < gaps.size(); i++) {
+                sender.resend(seq, nack_whole_frame, gaps[i].first, gaps[i].second);
+            }
+            resent += receive(sd, rcv, assembler, loss, dropped);
+        }
+        recovered += assembler.get_recovered();
+        if (!assembler.is_complete()) {
+            continue;
+        }
+
+        const char *data = assembler.get_data();
+        bool intact = true;
+        for (unsigned int i = 0; intact && (i < image.size()); i++) {
+            intact = ((unsigned char)(data[i] ^ key[i % key_size]) == image[i]);
+        }
+        delivered += intact ? 1 : 0;
+        corrupt += intact ? 0 : 1;
+    }
+    delete msg;
+    delete rcv;
+    close(sd);
+    close(server_sd);
+
+    int frags = (image.size() + frag_size - 1) / frag_size;
+    std::cout << code.name << ", " << loss << "% loss: " << delivered * 100.0 / count
+              << "% images delivered, " << (double)recovered / count
+              << " fragments recovered per image, "
+              << parity_code.get_parity_count(frags) * 100.0 / frags << "% parity, "
+              << resent * 100.0 / count / frags << "% resent ("
+              << (sent ? dropped * 100.0 / (sent + resent) : 0) << "% dropped";
+    if (0 != corrupt) {
+        std::cout << ", " << corrupt << " images CORRUPT";
+    }
+    std::cout << ")" << std::endl;
+}
+
+/**
+ * Main
+ */
+int
+main (int argc, char *argv[])
+{
+    if (argc > 4) {
+        std::cout << "usage: " << argv[0] << " [images] [size] [frag]" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    int count = (argc >= 2) ? atoi(argv[1]) : 2000;
+    if (count <= 0) {
+        count = 2000;
+    }
+    int size = (argc >= 3) ? atoi(argv[2]) : 40;
+    if (size <= 0) {
+        size = 40;
+    }
+    if ((argc >= 4) && (atoi(argv[3]) > 0)) {
+        frag_size = std::min(atoi(argv[3]), max_frag_size);
+    }
+
+    srand(1);
+    image.resize(size * 1024);
+    for (unsigned int i = 0; i < image.size(); i++) {
+        image[i] = rand();
+    }
+
+    std::cout << image.size() << " byte images in "
+              << (image.size() + frag_size - 1) / frag_size << " fragments of "
+              << frag_size << " bytes" << std::endl;
+    for (unsigned int l = 0; l < sizeof(losses) / sizeof(losses[0]); l++) {
+        for (unsigned int c = 0; c < sizeof(codes) / sizeof(codes[0]); c++) {
+            measure(codes[c], losses[l], count);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
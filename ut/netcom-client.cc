@@ -9,6 +9,10 @@
  *   hostname   IP address of the server
  *   portnum    server port for the control messages (stream uses portnum++)
  *   cid        camera ID, pick a unique number per client
+ *   fps        (optional) requested stream frame rate, server default if omitted
+ *   tier       (optional) requested encoding tier, 0 (the first tier) if omitted
+ *   mode       (optional) "tiles" to receive only the changed tiles between
+ *              keyframes, whole frames if omitted
  *
  * Connection with the server is done with 2 sockets:
  *   - control socket is used to send and receive
@@ -48,6 +52,7 @@
  */
 #include <iostream>
 #include <netdb.h>
+#include <netinet/in.h>
 #include <termios.h>
 #include <unistd.h>
 #include <signal.h>
@@ -57,9 +62,15 @@
 #include <openssl/err.h>
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
+#include <algorithm>
 #include <ctime>
+#include <deque>
+#include <map>
+#include <utility>
+#include <vector>
 
 #include "message.h"
+#include "fec.h"
 
 /** hardcoded configuration */
 const char *certfile = "../cfg/client/ca1_cert.pem";
@@ -75,10 +86,62 @@ int data_socket = -1;
 std::stringstream cam_window_name;
 
 /** secret key and client credentials from server */
-char key[max_buf_size];
-char otp[max_buf_size];
+char key[key_size];
+char otp[otp_size];
 int client_id = 0;
 
+/** fragment payload size, the largest the server supports at first, then negotiated */
+int frag_size = default_frag_size;
+
+/** parity fragments the server adds to each image, none unless it says so */
+sentry::ParityCode parity_code;
+
+/** largest frame or tile taken */
+const int max_image_size = 262140;
+
+/** requested stream frame rate, 0 means server default */
+int stream_fps = 0;
+
+/** requested encoding tier */
+int stream_tier = 0;
+
+/** requested stream mode */
+int stream_mode = STREAM_MODE_FRAMES;
+
+/** size of the whole frame, learnt from the frames received while not zoomed */
+int full_cols = 640;
+int full_rows = 480;
+
+/** zoomed into the middle of the picture */
+bool zoomed = false;
+
+/** subscribed to detection events */
+bool detecting = false;
+
+/** capture mode asked for last, high definition or VGA */
+bool high_definition = false;
+
+/** picture of tile streams, the tiles are drawn on the last keyframe */
+cv::Mat canvas;
+
+/** serializes the writes on the control channel, SSL doesn't */
+pthread_mutex_t control_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Write a message to the control channel
+ *
+ * The main, heartbeat and receive threads all send on the same connection,
+ * and OpenSSL can't take concurrent writes on it.
+ */
+static int
+write_control (const void *msg, const int length)
+{
+    pthread_mutex_lock(&control_mutex);
+    int written = SSL_write(ssl, msg, length);
+    pthread_mutex_unlock(&control_mutex);
+    return written;
+}
+
 /**
  * Send move command
  */
@@ -90,7 +153,7 @@ send_move_command (int direction)
 
     msg->type = htonl(MESSAGE_MOVE);
     msg->direction = htonl(direction);
-    length = SSL_write(ssl, msg, sizeof(*msg));
+    length = write_control(msg, sizeof(*msg));
 
     if (length <= 0) {
         return false;
@@ -108,7 +171,149 @@ send_command (int type)
     int length;
 
     msg->type = htonl(type);
-    length = SSL_write(ssl, msg, sizeof(*msg));
+    length = write_control(msg, sizeof(*msg));
+
+    if (length <= 0) {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Send camera stream request
+ */
+static bool
+send_camera_request (void)
+{
+    message_camera_st *msg = new message_camera_st;
+    int length;
+
+    memset(msg, 0, sizeof(*msg));
+    msg->type = htonl(MESSAGE_CAMERA_REQUEST);
+    msg->fps = htons(stream_fps);
+    msg->tier = htons(stream_tier);
+    msg->mode = htons(stream_mode);
+    length = write_control(msg, sizeof(*msg));
+    delete msg;
+
+    if (length <= 0) {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Send snapshot request, the still arrives as a camera frame
+ */
+static bool
+send_snapshot_request (void)
+{
+    message_snapshot_st *msg = new message_snapshot_st;
+    int length;
+
+    memset(msg, 0, sizeof(*msg));
+    msg->type = htonl(MESSAGE_SNAPSHOT_REQUEST);
+    msg->tier = htons(stream_tier);
+    length = write_control(msg, sizeof(*msg));
+    delete msg;
+
+    if (length <= 0) {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Send region of interest request, zooming into the middle of the picture
+ *
+ * The middle half of the frame is asked for at the size of the whole frame,
+ * or the whole frame again when already zoomed. The size of the whole frame
+ * comes from the frames received, so it is only right for full resolution
+ * tiers.
+ */
+static bool
+send_roi_request (const bool zoom)
+{
+    message_roi_st *msg = new message_roi_st;
+    int length;
+
+    memset(msg, 0, sizeof(*msg));
+    msg->type = htonl(MESSAGE_CAMERA_ROI);
+    if (zoom) {
+        msg->x = htons(full_cols / 4);
+        msg->y = htons(full_rows / 4);
+        msg->cols = htons(full_cols / 2);
+        msg->rows = htons(full_rows / 2);
+        msg->out_cols = htons(full_cols);
+        msg->out_rows = htons(full_rows);
+    }
+    length = write_control(msg, sizeof(*msg));
+    delete msg;
+
+    if (length <= 0) {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Send capture mode change request, 1280x720 or 640x480 at the current fps
+ */
+static bool
+send_mode_request (const bool hd)
+{
+    message_mode_st *msg = new message_mode_st;
+    int length;
+
+    memset(msg, 0, sizeof(*msg));
+    msg->type = htonl(MESSAGE_CAMERA_MODE);
+    msg->cols = htons(hd ? 1280 : 640);
+    msg->rows = htons(hd ? 720 : 480);
+    length = write_control(msg, sizeof(*msg));
+    delete msg;
+
+    if (length <= 0) {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Send pre-event ring dump request, the whole ring goes to the target
+ */
+static bool
+send_ring_dump (const ring_target_en target)
+{
+    message_ring_st *msg = new message_ring_st;
+    int length;
+
+    memset(msg, 0, sizeof(*msg));
+    msg->type = htonl(MESSAGE_RING_DUMP);
+    msg->target = htons(target);
+    msg->seconds = htons(0);
+    length = write_control(msg, sizeof(*msg));
+    delete msg;
+
+    if (length <= 0) {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Send detection event subscription request
+ */
+static bool
+send_detection_subscribe (const bool enable)
+{
+    message_subscribe_st *msg = new message_subscribe_st;
+    int length;
+
+    memset(msg, 0, sizeof(*msg));
+    msg->type = htonl(MESSAGE_DETECTION_SUBSCRIBE);
+    msg->enable = htons(enable ? 1 : 0);
+    length = write_control(msg, sizeof(*msg));
+    delete msg;
 
     if (length <= 0) {
         return false;
@@ -116,6 +321,31 @@ send_command (int type)
     return true;
 }
 
+/**
+ * Decode detection event
+ */
+static void
+decode_detection (const message_detection_st *detection_msg, const int length)
+{
+    int count = ntohs(detection_msg->count);
+    int max_count = (length - (int)(sizeof(*detection_msg) - sizeof(detection_msg->boxes))) /
+                    (int)sizeof(message_box_st);
+    if (count > max_count) {
+        count = max_count;
+    }
+
+    std::cout << time(NULL) << ": " << count << " people in frame "
+              << ntohl(detection_msg->frame_id) << " (" << ntohs(detection_msg->cols)
+              << "x" << ntohs(detection_msg->rows) << "), "
+              << ntohs(detection_msg->latency) << " ms after capture" << std::endl;
+    for (int i = 0; i < count; i++) {
+        const message_box_st &box = detection_msg->boxes[i];
+        std::cout << "  " << ntohs(box.cols) << "x" << ntohs(box.rows) << "+"
+                  << ntohs(box.x) << "+" << ntohs(box.y) << " score "
+                  << ntohs(box.score) / 100.0 << std::endl;
+    }
+}
+
 /**
  * Decode sensor data
  */
@@ -137,76 +367,352 @@ decode_sensor_data (const message_sensor_st *sensor_msg)
     }
 }
 
+/** receiver statistics since the last report, updated by the receive thread */
+static uint32_t frags_received = 0;
+static uint32_t frags_lost = 0;
+static uint32_t frames_completed = 0;
+
+/**
+ * Send receiver report
+ *
+ * The server uses these numbers to adjust the image quality and resolution to
+ * what our link can handle.
+ */
+static bool
+send_report (void)
+{
+    message_report_st *msg = new message_report_st;
+    int length;
+
+    memset(msg, 0, sizeof(*msg));
+    msg->type = htonl(MESSAGE_CAMERA_REPORT);
+    msg->frags_received = htonl(__sync_lock_test_and_set(&frags_received, 0));
+    msg->frags_lost = htonl(__sync_lock_test_and_set(&frags_lost, 0));
+    msg->frames_completed = htonl(__sync_lock_test_and_set(&frames_completed, 0));
+    if ((0 == msg->frags_received) && (0 == msg->frags_lost)) {
+        /* nothing to report, we are not streaming */
+        delete msg;
+        return true;
+    }
+    length = write_control(msg, sizeof(*msg));
+    delete msg;
+
+    if (length <= 0) {
+        return false;
+    }
+    return true;
+}
+
+/** images kept waiting for retransmitted fragments, at most */
+const unsigned int max_late_images = 4;
+
+/** NACKs sent for an image, at most, the last covers the rest of the gaps */
+const unsigned int max_nack_ranges = 4;
+
+/** a frame or tile being put together */
+typedef struct image {
+    uint32_t frame_id;                  /** frame identifier */
+    int tile_id;                        /** tile index, nack_whole_frame for frames */
+    int cols;                           /** cols of the whole frame */
+    int rows;                           /** rows of the whole frame */
+    int x;                              /** left edge of the tile */
+    int y;                              /** top edge of the tile */
+    int tile_count;                     /** number of tiles sent for the frame */
+    bool nacked;                        /** missing fragments asked for already */
+    sentry::FragmentAssembler data;     /** fragments received so far */
+} image_st;
+
+/**
+ * Ask the server for the missing fragments of an image, once
+ *
+ * The server resends them if it still has the image and the budget, the
+ * receive thread takes them like any other fragment.
+ */
+static void
+send_nack (image_st &image)
+{
+    std::vector<std::pair<int, int> > gaps;
+    image.data.get_gaps(gaps);
+    if (gaps.size() > max_nack_ranges) {
+        std::pair<int, int> &last = gaps[max_nack_ranges - 1];
+        last.second = gaps.back().first + gaps.back().second - last.first;
+        gaps.resize(max_nack_ranges);
+    }
+
+    message_nack_st *msg = new message_nack_st;
+    memset(msg, 0, sizeof(*msg));
+    msg->type = htonl(MESSAGE_CAMERA_NACK);
+    msg->frame_id = htonl(image.frame_id);
+    msg->tile_id = htons(image.tile_id);
+    for (unsigned int i = 0; i < gaps.size(); i++) {
+        msg->frag_seq = htons(gaps[i].first);
+        msg->frag_count = htons(gaps[i].second);
+        write_control(msg, sizeof(*msg));
+    }
+    delete msg;
+    image.nacked = true;
+}
+
+/**
+ * Image a fragment belongs to, NULL if it came too late
+ *
+ * A fragment of a newer image makes it the current one. The one it replaces
+ * asks for its missing fragments if it's incomplete, and waits for them among
+ * the late images until it's complete or the oldest of too many, when its
+ * missing fragments are lost for good.
+ */
+static image_st*
+find_image (image_st &current, std::deque<image_st> &late, const uint32_t frame_id,
+            const int tile_id, bool &fresh)
+{
+    fresh = false;
+    if (current.data.is_started() && (current.frame_id == frame_id) &&
+        (current.tile_id == tile_id)) {
+        return &current;
+    }
+    for (std::deque<image_st>::iterator it = late.begin(); it != late.end(); ++it) {
+        if ((it->frame_id == frame_id) && (it->tile_id == tile_id)) {
+            return &(*it);
+        }
+    }
+    if (current.data.is_started() && ((int32_t)(frame_id - current.frame_id) < 0)) {
+        /* late fragment of an old frame */
+        return NULL;
+    }
+
+    if (current.data.is_started() && !current.data.is_complete()) {
+        if (!current.nacked) {
+            send_nack(current);
+        }
+        late.push_back(current);
+        if (late.size() > max_late_images) {
+            image_st &lost = late.front();
+            std::cout << "lost " << lost.data.get_missing() << " fragments of frame "
+                      << lost.frame_id;
+            if (nack_whole_frame != lost.tile_id) {
+                std::cout << " tile " << lost.tile_id;
+            }
+            std::cout << std::endl;
+            __sync_fetch_and_add(&frags_lost, lost.data.get_missing());
+            late.pop_front();
+        }
+    }
+
+    current.frame_id = frame_id;
+    current.tile_id = tile_id;
+    current.nacked = false;
+    fresh = true;
+    return &current;
+}
+
+/**
+ * Add a fragment to an image, returns true if it completed the image
+ *
+ * Once the last fragment of the image is in, the fragments still missing
+ * are asked for right away, without waiting for the next image.
+ */
+static bool
+add_fragment (image_st &image, const int seq, const char *payload, const int length)
+{
+    if (image.data.is_complete() || !image.data.add(seq, payload, length)) {
+        return false;
+    }
+    __sync_fetch_and_add(&frags_received, 1);
+
+    if (image.data.is_complete()) {
+        return true;
+    }
+    if ((seq == image.data.get_count()) && !image.nacked) {
+        send_nack(image);
+    }
+    return false;
+}
+
+/**
+ * Forget a late image once it's complete
+ */
+static void
+retire_image (std::deque<image_st> &late, const image_st *image)
+{
+    for (std::deque<image_st>::iterator it = late.begin(); it != late.end(); ++it) {
+        if (&(*it) == image) {
+            late.erase(it);
+            return;
+        }
+    }
+}
+
 /**
  * Decode frame data
+ *
+ * Fragments are placed by their sequence number, so reordered fragments are
+ * fine, and the ones lost are recovered from the parity fragments, if the
+ * server sends any, or asked for again. A frame is displayed once all of its
+ * fragments are in, unless a newer frame was displayed already.
  */
 static void
 decode_frame_data (const message_frame_st *frame_msg)
 {
-    static int frame_size = ntohl(frame_msg->frame_size);
-    static int cols = ntohs(frame_msg->cols);
-    static int rows = ntohs(frame_msg->rows);
-    static int received_bytes = 0;
-    static char framebuf[262140];
-    static int frag_seq = ntohs(frame_msg->frag_seq);
-    static bool force_resync = false;
-
-    int curr_seq = ntohs(frame_msg->frag_seq);
-    if (1 == curr_seq) {
-        /* reset static vars */
-        frame_size = ntohl(frame_msg->frame_size);
-        cols = ntohs(frame_msg->cols);
-        rows = ntohs(frame_msg->rows);
-        received_bytes = 0;
-        frag_seq = curr_seq;
-        force_resync = false;
-    } else if (force_resync) {
-        /* skip until we get a new frame */
+    static image_st current;
+    static std::deque<image_st> late;
+    static uint32_t shown_id = 0;
+
+    bool fresh;
+    image_st *frame = find_image(current, late, ntohl(frame_msg->frame_id),
+                                 nack_whole_frame, fresh);
+    if (NULL == frame) {
         return;
     }
-
-    if (curr_seq != frag_seq) {
-        std::cout << "wrong sequence " << curr_seq << ", expected "
-                  << frag_seq << std::endl;
-        if (curr_seq > frag_seq) {
-            /* we lost a few fragments, skip the corresponding data in buffer */
-            received_bytes += max_buf_size * (curr_seq - frag_seq);
-            frag_seq = curr_seq;
-        } else {
-            /* we either lost a lot of fragments or got an old one */
-            force_resync = true;
-            return;
+    if (fresh) {
+        /* start the new frame */
+        frame->cols = ntohs(frame_msg->cols);
+        frame->rows = ntohs(frame_msg->rows);
+        if (!zoomed && (frame->cols > 0) && (frame->rows > 0)) {
+            full_cols = frame->cols;
+            full_rows = frame->rows;
         }
+        frame->data.start(std::min((int)ntohl(frame_msg->frame_size), max_image_size),
+                          frag_size, parity_code);
     }
 
-    /* copy frame data */
-    int frag_size = ntohs(frame_msg->frag_size);
-    memcpy(&framebuf[received_bytes], frame_msg->frame, frag_size);
-    received_bytes += frag_size;
-    frag_seq++;
+    /* copy fragment data, unless it's a duplicate */
+    if (!add_fragment(*frame, ntohs(frame_msg->frag_seq), frame_msg->frame,
+                      ntohs(frame_msg->frag_size))) {
+        return;
+    }
 
-    /* display frame if it's ready */
-    if (received_bytes == frame_size) {
-        /* decrypt frame with the secret key */
-        int k = 0;
-        for (int i = 0; i < received_bytes; i++) {
-            framebuf[i] ^= key[k++];
-            if (k >= max_buf_size) {
-                k = 0;
-            }
+    /* decrypt frame with the secret key */
+    char *framebuf = frame->data.get_data();
+    int frame_size = frame->data.get_size();
+    int k = 0;
+    for (int i = 0; i < frame_size; i++) {
+        framebuf[i] ^= key[k++];
+        if (k >= key_size) {
+            k = 0;
         }
+    }
 
+    if ((0 == shown_id) || ((int32_t)(frame->frame_id - shown_id) > 0)) {
         /*
          * Display the image, the window is opened/closed by the main thread,
          * thus it could happen that it's already closed when we try to show
          * the frame imshow returns error in that case, which we can safely
          * ignore
          */
-        cv::Mat frame = cv::imdecode(cv::Mat(rows, cols, CV_8UC3, framebuf), -1);
-        if (frame.rows > 0 && frame.cols > 0) {
-            imshow(cam_window_name.str(), frame);
+        cv::Mat image = cv::imdecode(cv::Mat(frame->rows, frame->cols, CV_8UC3, framebuf), -1);
+        if (image.rows > 0 && image.cols > 0) {
+            imshow(cam_window_name.str(), image);
+            canvas = image;
+        }
+        shown_id = frame->frame_id;
+        __sync_fetch_and_add(&frames_completed, 1);
+        std::cout << time(NULL) << ": received frame " << frame->frame_id << ", size "
+                  << frame_size << " (" << frame->cols << "x" << frame->rows << ")";
+        if (frame->data.get_recovered() > 0) {
+            std::cout << ", " << frame->data.get_recovered() << " fragments recovered";
+        }
+        if (frame != &current) {
+            std::cout << ", retransmitted";
+        }
+        std::cout << std::endl;
+    } else {
+        std::cout << "frame " << frame->frame_id << " completed after frame "
+                  << shown_id << ", not displayed" << std::endl;
+    }
+
+    if (frame != &current) {
+        retire_image(late, frame);
+    }
+}
+
+/**
+ * Decode tile data
+ *
+ * Tiles are reassembled the same way as frames, one tile at a time, then drawn
+ * onto the canvas, unless a newer tile was drawn in their place already. The
+ * canvas is displayed once every tile of the frame has arrived, and again for
+ * each tile that completed late; tiles that don't fit the canvas (e.g. we
+ * missed the keyframe after a resolution change) are dropped, the server
+ * sends a new keyframe when we report the loss.
+ */
+static void
+decode_tile_data (const message_tile_st *tile_msg)
+{
+    static image_st current;
+    static std::deque<image_st> late;
+    static uint32_t frame_id = 0;
+    static int tiles_done = 0;
+    static std::map<std::pair<int, int>, uint32_t> drawn;
+
+    bool fresh;
+    image_st *tile = find_image(current, late, ntohl(tile_msg->frame_id),
+                                ntohs(tile_msg->tile_id), fresh);
+    if (NULL == tile) {
+        return;
+    }
+    if (fresh) {
+        /* start the new tile */
+        tile->cols = ntohs(tile_msg->cols);
+        tile->rows = ntohs(tile_msg->rows);
+        tile->x = ntohs(tile_msg->x);
+        tile->y = ntohs(tile_msg->y);
+        tile->tile_count = ntohs(tile_msg->tile_count);
+        tile->data.start(std::min((int)ntohl(tile_msg->tile_size), max_image_size),
+                         frag_size, parity_code);
+    }
+
+    /* copy fragment data, unless it's a duplicate */
+    if (!add_fragment(*tile, ntohs(tile_msg->frag_seq), tile_msg->tile,
+                      ntohs(tile_msg->frag_size))) {
+        return;
+    }
+
+    /* decrypt tile with the secret key */
+    char *tilebuf = tile->data.get_data();
+    int tile_size = tile->data.get_size();
+    int k = 0;
+    for (int i = 0; i < tile_size; i++) {
+        tilebuf[i] ^= key[k++];
+        if (k >= key_size) {
+            k = 0;
         }
-        std::cout << time(NULL) << ": received frame, size " << received_bytes << std::endl;
+    }
+
+    /* draw it onto the canvas */
+    std::pair<int, int> spot(tile->x, tile->y);
+    std::map<std::pair<int, int>, uint32_t>::iterator it = drawn.find(spot);
+    if ((drawn.end() == it) || ((int32_t)(tile->frame_id - it->second) >= 0)) {
+        cv::Mat image = cv::imdecode(cv::Mat(1, tile_size, CV_8UC1, tilebuf), -1);
+        if ((canvas.cols == tile->cols) && (canvas.rows == tile->rows) &&
+            (image.type() == canvas.type()) && (tile->x + image.cols <= canvas.cols) &&
+            (tile->y + image.rows <= canvas.rows)) {
+            image.copyTo(canvas(cv::Rect(tile->x, tile->y, image.cols, image.rows)));
+            drawn[spot] = tile->frame_id;
+        }
+    }
+
+    /* display the canvas if the frame is complete, or a late tile came in */
+    if ((0 == frame_id) || ((int32_t)(tile->frame_id - frame_id) > 0)) {
+        frame_id = tile->frame_id;
+        tiles_done = 0;
+    }
+    if (tile->frame_id != frame_id) {
+        if (canvas.rows > 0 && canvas.cols > 0) {
+            imshow(cam_window_name.str(), canvas);
+        }
+        std::cout << time(NULL) << ": received tile " << tile->tile_id << " of frame "
+                  << tile->frame_id << ", retransmitted" << std::endl;
+    } else if (++tiles_done == tile->tile_count) {
+        if (canvas.rows > 0 && canvas.cols > 0) {
+            imshow(cam_window_name.str(), canvas);
+        }
+        __sync_fetch_and_add(&frames_completed, 1);
+        std::cout << time(NULL) << ": received " << tiles_done << " tiles of frame "
+                  << frame_id << std::endl;
+    }
+
+    if (tile != &current) {
+        retire_image(late, tile);
     }
 }
 
@@ -239,12 +745,25 @@ recv_thread (void *arg)
             break;
         }
 
+        case MESSAGE_CAMERA_TILE: {
+            message_tile_st *tile_msg = reinterpret_cast<message_tile_st*>(msg);
+            decode_tile_data(tile_msg);
+            break;
+        }
+
         case MESSAGE_SENSOR_DATA: {
             message_sensor_st *sensor_msg = reinterpret_cast<message_sensor_st*>(msg);
             decode_sensor_data(sensor_msg);
             break;
         }
 
+        case MESSAGE_DETECTION: {
+            message_detection_st *detection_msg =
+                reinterpret_cast<message_detection_st*>(msg);
+            decode_detection(detection_msg, length);
+            break;
+        }
+
         default:
             std::cout << "unknown message, type " << message_type_str(type)
                       << ", length " << length << std::endl;
@@ -265,6 +784,7 @@ heartbeat_thread (void *arg)
 
     while (true) {
         send_command(MESSAGE_HEARTBEAT);
+        send_report();
         sleep(1);
     }
 
@@ -420,6 +940,9 @@ wait_for_credentials ()
         } else {
             client_id = ntohl(msg->id);
             memcpy(otp, msg->otp, sizeof(msg->otp));
+            if (ntohs(msg->frag_size) > 0) {
+                frag_size = std::min((int)ntohs(msg->frag_size), max_frag_size);
+            }
             std::cout << "received client credentials, ID "
                       << client_id << std::endl;
         }
@@ -468,6 +991,26 @@ open_data_socket (char *server, char *port)
     }
 }
 
+/**
+ * Largest fragment payload that fits the path MTU to the server
+ *
+ * Leaves room for the IP, UDP and the largest fragment header, and asks for
+ * no more than the server supports.
+ */
+static int
+path_frag_size ()
+{
+    int mtu = 0;
+    socklen_t length = sizeof(mtu);
+    if (getsockopt(data_socket, IPPROTO_IP, IP_MTU, &mtu, &length) < 0) {
+        std::cout << "unable to find the path MTU, asking for "
+                  << default_frag_size << " byte fragments" << std::endl;
+        return default_frag_size;
+    }
+    int size = mtu - 28 - (int)(sizeof(message_tile_st) - max_frag_size);
+    return std::max(default_frag_size, std::min(size, frag_size));
+}
+
 /**
  * Wait for key from server
  */
@@ -481,6 +1024,7 @@ wait_for_key ()
         msg->type = htonl(MESSAGE_NETCOM_CONNECT);
         msg->id = htonl(client_id);
         memcpy(msg->otp, otp, sizeof(otp));
+        msg->frag_size = htons(path_frag_size());
 
         while (0 == key[0]) {
             std::cout << "sending client credentials to server" << std::endl;
@@ -496,8 +1040,17 @@ wait_for_key ()
                     std::cout << "message is NOT key, type "
                               << message_type_str(type) << std::endl;
                 } else {
-                    std::cout << "received key" << std::endl;
                     memcpy(key, key_msg->key, sizeof(key_msg->key));
+                    frag_size = ntohs(key_msg->frag_size);
+                    if ((frag_size <= 0) || (frag_size > max_frag_size)) {
+                        frag_size = default_frag_size;
+                    }
+                    parity_code = sentry::ParityCode(ntohs(key_msg->fec_group),
+                                                     ntohs(key_msg->fec_parity));
+                    std::cout << "received key, " << frag_size
+                              << " byte fragments, " << parity_code.get_parity()
+                              << " parity per " << parity_code.get_group()
+                              << " fragments" << std::endl;
                 }
             }
         }
@@ -522,11 +1075,21 @@ main (int argc, char *argv[])
     /* block ctrl+c (FIXME: pthread safe signal handling) */
     signal(SIGINT, signal_callback);
 
-    /* we are expecting 3 arguments */
-    if (argc != 4) {
-        std::cout << "usage: " << argv[0] << " <hostname> <portnum> <cid>" << std::endl;
+    /* we are expecting 3 arguments, plus the optional frame rate, tier and mode */
+    if ((argc < 4) || (argc > 7)) {
+        std::cout << "usage: " << argv[0]
+                  << " <hostname> <portnum> <cid> [fps] [tier] [tiles]" << std::endl;
         exit(EXIT_FAILURE);
     }
+    if (argc >= 5) {
+        stream_fps = atoi(argv[4]);
+    }
+    if (argc >= 6) {
+        stream_tier = atoi(argv[5]);
+    }
+    if ((argc >= 7) && (std::string("tiles") == argv[6])) {
+        stream_mode = STREAM_MODE_TILES;
+    }
 
     /* save the args */
     char *server = argv[1];
@@ -570,6 +1133,12 @@ main (int argc, char *argv[])
               << "  f      rotate camera up" << std::endl
               << "  v      rotate camera down" << std::endl
               << "  c      start/stop camera stream" << std::endl
+              << "  p      request a single still" << std::endl
+              << "  b      request the pre-event ring (arrives as camera frames)" << std::endl
+              << "  e      dump the pre-event ring to the server's disk" << std::endl
+              << "  o      zoom into the middle of the picture, or back out" << std::endl
+              << "  h      subscribe to/unsubscribe from people detection events" << std::endl
+              << "  m      switch the capture mode between 640x480 and 1280x720" << std::endl
               << "  r      send a remote controller search command" << std::endl
               << "  z      send a sensor data request message" << std::endl
               << "  t      send a server terminate command" << std::endl
@@ -621,7 +1190,51 @@ main (int argc, char *argv[])
         case 'c': {
             std::cout << "sending stream command, window "
                       << cam_window_name.str() << std::endl;
-            loop = send_command(MESSAGE_CAMERA_REQUEST);
+            loop = send_camera_request();
+            break;
+        }
+
+        case 'p': {
+            std::cout << "sending snapshot request, window "
+                      << cam_window_name.str() << std::endl;
+            loop = send_snapshot_request();
+            break;
+        }
+
+        case 'b': {
+            std::cout << "requesting the pre-event ring, window "
+                      << cam_window_name.str() << std::endl;
+            loop = send_ring_dump(RING_TARGET_CLIENT);
+            break;
+        }
+
+        case 'e': {
+            std::cout << "dumping the pre-event ring on the server" << std::endl;
+            loop = send_ring_dump(RING_TARGET_DISK);
+            break;
+        }
+
+        case 'o': {
+            zoomed = !zoomed;
+            std::cout << (zoomed ? "zooming into the middle of the picture" :
+                          "zooming out to the whole picture") << std::endl;
+            loop = send_roi_request(zoomed);
+            break;
+        }
+
+        case 'h': {
+            detecting = !detecting;
+            std::cout << (detecting ? "subscribing to" : "unsubscribing from")
+                      << " detection events" << std::endl;
+            loop = send_detection_subscribe(detecting);
+            break;
+        }
+
+        case 'm': {
+            high_definition = !high_definition;
+            std::cout << "switching the capture mode to "
+                      << (high_definition ? "1280x720" : "640x480") << std::endl;
+            loop = send_mode_request(high_definition);
             break;
         }
 
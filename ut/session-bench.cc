@@ -0,0 +1,304 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * session-bench.cc
+ *
+ * Session table benchmark and churn test
+ *
+ * Compares the lookup and broadcast cost of the session table with a mutex
+ * protected std::map, the way clients used to be kept, then churns sessions
+ * while reader threads look them up, and checks that no reader ever sees a
+ * freed or mismatched session. Args:
+ *   sessions   (optional) number of sessions, 100, 300 and 900 if omitted
+ *   readers    (optional) number of reader threads for the churn test, 3 if omitted
+ *   seconds    (optional) length of the churn test, 5 if omitted
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <iostream>
+#include <cstdlib>
+#include <map>
+#include <time.h>
+#include <vector>
+
+#include "session.h"
+
+/** marks a session made by the benchmark */
+const int canary = 0x5e55;
+
+/** lookups per measurement */
+const int lookups = 1000000;
+
+/** broadcasts per measurement */
+const int broadcasts = 10000;
+
+/** ids of the live sessions of the churn test, 0 if the slot is unused */
+static std::atomic<uint32_t> *live;
+
+/** size of the live array */
+static unsigned int live_size;
+
+/** churn test state */
+static std::atomic<bool> churning;
+static std::atomic<unsigned long> reads;
+static std::atomic<unsigned long> errors;
+
+/**
+ * Milliseconds elapsed since begin
+ */
+static double
+elapsed (const struct timespec &begin)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - begin.tv_sec) * 1e3 + (end.tv_nsec - begin.tv_nsec) / 1e6;
+}
+
+/**
+ * New session with the canary set
+ */
+static sentry::session_st*
+make_session (void)
+{
+    sentry::session_st *session = new sentry::session_st;
+    session->sd = -1;
+    session->ssl = NULL;
+    session->uplink_sd = canary;
+    session->uplink = NULL;
+    return session;
+}
+
+/**
+ * Lookup and broadcast cost of the session table and of a locked map
+ */
+static void
+measure (const int count)
+{
+    sentry::SessionTable table(count);
+    std::map<int, sentry::session_st*> map;
+    pthread_mutex_t mutex;
+    pthread_mutex_init(&mutex, NULL);
+    std::vector<uint32_t> ids;
+    for (int i = 0; i < count; i++) {
+        sentry::session_st *session = make_session();
+        ids.push_back(table.insert(session));
+        map[ids.back()] = session;
+    }
+    srand(1);
+    std::vector<uint32_t> order;
+    for (int i = 0; i < lookups; i++) {
+        order.push_back(ids[rand() % count]);
+    }
+
+    /* the sum keeps the compiler from dropping the loops */
+    unsigned long sum = 0;
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int i = 0; i < lookups; i++) {
+        int idx = table.read_lock();
+        sum += table.lookup(order[i])->uplink_sd;
+        table.read_unlock(idx);
+    }
+    double table_lookup = elapsed(begin);
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int i = 0; i < lookups; i++) {
+        pthread_mutex_lock(&mutex);
+        sum += map.find(order[i])->second->uplink_sd;
+        pthread_mutex_unlock(&mutex);
+    }
+    double map_lookup = elapsed(begin);
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int i = 0; i < broadcasts; i++) {
+        int idx = table.read_lock();
+        unsigned int slot = 0;
+        sentry::session_st *session;
+        while (NULL != (session = table.next(slot))) {
+            sum += session->uplink_sd;
+        }
+        table.read_unlock(idx);
+    }
+    double table_broadcast = elapsed(begin);
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int i = 0; i < broadcasts; i++) {
+        pthread_mutex_lock(&mutex);
+        std::map<int, sentry::session_st*>::iterator it;
+        for (it = map.begin(); it != map.end(); ++it) {
+            sum += it->second->uplink_sd;
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+    double map_broadcast = elapsed(begin);
+    pthread_mutex_destroy(&mutex);
+
+    std::cout << count << " sessions: lookup " << table_lookup * 1e6 / lookups
+              << " ns (locked map " << map_lookup * 1e6 / lookups << " ns), broadcast "
+              << table_broadcast * 1e3 / broadcasts << " us (locked map "
+              << map_broadcast * 1e3 / broadcasts << " us)" << (sum ? "" : " ")
+              << std::endl;
+}
+
+/**
+ * Reader thread of the churn test
+ *
+ * Looks up random live sessions, and walks through all of them now and then,
+ * checking every session it sees.
+ */
+static void*
+reader (void *args)
+{
+    sentry::SessionTable *table = reinterpret_cast<sentry::SessionTable*>(args);
+    unsigned int seed = (unsigned long)pthread_self();
+    unsigned long count = 0;
+
+    while (churning.load()) {
+        uint32_t id = live[rand_r(&seed) % live_size].load();
+        int idx = table->read_lock();
+        sentry::session_st *session = table->lookup(id);
+        if ((NULL != session) && ((session->id != id) || (canary != session->uplink_sd))) {
+            errors++;
+        }
+        if (0 == (++count % 64)) {
+            unsigned int slot = 0;
+            while (NULL != (session = table->next(slot))) {
+                if ((canary != session->uplink_sd) ||
+                    ((session->id & (live_size - 1)) != slot - 1)) {
+                    errors++;
+                }
+            }
+        }
+        table->read_unlock(idx);
+    }
+
+    reads += count;
+    return NULL;
+}
+
+/**
+ * Churn test: add and remove sessions while the readers look them up
+ */
+static bool
+churn (const int count, const int readers, const int seconds)
+{
+    sentry::SessionTable table(count);
+    live_size = 1;
+    while (live_size < (unsigned int)count) {
+        live_size <<= 1;
+    }
+    live = new std::atomic<uint32_t>[live_size];
+    for (unsigned int i = 0; i < live_size; i++) {
+        live[i].store(0);
+    }
+    for (int i = 0; i < count / 2; i++) {
+        uint32_t id = table.insert(make_session());
+        live[id & (live_size - 1)].store(id);
+    }
+
+    churning = true;
+    reads = 0;
+    errors = 0;
+    std::vector<pthread_t> threads(readers);
+    for (int i = 0; i < readers; i++) {
+        pthread_create(&threads[i], NULL, reader, &table);
+    }
+
+    /* keep between a quarter and all of the slots busy */
+    unsigned long inserts = 0;
+    unsigned long removes = 0;
+    double remove_msec = 0;
+    unsigned int seed = 1;
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    while (elapsed(begin) < seconds * 1000.0) {
+        unsigned int used = table.get_count();
+        bool add = (used < live_size / 4) ||
+                   ((used < live_size) && (rand_r(&seed) % 2));
+        if (add) {
+            uint32_t id = table.insert(make_session());
+            live[id & (live_size - 1)].store(id);
+            inserts++;
+            continue;
+        }
+        unsigned int slot = rand_r(&seed) % live_size;
+        uint32_t id = live[slot].load();
+        if (0 == id) {
+            continue;
+        }
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (table.remove(id)) {
+            remove_msec += elapsed(start);
+            removes++;
+        }
+    }
+
+    churning = false;
+    for (int i = 0; i < readers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    delete [] live;
+
+    std::cout << "churn, " << live_size << " slots, " << readers << " readers, "
+              << seconds << " s: " << inserts << " inserts, " << removes
+              << " removes (" << (removes ? remove_msec * 1e3 / removes : 0)
+              << " us each, with the grace period), " << reads.load() << " reads, "
+              << errors.load() << " errors" << std::endl;
+    return (0 == errors.load());
+}
+
+/**
+ * Main
+ */
+int
+main (int argc, char *argv[])
+{
+    if (argc > 4) {
+        std::cout << "usage: " << argv[0] << " [sessions] [readers] [seconds]" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::vector<int> counts;
+    if ((argc >= 2) && (atoi(argv[1]) > 0)) {
+        counts.push_back(atoi(argv[1]));
+    } else {
+        counts.push_back(100);
+        counts.push_back(300);
+        counts.push_back(900);
+    }
+    int readers = (argc >= 3) ? atoi(argv[2]) : 3;
+    if (readers <= 0) {
+        readers = 3;
+    }
+    int seconds = (argc >= 4) ? atoi(argv[3]) : 5;
+    if (seconds <= 0) {
+        seconds = 5;
+    }
+
+    for (unsigned int i = 0; i < counts.size(); i++) {
+        measure(counts[i]);
+    }
+
+    bool ok = true;
+    for (unsigned int i = 0; i < counts.size(); i++) {
+        ok = churn(counts[i], readers, seconds) && ok;
+    }
+
+    std::cout << (ok ? "churn test passed" : "churn test FAILED") << std::endl;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,270 @@
+/*
+ *------------------------------------------------------------------------------
+ *
+ * uplink-bench.cc
+ *
+ * Uplink transmit mode benchmark
+ *
+ * Streams a synthetic image over loopback to 1, 4 and 16 clients, each with
+ * its own sender thread like the uplinks, in every transmit mode: one by one,
+ * batched, segmentation offload and zerocopy. Each client's receiver counts
+ * what arrives. Prints the throughput sent and received, the send calls and
+ * the sender CPU time per image. Args:
+ *   seconds    (optional) length of each measurement, 2 if omitted
+ *   size       (optional) image size in KB, 40 if omitted
+ *   frag       (optional) fragment payload size, 512 if omitted
+ *
+ * Zerocopy over loopback is copied by the kernel, so the zerocopy senders
+ * turn into segmenting ones after the first completions, as they would with
+ * a real client on the same host.
+ *
+ * Copyright (c) 2017 Zoltan Toth <ztoth AT thetothfamily DOT net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ *
+ *------------------------------------------------------------------------------
+ */
+#include <iostream>
+#include <cstdlib>
+#include <atomic>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <vector>
+
+#include "sender.h"
+
+/** a transmit mode to measure */
+typedef struct bench_mode {
+    const char *name;             /** name printed */
+    sentry::transmit_mode_en mode;   /** transmit mode asked for */
+    int batch;                    /** fragments per sendmmsg call */
+} bench_mode_st;
+
+/** modes measured, slowest first */
+static const bench_mode_st modes[] = {
+    { "one by one", sentry::TRANSMIT_MODE_BATCH,    0  },
+    { "batch",      sentry::TRANSMIT_MODE_BATCH,    64 },
+    { "gso",        sentry::TRANSMIT_MODE_GSO,      64 },
+    { "zerocopy",   sentry::TRANSMIT_MODE_ZEROCOPY, 64 },
+};
+
+/** a client: its receiver, and the uplink sender streaming to it */
+typedef struct bench_client {
+    int sd;                                /** receiver socket */
+    struct sockaddr_storage addr;          /** receiver address */
+    unsigned char key[key_size];           /** client specific key */
+    sentry::FragmentSender *sender;        /** sender of the client */
+    pthread_t receiver_thrd;               /** receiver thread */
+    pthread_t sender_thrd;                 /** sender thread */
+    unsigned long received;                /** bytes received */
+    unsigned long images;                  /** images sent */
+    double cpu_msec;                       /** CPU time of the sender thread */
+} bench_client_st;
+
+/** the image every sender streams */
+static std::vector<unsigned char> image;
+
+/** fragment payload size */
+static int frag_size = default_frag_size;
+
+/** benchmark state */
+static std::atomic<bool> sending;
+static std::atomic<bool> receiving;
+
+/**
+ * Milliseconds elapsed since begin on the given clock
+ */
+static double
+elapsed (const struct timespec &begin, const clockid_t clock)
+{
+    struct timespec end;
+    clock_gettime(clock, &end);
+    return (end.tv_sec - begin.tv_sec) * 1e3 + (end.tv_nsec - begin.tv_nsec) / 1e6;
+}
+
+/**
+ * Receiver thread, counts the bytes that arrive
+ */
+static void*
+receiver (void *args)
+{
+    bench_client_st *client = reinterpret_cast<bench_client_st*>(args);
+    char buf[2048];
+    while (receiving.load()) {
+        ssize_t length = recv(client->sd, buf, sizeof(buf), 0);
+        if (length > 0) {
+            client->received += length;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Sender thread, streams the image as fast as it goes
+ */
+static void*
+sender (void *args)
+{
+    bench_client_st *client = reinterpret_cast<bench_client_st*>(args);
+    message_frame_st *msg = new message_frame_st;
+    struct timespec begin;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &begin);
+    uint32_t seq = 0;
+    while (sending.load()) {
+        msg->type = htonl(MESSAGE_CAMERA_FRAME);
+        msg->frame_id = htonl(++seq);
+        msg->frame_size = htonl(image.size());
+        msg->cols = htons(640);
+        msg->rows = htons(480);
+        client->sender->send(msg, msg->frame, image);
+        client->images++;
+    }
+    client->cpu_msec = elapsed(begin, CLOCK_THREAD_CPUTIME_ID);
+    delete msg;
+    return NULL;
+}
+
+/**
+ * Stream to the given number of clients in the given mode
+ */
+static void
+measure (const bench_mode_st &mode, const int count, const int seconds)
+{
+    /* the server socket, its port is shared by the segmenting senders */
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(server);
+    int on = 1;
+    int server_sd = socket(AF_INET, SOCK_DGRAM, 0);
+    setsockopt(server_sd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    bind(server_sd, (struct sockaddr*)&server, sizeof(server));
+    getsockname(server_sd, (struct sockaddr*)&server, &length);
+
+    std::vector<bench_client_st> clients(count);
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 100000;
+    int rcvbuf = 4 * 1024 * 1024;
+    for (int i = 0; i < count; i++) {
+        bench_client_st &client = clients[i];
+        struct sockaddr_in local;
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        length = sizeof(local);
+        client.sd = socket(AF_INET, SOCK_DGRAM, 0);
+        setsockopt(client.sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        setsockopt(client.sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        bind(client.sd, (struct sockaddr*)&local, sizeof(local));
+        getsockname(client.sd, (struct sockaddr*)&local, &length);
+        connect(client.sd, (struct sockaddr*)&server, sizeof(server));
+        memset(&client.addr, 0, sizeof(client.addr));
+        memcpy(&client.addr, &local, sizeof(local));
+        for (int k = 0; k < key_size; k++) {
+            client.key[k] = rand();
+        }
+        client.sender = new sentry::FragmentSender("bench", server_sd, client.addr,
+                                                   client.key, frag_size, mode.mode,
+                                                   mode.batch, ntohs(server.sin_port));
+        client.received = 0;
+        client.images = 0;
+        client.cpu_msec = 0;
+    }
+
+    receiving = true;
+    sending = true;
+    for (int i = 0; i < count; i++) {
+        pthread_create(&clients[i].receiver_thrd, NULL, receiver, &clients[i]);
+        pthread_create(&clients[i].sender_thrd, NULL, sender, &clients[i]);
+    }
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    sleep(seconds);
+    sending = false;
+    for (int i = 0; i < count; i++) {
+        pthread_join(clients[i].sender_thrd, NULL);
+    }
+    double msec = elapsed(begin, CLOCK_MONOTONIC);
+    usleep(200000);
+    receiving = false;
+
+    unsigned long images = 0;
+    unsigned long received = 0;
+    double cpu_msec = 0;
+    const char *fallback = "";
+    for (int i = 0; i < count; i++) {
+        bench_client_st &client = clients[i];
+        pthread_join(client.receiver_thrd, NULL);
+        images += client.images;
+        received += client.received;
+        cpu_msec += client.cpu_msec;
+        if (client.sender->get_mode() != mode.mode) {
+            fallback = " (fell back)";
+        }
+        delete client.sender;
+        close(client.sd);
+    }
+    close(server_sd);
+
+    int frags = (image.size() + frag_size - 1) / frag_size;
+    int hdr_size = sizeof(message_frame_st) - max_frag_size;
+    double sent = (double)images * (image.size() + frags * hdr_size);
+    std::cout << mode.name << fallback << ", " << count << " clients: "
+              << sent / msec / 1e3 << " MB/s sent, " << received / msec / 1e3
+              << " MB/s received, " << images * 1e3 / msec << " images/s, "
+              << (images ? cpu_msec * 1e3 / images : 0) << " us CPU per image"
+              << std::endl;
+}
+
+/**
+ * Main
+ */
+int
+main (int argc, char *argv[])
+{
+    if (argc > 4) {
+        std::cout << "usage: " << argv[0] << " [seconds] [size] [frag]" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    int seconds = (argc >= 2) ? atoi(argv[1]) : 2;
+    if (seconds <= 0) {
+        seconds = 2;
+    }
+    int size = (argc >= 3) ? atoi(argv[2]) : 40;
+    if (size <= 0) {
+        size = 40;
+    }
+    if ((argc >= 4) && (atoi(argv[3]) > 0)) {
+        frag_size = std::min(atoi(argv[3]), max_frag_size);
+    }
+
+    srand(1);
+    image.resize(size * 1024);
+    for (unsigned int i = 0; i < image.size(); i++) {
+        image[i] = rand();
+    }
+
+    const int counts[] = { 1, 4, 16 };
+    for (unsigned int m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        for (unsigned int c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+            measure(modes[m], counts[c], seconds);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}